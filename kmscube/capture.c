@@ -0,0 +1,517 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/dma-buf.h>
+
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
+
+#include "capture.h"
+#include "common.h"
+#include "spsc-queue.h"
+
+#define CAPTURE_BUFFERS 4
+
+enum capture_format {
+	CAPTURE_RAW,
+	CAPTURE_Y4M,
+	CAPTURE_PNG,
+};
+
+enum capture_state {
+	CAPTURE_FREE,        /* can be copied into */
+	CAPTURE_COPYING,     /* gpu copy in flight, fence not signaled yet */
+	CAPTURE_WRITING,     /* handed to the writer thread */
+};
+
+struct capture_buf {
+	struct gbm_bo *bo;
+	struct framebuffer fb;
+	int dmabuf_fd;
+	void *map;
+	size_t size;
+	uint32_t stride;
+	EGLSyncKHR fence;
+	unsigned frame;
+	enum capture_state state;    /* CAPTURE_WRITING -> FREE by the writer */
+};
+
+static struct {
+	const char *filename;
+	enum capture_format format;
+	FILE *fp;
+	unsigned width, height;
+	/* a window surface is bottom-up compared to a plain fbo: */
+	bool flip;
+	bool use_fences;
+
+	struct capture_buf bufs[CAPTURE_BUFFERS];
+	unsigned next;           /* next buffer to copy into */
+	unsigned oldest;         /* oldest buffer with a copy in flight */
+
+	/* render thread -> writer thread: */
+	struct spsc_queue queue;
+	int efd;
+	pthread_t thread;
+	bool quit;
+	bool failed;
+
+	/* tightly packed copy of a frame, owned by the writer: */
+	uint8_t *pixels;
+
+	unsigned captured, dropped, written;
+} capture = {
+	.efd = -1,
+};
+
+static void wake_writer(void)
+{
+	uint64_t one = 1;
+
+	if (write(capture.efd, &one, sizeof(one)) < 0)
+		printf("failed to wake capture writer: %s\n", strerror(errno));
+}
+
+/* BT.601, limited range: */
+static inline uint8_t rgb_to_y(const uint8_t *p)
+{
+	return ((66 * p[0] + 129 * p[1] + 25 * p[2] + 128) >> 8) + 16;
+}
+
+static inline uint8_t rgb_to_u(const uint8_t *p)
+{
+	return ((-38 * p[0] - 74 * p[1] + 112 * p[2] + 128) >> 8) + 128;
+}
+
+static inline uint8_t rgb_to_v(const uint8_t *p)
+{
+	return ((112 * p[0] - 94 * p[1] - 18 * p[2] + 128) >> 8) + 128;
+}
+
+/* Copy the frame out of the (uncached) mapping in one go, top row first,
+ * so the conversion and the file io don't hold the dma-buf:
+ */
+static int read_frame(struct capture_buf *buf)
+{
+	struct dma_buf_sync sync = {
+		.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ,
+	};
+	unsigned pitch = capture.width * 4;
+
+	if (ioctl(buf->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync) < 0) {
+		printf("failed to sync capture buffer: %s\n", strerror(errno));
+		return -1;
+	}
+
+	for (unsigned y = 0; y < capture.height; y++) {
+		unsigned row = capture.flip ? capture.height - y - 1 : y;
+		memcpy(capture.pixels + y * pitch,
+				(uint8_t *)buf->map + row * buf->stride, pitch);
+	}
+
+	sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+	ioctl(buf->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+	return 0;
+}
+
+static int write_y4m(void)
+{
+	unsigned n = capture.width * capture.height;
+	uint8_t *planes = capture.pixels + n * 4;
+
+	/* convert into the planes which follow the rgba copy: */
+	for (unsigned i = 0; i < n; i++) {
+		const uint8_t *p = capture.pixels + i * 4;
+		planes[i] = rgb_to_y(p);
+		planes[n + i] = rgb_to_u(p);
+		planes[2 * n + i] = rgb_to_v(p);
+	}
+
+	if (fputs("FRAME\n", capture.fp) < 0 ||
+	    fwrite(planes, 3, n, capture.fp) != n)
+		return -1;
+
+	return 0;
+}
+
+#ifdef HAVE_LIBPNG
+static int write_png(unsigned frame)
+{
+	png_structp png;
+	png_infop info;
+	png_bytep rows[capture.height];
+	char name[256];
+	FILE *fp;
+
+	snprintf(name, sizeof(name), capture.filename, frame);
+	fp = fopen(name, "wb");
+	if (!fp)
+		return -1;
+
+	png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	info = png_create_info_struct(png);
+	if (setjmp(png_jmpbuf(png))) {
+		png_destroy_write_struct(&png, &info);
+		fclose(fp);
+		return -1;
+	}
+
+	png_init_io(png, fp);
+	/* speed over size, this runs once per frame: */
+	png_set_compression_level(png, 1);
+	png_set_IHDR(png, info, capture.width, capture.height, 8,
+			PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
+			PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	png_write_info(png, info);
+
+	for (unsigned y = 0; y < capture.height; y++)
+		rows[y] = capture.pixels + y * capture.width * 4;
+
+	png_write_image(png, rows);
+	png_write_end(png, NULL);
+	png_destroy_write_struct(&png, &info);
+
+	return fclose(fp);
+}
+#endif
+
+static int write_frame(struct capture_buf *buf)
+{
+	unsigned pitch = capture.width * 4;
+
+	if (read_frame(buf))
+		return -1;
+
+	switch (capture.format) {
+	case CAPTURE_Y4M:
+		return write_y4m();
+#ifdef HAVE_LIBPNG
+	case CAPTURE_PNG:
+		return write_png(buf->frame);
+#endif
+	default:
+		if (fwrite(capture.pixels, pitch, capture.height, capture.fp) != capture.height)
+			return -1;
+		return 0;
+	}
+}
+
+static void *writer_thread(void *arg)
+{
+	(void)arg;
+
+	for (;;) {
+		struct capture_buf *buf = spsc_queue_pop(&capture.queue);
+		uint64_t val;
+
+		if (!buf) {
+			if (__atomic_load_n(&capture.quit, __ATOMIC_ACQUIRE))
+				break;
+			if (read(capture.efd, &val, sizeof(val)) < 0 && errno != EINTR)
+				break;
+			continue;
+		}
+
+		/* after an error keep recycling buffers, but stop writing: */
+		if (!capture.failed) {
+			if (write_frame(buf)) {
+				printf("failed to write captured frame %u: %s\n",
+						buf->frame, strerror(errno));
+				capture.failed = true;
+			} else {
+				capture.written++;
+			}
+		}
+
+		__atomic_store_n(&buf->state, CAPTURE_FREE, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+static void queue_buf(struct capture_buf *buf)
+{
+	buf->state = CAPTURE_WRITING;
+	spsc_queue_push(&capture.queue, buf);
+	wake_writer();
+}
+
+/* Hand the buffers whose copy completed to the writer, in order.  With
+ * wait set, wait for all of them (at exit):
+ */
+static void retire(const struct egl *egl, bool wait)
+{
+	while (capture.oldest != capture.next) {
+		struct capture_buf *buf = &capture.bufs[capture.oldest % CAPTURE_BUFFERS];
+
+		if (buf->fence != EGL_NO_SYNC_KHR) {
+			EGLint ret = egl->eglClientWaitSyncKHR(egl->display, buf->fence,
+					0, wait ? EGL_FOREVER_KHR : 0);
+			if (ret == EGL_TIMEOUT_EXPIRED_KHR)
+				break;
+			egl->eglDestroySyncKHR(egl->display, buf->fence);
+			buf->fence = EGL_NO_SYNC_KHR;
+		}
+
+		queue_buf(buf);
+		capture.oldest++;
+	}
+}
+
+static int init_buf(const struct egl *egl, const struct gbm *gbm,
+		struct capture_buf *buf)
+{
+	buf->fence = EGL_NO_SYNC_KHR;
+	buf->state = CAPTURE_FREE;
+
+	/* linear, so the writer can read it straight from a mapping: */
+	buf->bo = gbm_bo_create(gbm->dev, capture.width, capture.height,
+			GBM_FORMAT_ABGR8888, GBM_BO_USE_LINEAR | GBM_BO_USE_RENDERING);
+	if (!buf->bo) {
+		printf("failed to create capture buffer\n");
+		return -1;
+	}
+
+	if (!create_framebuffer(egl, buf->bo, &buf->fb)) {
+		printf("failed to create capture framebuffer\n");
+		return -1;
+	}
+
+	buf->stride = gbm_bo_get_stride(buf->bo);
+	buf->size = (size_t)buf->stride * capture.height;
+	buf->dmabuf_fd = gbm_bo_get_fd(buf->bo);
+	if (buf->dmabuf_fd < 0) {
+		printf("failed to get fd for capture buffer\n");
+		return -1;
+	}
+
+	buf->map = mmap(NULL, buf->size, PROT_READ, MAP_SHARED, buf->dmabuf_fd, 0);
+	if (buf->map == MAP_FAILED) {
+		printf("failed to map capture buffer: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static bool has_suffix(const char *str, const char *suffix)
+{
+	size_t len = strlen(str), n = strlen(suffix);
+
+	return len >= n && !strcasecmp(str + len - n, suffix);
+}
+
+#ifdef HAVE_LIBPNG
+/* The png name is a printf format for the frame number, so it needs
+ * exactly one %u or %d (eg. %06u), and no other conversion but %%:
+ */
+static bool valid_frame_format(const char *fmt)
+{
+	unsigned conversions = 0;
+
+	for (const char *p = strchr(fmt, '%'); p; p = strchr(p + 1, '%')) {
+		if (p[1] == '%') {
+			p++;
+			continue;
+		}
+
+		p++;
+		p += strspn(p, "-+ #0");
+		p += strspn(p, "0123456789");
+		if (*p != 'u' && *p != 'd')
+			return false;
+		conversions++;
+	}
+
+	return conversions == 1;
+}
+#endif
+
+int init_capture(const struct egl *egl, const struct gbm *gbm,
+		const char *filename, unsigned fps)
+{
+	int ret;
+
+	if (!filename)
+		return 0;
+
+	if (egl_check(egl, eglCreateImageKHR) ||
+	    egl_check(egl, glEGLImageTargetTexture2DOES))
+		return -1;
+
+	capture.filename = filename;
+	capture.width = gbm->width;
+	capture.height = gbm->height;
+	capture.flip = !!gbm->surface;
+	capture.use_fences = egl->eglCreateSyncKHR && egl->eglClientWaitSyncKHR &&
+			egl->eglDestroySyncKHR;
+
+	if (has_suffix(filename, ".y4m")) {
+		capture.format = CAPTURE_Y4M;
+	} else if (has_suffix(filename, ".png")) {
+#ifdef HAVE_LIBPNG
+		if (!valid_frame_format(filename)) {
+			printf("%s: needs one %%u for the frame number, and no other %%\n",
+					filename);
+			return -1;
+		}
+		capture.format = CAPTURE_PNG;
+#else
+		printf("no libpng support, can't capture to %s\n", filename);
+		return -1;
+#endif
+	} else {
+		capture.format = CAPTURE_RAW;
+	}
+
+	for (unsigned i = 0; i < CAPTURE_BUFFERS; i++)
+		if (init_buf(egl, gbm, &capture.bufs[i]))
+			return -1;
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	/* rgba, plus the 4:4:4 planes for y4m: */
+	capture.pixels = malloc((size_t)capture.width * capture.height * 7);
+	if (!capture.pixels)
+		return -1;
+
+	if (capture.format != CAPTURE_PNG) {
+		capture.fp = fopen(filename, "wb");
+		if (!capture.fp) {
+			printf("failed to open %s: %s\n", filename, strerror(errno));
+			return -1;
+		}
+	}
+
+	if (capture.format == CAPTURE_Y4M)
+		fprintf(capture.fp, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C444\n",
+				capture.width, capture.height, fps ? fps : 60);
+
+	spsc_queue_init(&capture.queue);
+	capture.efd = eventfd(0, EFD_CLOEXEC);
+	if (capture.efd < 0) {
+		printf("eventfd failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	ret = pthread_create(&capture.thread, NULL, writer_thread, NULL);
+	if (ret) {
+		printf("failed to start capture writer: %s\n", strerror(ret));
+		close(capture.efd);
+		capture.efd = -1;
+		return -1;
+	}
+
+	if (capture.format == CAPTURE_RAW)
+		printf("Capturing %ux%u rgba frames to %s\n",
+				capture.width, capture.height, filename);
+	else
+		printf("Capturing to %s\n", filename);
+
+	return 0;
+}
+
+void capture_frame(const struct egl *egl, unsigned i)
+{
+	struct capture_buf *buf;
+
+	if (capture.efd < 0)
+		return;
+
+	retire(egl, false);
+
+	buf = &capture.bufs[capture.next % CAPTURE_BUFFERS];
+	if (__atomic_load_n(&buf->state, __ATOMIC_ACQUIRE) != CAPTURE_FREE) {
+		capture.dropped++;
+		return;
+	}
+
+	buf->frame = i;
+
+	glBindTexture(GL_TEXTURE_2D, buf->fb.tex);
+	glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0,
+			capture.width, capture.height);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	capture.captured++;
+
+	if (capture.use_fences) {
+		buf->state = CAPTURE_COPYING;
+		buf->fence = egl->eglCreateSyncKHR(egl->display, EGL_SYNC_FENCE_KHR, NULL);
+		capture.next++;
+	} else {
+		/* the dma-buf sync in the writer waits for the copy, as long
+		 * as it has been submitted:
+		 */
+		glFlush();
+		capture.next++;
+		capture.oldest++;
+		queue_buf(buf);
+	}
+}
+
+void fini_capture(const struct egl *egl)
+{
+	if (capture.efd < 0)
+		return;
+
+	glFlush();
+	retire(egl, true);
+
+	__atomic_store_n(&capture.quit, true, __ATOMIC_RELEASE);
+	wake_writer();
+	pthread_join(capture.thread, NULL);
+
+	if (capture.fp)
+		fclose(capture.fp);
+
+	for (unsigned i = 0; i < CAPTURE_BUFFERS; i++) {
+		struct capture_buf *buf = &capture.bufs[i];
+
+		munmap(buf->map, buf->size);
+		close(buf->dmabuf_fd);
+		egl->eglDestroyImageKHR(egl->display, buf->fb.image);
+		glDeleteTextures(1, &buf->fb.tex);
+		glDeleteFramebuffers(1, &buf->fb.fb);
+		gbm_bo_destroy(buf->bo);
+	}
+
+	free(capture.pixels);
+	close(capture.efd);
+	capture.efd = -1;
+
+	printf("Captured %u frames (%u written, %u dropped) to %s\n",
+			capture.captured, capture.written, capture.dropped,
+			capture.filename);
+}
@@ -0,0 +1,51 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+struct egl;
+struct gbm;
+
+/* Asynchronous frame capture, with --capture.  Each frame is copied on
+ * the gpu into one of a small ring of linear buffers, and a writer
+ * thread streams it to disk once the copy's fence signaled, so the
+ * render loop never waits for the gpu or for the disk.  When the writer
+ * falls behind, frames are dropped (and counted) rather than queued, so
+ * memory use stays bounded.
+ *
+ * The filename picks the format: .y4m for a YUV4MPEG2 (4:4:4) stream,
+ * .png for a PNG sequence (with a printf style %u for the frame number,
+ * if built with libpng), otherwise raw RGBA frames back to back.
+ */
+
+int init_capture(const struct egl *egl, const struct gbm *gbm,
+		const char *filename, unsigned fps);
+
+/* Capture the currently bound framebuffer, call after drawing frame i
+ * and before swapping/flushing it:
+ */
+void capture_frame(const struct egl *egl, unsigned i);
+
+/* Write out what is still in flight, and stop the writer: */
+void fini_capture(const struct egl *egl);
+
+#endif /* _CAPTURE_H */
@@ -36,6 +36,11 @@
 
 static struct gbm gbm;
 
+/* with KHR_parallel_shader_compile, compiles and links return right
+ * away and complete on driver threads:
+ */
+static bool parallel_compile;
+
 WEAK struct gbm_surface *
 gbm_surface_create_with_modifiers(struct gbm_device *gbm,
                                   uint32_t width, uint32_t height,
@@ -70,6 +75,13 @@ static struct gbm_bo * init_bo(uint64_t modifier)
 				   gbm.width, gbm.height,
 				   gbm.format,
 				   GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+
+		/* a render node (offscreen) may not do scanout buffers: */
+		if (!bo)
+			bo = gbm_bo_create(gbm.dev,
+					   gbm.width, gbm.height,
+					   gbm.format,
+					   GBM_BO_USE_RENDERING);
 	}
 
 	if (!bo) {
@@ -82,7 +94,7 @@ static struct gbm_bo * init_bo(uint64_t modifier)
 
 static struct gbm * init_surfaceless(uint64_t modifier)
 {
-	for (unsigned i = 0; i < ARRAY_SIZE(gbm.bos); i++) {
+	for (unsigned i = 0; i < gbm.num_buffers; i++) {
 		gbm.bos[i] = init_bo(modifier);
 		if (!gbm.bos[i])
 			return NULL;
@@ -121,11 +133,18 @@ static struct gbm * init_surface(uint64_t modifier)
 }
 
 const struct gbm * init_gbm(int drm_fd, int w, int h, uint32_t format,
-		uint64_t modifier, bool surfaceless)
+		uint64_t modifier, bool surfaceless, unsigned num_buffers)
 {
+	if (num_buffers < 2 || num_buffers > MAX_BUFFERS) {
+		printf("invalid number of buffers: %u (must be 2..%d)\n",
+				num_buffers, MAX_BUFFERS);
+		return NULL;
+	}
+
 	gbm.dev = gbm_create_device(drm_fd);
 	gbm.format = format;
 	gbm.surface = NULL;
+	gbm.num_buffers = num_buffers;
 
 	gbm.width = w;
 	gbm.height = h;
@@ -222,7 +241,7 @@ out:
 	return true;
 }
 
-static bool
+bool
 create_framebuffer(const struct egl *egl, struct gbm_bo *bo,
 		struct framebuffer *fb) {
 	assert(egl->eglCreateImageKHR);
@@ -426,8 +445,26 @@ int init_egl(struct egl *egl, const struct gbm *gbm, int samples)
 	get_proc_gl(GL_AMD_performance_monitor, glEndPerfMonitorAMD);
 	get_proc_gl(GL_AMD_performance_monitor, glGetPerfMonitorCounterDataAMD);
 
+	get_proc_gl(GL_OES_get_program_binary, glGetProgramBinaryOES);
+	get_proc_gl(GL_OES_get_program_binary, glProgramBinaryOES);
+
+	get_proc_gl(GL_KHR_parallel_shader_compile, glMaxShaderCompilerThreadsKHR);
+	if (egl->glMaxShaderCompilerThreadsKHR) {
+		/* as many as the driver likes: */
+		egl->glMaxShaderCompilerThreadsKHR(0xffffffff);
+		parallel_compile = true;
+	}
+
+	get_proc_gl(GL_EXT_disjoint_timer_query, glGenQueriesEXT);
+	get_proc_gl(GL_EXT_disjoint_timer_query, glBeginQueryEXT);
+	get_proc_gl(GL_EXT_disjoint_timer_query, glEndQueryEXT);
+	get_proc_gl(GL_EXT_disjoint_timer_query, glGetQueryObjectuivEXT);
+	get_proc_gl(GL_EXT_disjoint_timer_query, glGetQueryObjectui64vEXT);
+
+	progcache_init(egl);
+
 	if (!gbm->surface) {
-		for (unsigned i = 0; i < ARRAY_SIZE(gbm->bos); i++) {
+		for (unsigned i = 0; i < gbm->num_buffers; i++) {
 			if (!create_framebuffer(egl, gbm->bos[i], &egl->fbs[i])) {
 				printf("failed to create framebuffer\n");
 				return -1;
@@ -438,72 +475,116 @@ int init_egl(struct egl *egl, const struct gbm *gbm, int samples)
 	return 0;
 }
 
-int create_program(const char *vs_src, const char *fs_src)
+/* Only submits the compile, the status is checked once linked, so with
+ * parallel compiles the shaders of all programs created before the
+ * first one is needed build at the same time:
+ */
+static void compile_shader(GLuint program, GLenum type, const char *src)
 {
-	GLuint vertex_shader, fragment_shader, program;
-	GLint ret;
+	GLuint shader;
 
-	vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+	shader = glCreateShader(type);
 
-	glShaderSource(vertex_shader, 1, &vs_src, NULL);
-	glCompileShader(vertex_shader);
+	glShaderSource(shader, 1, &src, NULL);
+	glCompileShader(shader);
 
-	glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &ret);
-	if (!ret) {
-		char *log;
-
-		printf("vertex shader compilation failed!:\n");
-		glGetShaderiv(vertex_shader, GL_INFO_LOG_LENGTH, &ret);
-		if (ret > 1) {
-			log = malloc(ret);
-			glGetShaderInfoLog(vertex_shader, ret, NULL, log);
-			printf("%s", log);
-			free(log);
-		}
+	glAttachShader(program, shader);
 
-		return -1;
-	}
+	/* deleted with the program: */
+	glDeleteShader(shader);
+}
 
-	fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+static void print_compile_errors(GLuint program)
+{
+	GLuint shaders[2];
+	GLsizei count = 0;
+	GLint ret, type;
 
-	glShaderSource(fragment_shader, 1, &fs_src, NULL);
-	glCompileShader(fragment_shader);
+	glGetAttachedShaders(program, ARRAY_SIZE(shaders), &count, shaders);
 
-	glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &ret);
-	if (!ret) {
+	for (GLsizei i = 0; i < count; i++) {
 		char *log;
 
-		printf("fragment shader compilation failed!:\n");
-		glGetShaderiv(fragment_shader, GL_INFO_LOG_LENGTH, &ret);
+		glGetShaderiv(shaders[i], GL_COMPILE_STATUS, &ret);
+		if (ret)
+			continue;
+
+		glGetShaderiv(shaders[i], GL_SHADER_TYPE, &type);
+		printf("%s shader compilation failed!:\n",
+				type == GL_VERTEX_SHADER ? "vertex" : "fragment");
+		glGetShaderiv(shaders[i], GL_INFO_LOG_LENGTH, &ret);
 
 		if (ret > 1) {
 			log = malloc(ret);
-			glGetShaderInfoLog(fragment_shader, ret, NULL, log);
+			glGetShaderInfoLog(shaders[i], ret, NULL, log);
 			printf("%s", log);
 			free(log);
 		}
-
-		return -1;
 	}
+}
+
+int create_program(const char *vs_src, const char *fs_src)
+{
+	GLuint program;
 
 	program = glCreateProgram();
 
-	glAttachShader(program, vertex_shader);
-	glAttachShader(program, fragment_shader);
+	/* with a cached binary, compiling is left to link_program() in
+	 * case the binary doesn't load:
+	 */
+	if (progcache_lookup(program, vs_src, fs_src))
+		return program;
+
+	compile_shader(program, GL_VERTEX_SHADER, vs_src);
+	compile_shader(program, GL_FRAGMENT_SHADER, fs_src);
 
 	return program;
 }
 
-int link_program(unsigned program)
+void delete_program(unsigned program)
 {
-	GLint ret;
+	/* it may not have got to program_status(), which frees the cache
+	 * slot, and GL reuses the name:
+	 */
+	progcache_done(program, false);
+	glDeleteProgram(program);
+}
+
+int link_program_async(unsigned program)
+{
+	const char *vs_src, *fs_src;
+	int ret;
+
+	ret = progcache_link(program, &vs_src, &fs_src);
+	if (ret > 0)
+		return 0;
+
+	if (ret < 0) {
+		compile_shader(program, GL_VERTEX_SHADER, vs_src);
+		compile_shader(program, GL_FRAGMENT_SHADER, fs_src);
+	}
 
 	glLinkProgram(program);
 
+	return 0;
+}
+
+int program_status(unsigned program, bool wait)
+{
+	GLint ret;
+
+	if (!wait && parallel_compile) {
+		glGetProgramiv(program, GL_COMPLETION_STATUS_KHR, &ret);
+		if (!ret)
+			return 0;
+	}
+
 	glGetProgramiv(program, GL_LINK_STATUS, &ret);
 	if (!ret) {
 		char *log;
 
+		print_compile_errors(program);
+
 		printf("program linking failed!:\n");
 		glGetProgramiv(program, GL_INFO_LOG_LENGTH, &ret);
 
@@ -514,10 +595,21 @@ int link_program(unsigned program)
 			free(log);
 		}
 
+		progcache_done(program, false);
 		return -1;
 	}
 
-	return 0;
+	progcache_done(program, true);
+
+	return 1;
+}
+
+int link_program(unsigned program)
+{
+	if (link_program_async(program))
+		return -1;
+
+	return program_status(program, true) > 0 ? 0 : -1;
 }
 
 int64_t get_time_ns(void)
@@ -96,17 +96,21 @@ EGLAPI EGLSurface EGLAPIENTRY eglCreatePlatformPixmapSurfaceEXT (EGLDisplay dpy,
 #define EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT 0x344A
 #endif
 
+/* default and maximum swapchain depth: */
 #define NUM_BUFFERS 2
+#define MAX_BUFFERS 8
 
 struct gbm {
 	struct gbm_device *dev;
 	struct gbm_surface *surface;
-	struct gbm_bo *bos[NUM_BUFFERS];    /* for the surfaceless case */
+	struct gbm_bo *bos[MAX_BUFFERS];    /* for the surfaceless case */
+	unsigned num_buffers;
 	uint32_t format;
 	int width, height;
 };
 
-const struct gbm * init_gbm(int drm_fd, int w, int h, uint32_t format, uint64_t modifier, bool surfaceless);
+const struct gbm * init_gbm(int drm_fd, int w, int h, uint32_t format,
+		uint64_t modifier, bool surfaceless, unsigned num_buffers);
 
 struct framebuffer {
 	EGLImageKHR image;
@@ -114,12 +118,40 @@ struct framebuffer {
 	GLuint fb;
 };
 
+/* An extra layer shown on top of the primary (cube) output, ie. a video
+ * or shadertoy picture-in-picture or a UI overlay.  The layer content is
+ * rendered into its own buffers, one per swapchain buffer, so a layer
+ * buffer is recycled together with the primary buffer it was committed
+ * with.
+ *
+ * The atomic backend puts each layer on its own overlay plane when the
+ * kms driver accepts that, otherwise the layers are blended into the
+ * primary buffer by the gpu (see composite_layers()).
+ */
+#define MAX_LAYERS 3
+
+struct layer {
+	const char *name;
+	struct gbm_bo *bos[MAX_BUFFERS];
+	struct framebuffer fbs[MAX_BUFFERS];
+	unsigned num_buffers;
+	uint32_t format;
+	int x, y;                  /* position on screen */
+	unsigned width, height;
+	unsigned zpos;             /* stacking order, above the primary */
+	int cur;                   /* buffer being drawn in this frame */
+
+	void (*draw)(struct layer *layer, unsigned i, int64_t time_ns);
+};
+
+struct evloop;
+
 struct egl {
 	EGLDisplay display;
 	EGLConfig config;
 	EGLContext context;
 	EGLSurface surface;
-	struct framebuffer fbs[NUM_BUFFERS];    /* for the surfaceless case */
+	struct framebuffer fbs[MAX_BUFFERS];    /* for the surfaceless case */
 
 	PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplayEXT;
 	PFNEGLCREATEIMAGEKHRPROC eglCreateImageKHR;
@@ -144,9 +176,38 @@ struct egl {
 	PFNGLENDPERFMONITORAMDPROC               glEndPerfMonitorAMD;
 	PFNGLGETPERFMONITORCOUNTERDATAAMDPROC    glGetPerfMonitorCounterDataAMD;
 
+	/* OES_get_program_binary */
+	PFNGLGETPROGRAMBINARYOESPROC             glGetProgramBinaryOES;
+	PFNGLPROGRAMBINARYOESPROC                glProgramBinaryOES;
+
+	/* KHR_parallel_shader_compile */
+	PFNGLMAXSHADERCOMPILERTHREADSKHRPROC     glMaxShaderCompilerThreadsKHR;
+
+	/* EXT_disjoint_timer_query */
+	PFNGLGENQUERIESEXTPROC                   glGenQueriesEXT;
+	PFNGLBEGINQUERYEXTPROC                   glBeginQueryEXT;
+	PFNGLENDQUERYEXTPROC                     glEndQueryEXT;
+	PFNGLGETQUERYOBJECTUIVEXTPROC            glGetQueryObjectuivEXT;
+	PFNGLGETQUERYOBJECTUI64VEXTPROC          glGetQueryObjectui64vEXT;
+
 	bool modifiers_supported;
 
-	void (*draw)(unsigned i);
+	/* extra layers on top of the cube, with --layers: */
+	struct layer *layers[MAX_LAYERS];
+	unsigned num_layers;
+
+	/* draw frame i, which is predicted to be on screen time_ns after
+	 * the first frame:
+	 */
+	void (*draw)(unsigned i, int64_t time_ns);
+
+	/* optional, add mode specific fds (eg. watched files) to the
+	 * backend's event loop, which dispatches on the render thread:
+	 */
+	int (*add_sources)(struct evloop *loop);
+
+	/* optional, called at exit with the context still current: */
+	void (*fini)(void);
 };
 
 static inline int __egl_check(void *ptr, const char *name)
@@ -161,9 +222,43 @@ static inline int __egl_check(void *ptr, const char *name)
 #define egl_check(egl, name) __egl_check((egl)->name, #name)
 
 int init_egl(struct egl *egl, const struct gbm *gbm, int samples);
+bool create_framebuffer(const struct egl *egl, struct gbm_bo *bo,
+		struct framebuffer *fb);
+
+int init_layer(struct egl *egl, const struct gbm *gbm, struct layer *layer,
+		uint32_t format, unsigned width, unsigned height);
+int init_hud_layer(struct egl *egl, const struct gbm *gbm);
+void draw_layers(const struct egl *egl, const struct gbm *gbm, int idx,
+		unsigned i, int64_t time_ns);
+void composite_layers(const struct egl *egl, const struct gbm *gbm, unsigned mask);
 int create_program(const char *vs_src, const char *fs_src);
 int link_program(unsigned program);
 
+/* glDeleteProgram(), also for a program that may not be linked yet: */
+void delete_program(unsigned program);
+
+/* link_program() in two halves, for programs that the render loop can
+ * start without: link_program_async() starts the link, and
+ * program_status() returns 1 once linked, -1 if that failed, or 0 if it
+ * isn't done yet (without waiting for it, unless wait is set).  Shader
+ * compile errors are reported then, not by create_program().
+ */
+int link_program_async(unsigned program);
+int program_status(unsigned program, bool wait);
+
+/* Program binary cache (progcache.c), behind create_program() and
+ * link_program().  progcache_lookup() returns true if a cached binary
+ * will be loaded at link time instead of compiling.  progcache_link()
+ * returns 1 if it linked the program from the binary, -1 if the binary
+ * was rejected and the program needs compiling from the returned
+ * sources, and 0 otherwise.  progcache_done() releases the slot the
+ * program took in progcache_lookup(), storing the binary if linked.
+ */
+void progcache_init(const struct egl *egl);
+bool progcache_lookup(unsigned program, const char *vs_src, const char *fs_src);
+int progcache_link(unsigned program, const char **vs_src, const char **fs_src);
+void progcache_done(unsigned program, bool linked);
+
 enum mode {
 	SMOOTH,        /* smooth-shaded */
 	RGBA,          /* single-plane RGBA */
@@ -173,24 +268,45 @@ enum mode {
 	SHADERTOY,     /* display shadertoy shader */
 };
 
-const struct egl * init_cube_smooth(const struct gbm *gbm, int samples);
-const struct egl * init_cube_tex(const struct gbm *gbm, enum mode mode, int samples);
-const struct egl * init_cube_shadertoy(const struct gbm *gbm, const char *shadertoy, int samples);
+const struct egl * init_cube_smooth(const struct gbm *gbm, int samples, bool layers);
+const struct egl * init_cube_tex(const struct gbm *gbm, enum mode mode, int samples, bool layers);
+const struct egl * init_cube_shadertoy(const struct gbm *gbm, const char *shadertoy, int samples, bool layers, int64_t dynres_ns);
+
+/* --cubes, for the smooth, rgba/nv12 and shadertoy cube modes (see cubes.c).
+ * The vertex shaders take the per-cube offset and scale at CUBES_ATTRIB:
+ */
+#define MAX_CUBES    65536
+#define CUBES_ATTRIB 6
+
+int init_cubes(unsigned count);
+void draw_cubes(void);
+void dump_cubes(unsigned frames, double secs);
 
 #ifdef HAVE_GST
 
 struct decoder;
-struct decoder * video_init(const struct egl *egl, const struct gbm *gbm, const char *filename);
-EGLImage video_frame(struct decoder *dec);
+struct decoder * video_init(const struct egl *egl, const struct gbm *gbm, const char *filename, bool loop);
+void video_play(struct decoder *dec);
+GLuint video_frame(struct decoder *dec, int64_t time_ns, bool wait, bool *eos);
 void video_deinit(struct decoder *dec);
+/* wait for the background teardown of the deinit'ed decoders, at exit: */
+void video_wait(void);
 
-const struct egl * init_cube_video(const struct gbm *gbm, const char *video, int samples);
+const struct egl * init_cube_video(const struct gbm *gbm, const char *video, int samples, bool layers, bool loop);
+const struct egl * init_cube_video_multi(const struct gbm *gbm, const char *video, unsigned streams, int samples, bool loop);
 
 #else
 static inline const struct egl *
-init_cube_video(const struct gbm *gbm, const char *video, int samples)
+init_cube_video(const struct gbm *gbm, const char *video, int samples, bool layers, bool loop)
 {
-	(void)gbm; (void)video; (void)samples;
+	(void)gbm; (void)video; (void)samples; (void)layers; (void)loop;
+	printf("no GStreamer support!\n");
+	return NULL;
+}
+static inline const struct egl *
+init_cube_video_multi(const struct gbm *gbm, const char *video, unsigned streams, int samples, bool loop)
+{
+	(void)gbm; (void)video; (void)streams; (void)samples; (void)loop;
 	printf("no GStreamer support!\n");
 	return NULL;
 }
@@ -208,4 +324,12 @@ void dump_perfcntrs(unsigned nframes, uint64_t elapsed_time_ns);
 
 int64_t get_time_ns(void);
 
+/* The cube animations advance one step per frame at 60Hz, this keeps
+ * them at that speed whatever the refresh rate, or dropped frames:
+ */
+static inline float anim_step(int64_t time_ns)
+{
+	return (double)time_ns * 60.0 / NSEC_PER_SEC;
+}
+
 #endif /* _COMMON_H */
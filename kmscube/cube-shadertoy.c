@@ -24,38 +24,38 @@
 #define _GNU_SOURCE
 
 #include <assert.h>
-#include <err.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
 #include <string.h>
-#include <sys/mman.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
 
 #include <GLES3/gl3.h>
 
 #include "common.h"
 #include "esUtil.h"
+#include "shadertoy.h"
+#include "transform.h"
 
 static struct {
 	struct egl egl;
 
 	const struct gbm *gbm;
 
-	/* Shadertoy rendering (to FBO): */
-	GLuint stoy_program;
+	/* Shadertoy rendering (to FBO, see shadertoy.c): */
 	GLuint stoy_fbo, stoy_fbotex;
-	GLint stoy_time_loc;
-	GLuint stoy_vbo;
+	unsigned texw, texh;
+	bool dynres;
+
+	/* with --layers the shadertoy renders into a layer instead: */
+	bool layered;
+	struct layer layer;
 
 	/* Cube rendering (textures from FBO): */
 	GLfloat aspect;
+	struct transform xf;
 	GLuint program;
 	/* uniform handles: */
 	GLint modelviewmatrix, modelviewprojectionmatrix, normalmatrix;
-	GLint texture;
+	GLint texture, texel, sharpen;
 	GLuint vbo;
 	GLuint positionsoffset, texcoordsoffset, normalsoffset;
 	GLuint tex[2];
@@ -166,6 +166,7 @@ static const char *cube_vs =
 	"uniform mat3 normalMatrix;         \n"
 	"                                   \n"
 	"attribute vec4 in_position;        \n"
+	"attribute vec4 in_instance;        \n"
 	"attribute vec3 in_normal;          \n"
 	"attribute vec2 in_TexCoord;        \n"
 	"                                   \n"
@@ -176,9 +177,10 @@ static const char *cube_vs =
 	"                                   \n"
 	"void main()                        \n"
 	"{                                  \n"
-	"    gl_Position = modelviewprojectionMatrix * in_position;\n"
+	"    vec4 position = vec4(in_position.xyz * in_instance.w + in_instance.xyz, 1.0);\n"
+	"    gl_Position = modelviewprojectionMatrix * position;\n"
 	"    vec3 vEyeNormal = normalMatrix * in_normal;\n"
-	"    vec4 vPosition4 = modelviewMatrix * in_position;\n"
+	"    vec4 vPosition4 = modelviewMatrix * position;\n"
 	"    vec3 vPosition3 = vPosition4.xyz / vPosition4.w;\n"
 	"    vec3 vLightDir = normalize(lightSource.xyz - vPosition3);\n"
 	"    float diff = max(0.0, dot(vEyeNormal, vLightDir));\n"
@@ -190,83 +192,38 @@ static const char *cube_fs =
 	"precision mediump float;           \n"
 	"                                   \n"
 	"uniform sampler2D uTex;            \n"
+	"uniform vec2 uTexel;               \n"
+	"uniform float uSharpen;            \n"
 	"                                   \n"
 	"varying vec4 vVaryingColor;        \n"
 	"varying vec2 vTexCoord;            \n"
 	"                                   \n"
 	"void main()                        \n"
 	"{                                  \n"
-	"    gl_FragColor = vVaryingColor * texture2D(uTex, vTexCoord);\n"
+	"    vec4 color = texture2D(uTex, vTexCoord);\n"
+	"    if (uSharpen > 0.0) {          \n"
+	"        vec4 blur = texture2D(uTex, vTexCoord + vec2(uTexel.x, 0.0)) +\n"
+	"                    texture2D(uTex, vTexCoord - vec2(uTexel.x, 0.0)) +\n"
+	"                    texture2D(uTex, vTexCoord + vec2(0.0, uTexel.y)) +\n"
+	"                    texture2D(uTex, vTexCoord - vec2(0.0, uTexel.y));\n"
+	"        color += (color - blur * 0.25) * uSharpen;\n"
+	"    }                              \n"
+	"    gl_FragColor = vVaryingColor * color;\n"
 	"}                                  \n";
 
-static const char *shadertoy_vs =
-	"attribute vec3 position;           \n"
-	"void main()                        \n"
-	"{                                  \n"
-	"    gl_Position = vec4(position, 1.0);\n"
-	"}                                  \n";
-
-static const char *shadertoy_fs_tmpl =
-	"precision mediump float;                                                             \n"
-	"uniform vec3      iResolution;           // viewport resolution (in pixels)          \n"
-	"uniform float     iGlobalTime;           // shader playback time (in seconds)        \n"
-	"uniform vec4      iMouse;                // mouse pixel coords                       \n"
-	"uniform vec4      iDate;                 // (year, month, day, time in seconds)      \n"
-	"uniform float     iSampleRate;           // sound sample rate (i.e., 44100)          \n"
-	"uniform vec3      iChannelResolution[4]; // channel resolution (in pixels)           \n"
-	"uniform float     iChannelTime[4];       // channel playback time (in sec)           \n"
-	"uniform float     iTime;                                                             \n"
-	"                                                                                     \n"
-	"%s                                                                                   \n"
-	"                                                                                     \n"
-	"void main()                                                                          \n"
-	"{                                                                                    \n"
-	"    mainImage(gl_FragColor, gl_FragCoord.xy);                                        \n"
-	"}                                                                                    \n";
-
-
-static const uint32_t texw = 512, texh = 512;
-
-static int load_shader(const char *file)
-{
-	struct stat statbuf;
-	char *frag;
-	int fd, ret;
-
-	/* load src file: */
-	fd = open(file, 0);
-	if (fd < 0) {
-		err(fd, "could not open '%s'", file);
-	}
-
-	ret = fstat(fd, &statbuf);
-	if (ret < 0) {
-		err(ret, "could not stat '%s'", file);
-	}
-
-	const char *text =
-		mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-
-	asprintf(&frag, shadertoy_fs_tmpl, text);
-
-	return create_program(shadertoy_vs, frag);
-}
-
 static int init_shadertoy(const char *file)
 {
-	int ret = load_shader(file);
-	gl.stoy_program = ret;
+	/* Shadertoys can take a while to compile, so the render loop
+	 * starts without it, see render_shadertoy():
+	 */
+	if (shadertoy_init(file))
+		return -1;
 
-	glBindAttribLocation(gl.program, 0, "position");
+	shadertoy_size(&gl.texw, &gl.texh);
 
-	ret = link_program(gl.stoy_program);
-
-	glUseProgram(gl.stoy_program);
-	gl.stoy_time_loc = glGetUniformLocation(gl.stoy_program, "iTime");
-
-	/* we can set iResolution a single time, it doesn't change: */
-	GLint resolution_location = glGetUniformLocation(gl.stoy_program, "iResolution");
-	glUniform3f(resolution_location, texw, texh, 0);
+	/* with layers, the layer buffers are the render target: */
+	if (gl.layered)
+		return 0;
 
 	glGenFramebuffers(1, &gl.stoy_fbo);
 	glGenTextures(1, &gl.stoy_fbotex);
@@ -278,58 +235,69 @@ static int init_shadertoy(const char *file)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, texw, texh, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, gl.texw, gl.texh, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
 		gl.stoy_fbotex, 0);
 
-	const GLfloat vertices[] = {
-		-1.0f, -1.0f, 0.0f,
-		 1.0f, -1.0f, 0.0f,
-		-1.0f,  1.0f, 0.0f,
-		 1.0f,  1.0f, 0.0f,
-	};
-	glGenBuffers(1, &gl.stoy_vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, gl.stoy_vbo);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), 0, GL_STATIC_DRAW);
-	glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vertices), &vertices[0]);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (const GLvoid *)(intptr_t)0);
-
 	return 0;
 }
 
-static void draw_shadertoy(unsigned i)
+static void render_shadertoy(int64_t time_ns)
 {
-	GLenum mrt_bufs[] = {GL_COLOR_ATTACHMENT0};
-
-	glBindFramebuffer(GL_FRAMEBUFFER, gl.stoy_fbo);
-	glViewport(0, 0, texw, texh);
-
-	glUseProgram(gl.stoy_program);
-	glUniform1f(gl.stoy_time_loc, (float)i / 60.0f);
-
-	glBindBuffer(GL_ARRAY_BUFFER, gl.stoy_vbo);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (const GLvoid *)(intptr_t)0);
-	glEnableVertexAttribArray(0);
-
-	glDrawBuffers(1, mrt_bufs);
+	/* until the shaders are compiled (or if that failed), a placeholder: */
+	if (!shadertoy_ready()) {
+		glClearColor(0.2, 0.2, 0.2, 1.0);
+		glClear(GL_COLOR_BUFFER_BIT);
+		return;
+	}
 
 	start_perfcntrs();
 
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	shadertoy_render(time_ns);
 
 	end_perfcntrs();
+}
 
-	glDisableVertexAttribArray(0);
+static void draw_shadertoy(int64_t time_ns)
+{
+	unsigned texw, texh;
+
+	/* follow the dynamic resolution (the fbo stays attached): */
+	shadertoy_size(&texw, &texh);
+	if (texw != gl.texw || texh != gl.texh) {
+		gl.texw = texw;
+		gl.texh = texh;
+		glBindTexture(GL_TEXTURE_2D, gl.stoy_fbotex);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, gl.texw, gl.texh, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, gl.stoy_fbo);
+	glViewport(0, 0, gl.texw, gl.texh);
+
+	render_shadertoy(time_ns);
 
 	/* switch back to back buffer: */
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
-static void draw_cube_shadertoy(unsigned i)
+/* the layer framebuffer is already bound by draw_layers(): */
+static void draw_shadertoy_layer(struct layer *layer, unsigned i, int64_t time_ns)
+{
+	(void)layer; (void)i;
+	render_shadertoy(time_ns);
+}
+
+static void draw_cube_shadertoy(unsigned i, int64_t time_ns)
 {
-	ESMatrix modelview;
+	GLuint tex = gl.stoy_fbotex;
+	float t = anim_step(time_ns);
 
-	draw_shadertoy(i);
+	(void)i;
+
+	if (gl.layered)
+		tex = gl.layer.fbs[gl.layer.cur].tex;
+	else
+		draw_shadertoy(time_ns);
 
 	glViewport(0, 0, gl.gbm->width, gl.gbm->height);
 	glEnable(GL_CULL_FACE);
@@ -340,34 +308,11 @@ static void draw_cube_shadertoy(unsigned i)
 
 	glUseProgram(gl.program);
 
-	esMatrixLoadIdentity(&modelview);
-	esTranslate(&modelview, 0.0f, 0.0f, -8.0f);
-	esRotate(&modelview, 45.0f + (0.25f * i), 1.0f, 0.0f, 0.0f);
-	esRotate(&modelview, 45.0f - (0.5f * i), 0.0f, 1.0f, 0.0f);
-	esRotate(&modelview, 10.0f + (0.15f * i), 0.0f, 0.0f, 1.0f);
-
-	ESMatrix projection;
-	esMatrixLoadIdentity(&projection);
-	esFrustum(&projection, -2.8f, +2.8f, -2.8f * gl.aspect, +2.8f * gl.aspect, 6.0f, 10.0f);
-
-	ESMatrix modelviewprojection;
-	esMatrixLoadIdentity(&modelviewprojection);
-	esMatrixMultiply(&modelviewprojection, &modelview, &projection);
-
-	float normal[9];
-	normal[0] = modelview.m[0][0];
-	normal[1] = modelview.m[0][1];
-	normal[2] = modelview.m[0][2];
-	normal[3] = modelview.m[1][0];
-	normal[4] = modelview.m[1][1];
-	normal[5] = modelview.m[1][2];
-	normal[6] = modelview.m[2][0];
-	normal[7] = modelview.m[2][1];
-	normal[8] = modelview.m[2][2];
-
-	glUniformMatrix4fv(gl.modelviewmatrix, 1, GL_FALSE, &modelview.m[0][0]);
-	glUniformMatrix4fv(gl.modelviewprojectionmatrix, 1, GL_FALSE, &modelviewprojection.m[0][0]);
-	glUniformMatrix3fv(gl.normalmatrix, 1, GL_FALSE, normal);
+	transform_update(&gl.xf, t);
+
+	glUniformMatrix4fv(gl.modelviewmatrix, 1, GL_FALSE, &gl.xf.modelview.m[0][0]);
+	glUniformMatrix4fv(gl.modelviewprojectionmatrix, 1, GL_FALSE, &gl.xf.modelviewprojection.m[0][0]);
+	glUniformMatrix3fv(gl.normalmatrix, 1, GL_FALSE, gl.xf.normal);
 
 	glBindBuffer(GL_ARRAY_BUFFER, gl.vbo);
 	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (const GLvoid *)(intptr_t)gl.positionsoffset);
@@ -378,27 +323,26 @@ static void draw_cube_shadertoy(unsigned i)
 	glEnableVertexAttribArray(2);
 
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, gl.stoy_fbotex);
+	glBindTexture(GL_TEXTURE_2D, tex);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_REPEAT);
+	/* the size isn't a power of two with dynamic resolution: */
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glUniform1i(gl.texture, 0); /* '0' refers to texture unit 0. */
 
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 4, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 8, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 12, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 16, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 20, 4);
+	/* sharpen the upscale, more the lower the resolution: */
+	glUniform2f(gl.texel, 1.0f / gl.texw, 1.0f / gl.texh);
+	glUniform1f(gl.sharpen, gl.dynres ? 0.8f * (1.0f - shadertoy_scale()) : 0.0f);
+
+	draw_cubes();
 
 	glDisableVertexAttribArray(0);
 	glDisableVertexAttribArray(1);
 	glDisableVertexAttribArray(2);
 }
 
-const struct egl * init_cube_shadertoy(const struct gbm *gbm, const char *file, int samples)
+const struct egl * init_cube_shadertoy(const struct gbm *gbm, const char *file, int samples, bool layers, int64_t dynres_ns)
 {
 	int ret;
 
@@ -407,7 +351,22 @@ const struct egl * init_cube_shadertoy(const struct gbm *gbm, const char *file,
 		return NULL;
 
 	gl.aspect = (GLfloat)(gbm->height) / (GLfloat)(gbm->width);
+	transform_init(&gl.xf, 2.8f, gl.aspect);
 	gl.gbm = gbm;
+	gl.layered = layers;
+
+	/* first, so it compiles while the rest is set up: */
+	ret = init_shadertoy(file);
+	if (ret) {
+		printf("failed to initialize\n");
+		return NULL;
+	}
+
+	if (dynres_ns) {
+		if (shadertoy_dynres(&gl.egl, dynres_ns))
+			return NULL;
+		gl.dynres = true;
+	}
 
 	ret = create_program(cube_vs, cube_fs);
 	if (ret < 0)
@@ -418,6 +377,7 @@ const struct egl * init_cube_shadertoy(const struct gbm *gbm, const char *file,
 	glBindAttribLocation(gl.program, 0, "in_position");
 	glBindAttribLocation(gl.program, 1, "in_normal");
 	glBindAttribLocation(gl.program, 2, "in_color");
+	glBindAttribLocation(gl.program, CUBES_ATTRIB, "in_instance");
 
 	ret = link_program(gl.program);
 	if (ret)
@@ -429,6 +389,8 @@ const struct egl * init_cube_shadertoy(const struct gbm *gbm, const char *file,
 	gl.modelviewprojectionmatrix = glGetUniformLocation(gl.program, "modelviewprojectionMatrix");
 	gl.normalmatrix = glGetUniformLocation(gl.program, "normalMatrix");
 	gl.texture   = glGetUniformLocation(gl.program, "uTex");
+	gl.texel     = glGetUniformLocation(gl.program, "uTexel");
+	gl.sharpen   = glGetUniformLocation(gl.program, "uSharpen");
 
 	glViewport(0, 0, gbm->width, gbm->height);
 	glEnable(GL_CULL_FACE);
@@ -447,13 +409,25 @@ const struct egl * init_cube_shadertoy(const struct gbm *gbm, const char *file,
 	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, (const GLvoid *)(intptr_t)gl.normalsoffset);
 	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, (const GLvoid *)(intptr_t)gl.texcoordsoffset);
 
-	ret = init_shadertoy(file);
-	if (ret) {
-		printf("failed to initialize\n");
-		return NULL;
+	if (layers) {
+		/* the shadertoy output goes in the bottom left corner, besides
+		 * being used as the cube texture:
+		 */
+		gl.layer.name = "shadertoy";
+		gl.layer.x = 0;
+		gl.layer.y = MAX2(0, gbm->height - (int)gl.texh);
+		gl.layer.draw = draw_shadertoy_layer;
+
+		if (init_layer(&gl.egl, gbm, &gl.layer, DRM_FORMAT_XRGB8888, gl.texw, gl.texh))
+			return NULL;
+
+		if (init_hud_layer(&gl.egl, gbm))
+			return NULL;
 	}
 
 	gl.egl.draw = draw_cube_shadertoy;
+	gl.egl.add_sources = shadertoy_watch;
+	gl.egl.fini = shadertoy_fini;
 
 	return &gl.egl;
 }
@@ -29,11 +29,13 @@
 
 #include "common.h"
 #include "esUtil.h"
+#include "transform.h"
 
 static struct {
 	struct egl egl;
 
 	GLfloat aspect;
+	struct transform xf;
 	enum mode mode;
 	const struct gbm *gbm;
 
@@ -153,6 +155,7 @@ static const char *vertex_shader_source =
 		"uniform mat3 normalMatrix;         \n"
 		"                                   \n"
 		"attribute vec4 in_position;        \n"
+		"attribute vec4 in_instance;        \n"
 		"attribute vec3 in_normal;          \n"
 		"attribute vec2 in_TexCoord;        \n"
 		"                                   \n"
@@ -163,9 +166,10 @@ static const char *vertex_shader_source =
 		"                                   \n"
 		"void main()                        \n"
 		"{                                  \n"
-		"    gl_Position = modelviewprojectionMatrix * in_position;\n"
+		"    vec4 position = vec4(in_position.xyz * in_instance.w + in_instance.xyz, 1.0);\n"
+		"    gl_Position = modelviewprojectionMatrix * position;\n"
 		"    vec3 vEyeNormal = normalMatrix * in_normal;\n"
-		"    vec4 vPosition4 = modelviewMatrix * in_position;\n"
+		"    vec4 vPosition4 = modelviewMatrix * position;\n"
 		"    vec3 vPosition3 = vPosition4.xyz / vPosition4.w;\n"
 		"    vec3 vLightDir = normalize(lightSource.xyz - vPosition3);\n"
 		"    float diff = max(0.0, dot(vEyeNormal, vLightDir));\n"
@@ -523,56 +527,30 @@ static int init_tex(enum mode mode)
 	return -1;
 }
 
-static void draw_cube_tex(unsigned i)
+static void draw_cube_tex(unsigned i, int64_t time_ns)
 {
-	ESMatrix modelview;
+	float t = anim_step(time_ns);
+
+	(void)i;
 
 	/* clear the color buffer */
 	glClearColor(0.5, 0.5, 0.5, 1.0);
 	glClear(GL_COLOR_BUFFER_BIT);
 
-	esMatrixLoadIdentity(&modelview);
-	esTranslate(&modelview, 0.0f, 0.0f, -8.0f);
-	esRotate(&modelview, 45.0f + (0.25f * i), 1.0f, 0.0f, 0.0f);
-	esRotate(&modelview, 45.0f - (0.5f * i), 0.0f, 1.0f, 0.0f);
-	esRotate(&modelview, 10.0f + (0.15f * i), 0.0f, 0.0f, 1.0f);
-
-	ESMatrix projection;
-	esMatrixLoadIdentity(&projection);
-	esFrustum(&projection, -2.8f, +2.8f, -2.8f * gl.aspect, +2.8f * gl.aspect, 6.0f, 10.0f);
-
-	ESMatrix modelviewprojection;
-	esMatrixLoadIdentity(&modelviewprojection);
-	esMatrixMultiply(&modelviewprojection, &modelview, &projection);
-
-	float normal[9];
-	normal[0] = modelview.m[0][0];
-	normal[1] = modelview.m[0][1];
-	normal[2] = modelview.m[0][2];
-	normal[3] = modelview.m[1][0];
-	normal[4] = modelview.m[1][1];
-	normal[5] = modelview.m[1][2];
-	normal[6] = modelview.m[2][0];
-	normal[7] = modelview.m[2][1];
-	normal[8] = modelview.m[2][2];
-
-	glUniformMatrix4fv(gl.modelviewmatrix, 1, GL_FALSE, &modelview.m[0][0]);
-	glUniformMatrix4fv(gl.modelviewprojectionmatrix, 1, GL_FALSE, &modelviewprojection.m[0][0]);
-	glUniformMatrix3fv(gl.normalmatrix, 1, GL_FALSE, normal);
+	transform_update(&gl.xf, t);
+
+	glUniformMatrix4fv(gl.modelviewmatrix, 1, GL_FALSE, &gl.xf.modelview.m[0][0]);
+	glUniformMatrix4fv(gl.modelviewprojectionmatrix, 1, GL_FALSE, &gl.xf.modelviewprojection.m[0][0]);
+	glUniformMatrix3fv(gl.normalmatrix, 1, GL_FALSE, gl.xf.normal);
 	glUniform1i(gl.texture, 0); /* '0' refers to texture unit 0. */
 
 	if (gl.mode == NV12_2IMG)
 		glUniform1i(gl.textureuv, 1);
 
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 4, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 8, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 12, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 16, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 20, 4);
+	draw_cubes();
 }
 
-const struct egl * init_cube_tex(const struct gbm *gbm, enum mode mode, int samples)
+const struct egl * init_cube_tex(const struct gbm *gbm, enum mode mode, int samples, bool layers)
 {
 	const char *fragment_shader_source = (mode == NV12_2IMG) ?
 			fragment_shader_source_2img : fragment_shader_source_1img;
@@ -588,6 +566,7 @@ const struct egl * init_cube_tex(const struct gbm *gbm, enum mode mode, int samp
 		return NULL;
 
 	gl.aspect = (GLfloat)(gbm->height) / (GLfloat)(gbm->width);
+	transform_init(&gl.xf, 2.8f, gl.aspect);
 	gl.mode = mode;
 	gl.gbm = gbm;
 
@@ -600,6 +579,7 @@ const struct egl * init_cube_tex(const struct gbm *gbm, enum mode mode, int samp
 	glBindAttribLocation(gl.program, 0, "in_position");
 	glBindAttribLocation(gl.program, 1, "in_normal");
 	glBindAttribLocation(gl.program, 2, "in_color");
+	glBindAttribLocation(gl.program, CUBES_ATTRIB, "in_instance");
 
 	ret = link_program(gl.program);
 	if (ret)
@@ -643,6 +623,9 @@ const struct egl * init_cube_tex(const struct gbm *gbm, enum mode mode, int samp
 		return NULL;
 	}
 
+	if (layers && init_hud_layer(&gl.egl, gbm))
+		return NULL;
+
 	gl.egl.draw = draw_cube_tex;
 
 	return &gl.egl;
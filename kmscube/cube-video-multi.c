@@ -0,0 +1,574 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "esUtil.h"
+#include "transform.h"
+
+/* Several videos at once, each decoded by its own pipeline (and thread)
+ * and shown on its own cube, laid out in a grid.  For stress testing
+ * how many streams the decoders, the imports and the gpu keep up with.
+ *
+ * GLES2 has no instancing, and external textures can't go into a
+ * texture array, so the cubes are batched instead: the vertex buffer
+ * holds a copy of the cube per stream, tagged with the stream index,
+ * which picks the cube's transform from a uniform array and its texture
+ * unit in the fragment shader.  All cubes are one draw call.
+ */
+
+/* the minimum number of texture units of GLES2, more streams than the
+ * gpu has units for are dropped, see check_texture_units():
+ */
+#define MAX_STREAMS 8
+
+#define VERTS_PER_CUBE   24
+#define INDICES_PER_CUBE 36
+
+static struct {
+	struct egl egl;
+
+	GLfloat aspect;
+	struct transform xf;
+	const struct gbm *gbm;
+
+	GLuint program;
+	/* uniform handles: */
+	GLint modelviewmatrix, projectionmatrix;
+	GLuint vbo, ibo;
+
+	struct decoder *decoders[MAX_STREAMS];
+	const char *filenames[MAX_STREAMS];
+	unsigned num_streams;
+	unsigned cols, rows;
+	bool loop;                      /* with segment seeks */
+
+	bool shown[MAX_STREAMS];        /* has a frame this time */
+	int64_t retry_ns[MAX_STREAMS];  /* when a failed decoder is retried */
+	bool restarted[MAX_STREAMS];    /* don't wait for its first frame */
+
+	/* texture units each stream's frames take, 0 until known: */
+	GLint units[MAX_STREAMS];
+	GLint max_units;
+	unsigned num_samplers;          /* in the fragment shader */
+
+	EGLSyncKHR last_fence;
+} gl;
+
+static const struct egl *egl = &gl.egl;
+
+static const GLfloat vVertices[] = {
+		// front
+		-1.0f, -1.0f, +1.0f,
+		+1.0f, -1.0f, +1.0f,
+		-1.0f, +1.0f, +1.0f,
+		+1.0f, +1.0f, +1.0f,
+		// back
+		+1.0f, -1.0f, -1.0f,
+		-1.0f, -1.0f, -1.0f,
+		+1.0f, +1.0f, -1.0f,
+		-1.0f, +1.0f, -1.0f,
+		// right
+		+1.0f, -1.0f, +1.0f,
+		+1.0f, -1.0f, -1.0f,
+		+1.0f, +1.0f, +1.0f,
+		+1.0f, +1.0f, -1.0f,
+		// left
+		-1.0f, -1.0f, -1.0f,
+		-1.0f, -1.0f, +1.0f,
+		-1.0f, +1.0f, -1.0f,
+		-1.0f, +1.0f, +1.0f,
+		// top
+		-1.0f, +1.0f, +1.0f,
+		+1.0f, +1.0f, +1.0f,
+		-1.0f, +1.0f, -1.0f,
+		+1.0f, +1.0f, -1.0f,
+		// bottom
+		-1.0f, -1.0f, -1.0f,
+		+1.0f, -1.0f, -1.0f,
+		-1.0f, -1.0f, +1.0f,
+		+1.0f, -1.0f, +1.0f,
+};
+
+static const GLfloat vTexCoords[] = {
+		//front
+		0.0f, 1.0f,
+		1.0f, 1.0f,
+		0.0f, 0.0f,
+		1.0f, 0.0f,
+		//back
+		0.0f, 1.0f,
+		1.0f, 1.0f,
+		0.0f, 0.0f,
+		1.0f, 0.0f,
+		//right
+		0.0f, 1.0f,
+		1.0f, 1.0f,
+		0.0f, 0.0f,
+		1.0f, 0.0f,
+		//left
+		0.0f, 1.0f,
+		1.0f, 1.0f,
+		0.0f, 0.0f,
+		1.0f, 0.0f,
+		//top
+		0.0f, 1.0f,
+		1.0f, 1.0f,
+		0.0f, 0.0f,
+		1.0f, 0.0f,
+		//bottom
+		0.0f, 1.0f,
+		1.0f, 1.0f,
+		0.0f, 0.0f,
+		1.0f, 0.0f,
+};
+
+static const GLfloat vNormals[] = {
+		// front
+		+0.0f, +0.0f, +1.0f, // forward
+		+0.0f, +0.0f, +1.0f, // forward
+		+0.0f, +0.0f, +1.0f, // forward
+		+0.0f, +0.0f, +1.0f, // forward
+		// back
+		+0.0f, +0.0f, -1.0f, // backward
+		+0.0f, +0.0f, -1.0f, // backward
+		+0.0f, +0.0f, -1.0f, // backward
+		+0.0f, +0.0f, -1.0f, // backward
+		// right
+		+1.0f, +0.0f, +0.0f, // right
+		+1.0f, +0.0f, +0.0f, // right
+		+1.0f, +0.0f, +0.0f, // right
+		+1.0f, +0.0f, +0.0f, // right
+		// left
+		-1.0f, +0.0f, +0.0f, // left
+		-1.0f, +0.0f, +0.0f, // left
+		-1.0f, +0.0f, +0.0f, // left
+		-1.0f, +0.0f, +0.0f, // left
+		// top
+		+0.0f, +1.0f, +0.0f, // up
+		+0.0f, +1.0f, +0.0f, // up
+		+0.0f, +1.0f, +0.0f, // up
+		+0.0f, +1.0f, +0.0f, // up
+		// bottom
+		+0.0f, -1.0f, +0.0f, // down
+		+0.0f, -1.0f, +0.0f, // down
+		+0.0f, -1.0f, +0.0f, // down
+		+0.0f, -1.0f, +0.0f  // down
+};
+
+static const char *vertex_shader_source =
+		"uniform mat4 modelviewMatrix[8];   \n"   /* MAX_STREAMS */
+		"uniform mat4 projectionMatrix;     \n"
+		"                                   \n"
+		"attribute vec4 in_position;        \n"
+		"attribute vec2 in_TexCoord;        \n"
+		"attribute vec3 in_normal;          \n"
+		"attribute float in_stream;         \n"
+		"                                   \n"
+		"vec4 lightSource = vec4(2.0, 2.0, 20.0, 0.0);\n"
+		"                                   \n"
+		"varying vec4 vVaryingColor;        \n"
+		"varying vec2 vTexCoord;            \n"
+		"varying float vStream;             \n"
+		"                                   \n"
+		"void main()                        \n"
+		"{                                  \n"
+		"    mat4 modelview = modelviewMatrix[int(in_stream)];\n"
+		"    vec4 vPosition4 = modelview * in_position;\n"
+		"    gl_Position = projectionMatrix * vPosition4;\n"
+		"    mat3 normalMatrix = mat3(modelview[0].xyz, modelview[1].xyz, modelview[2].xyz);\n"
+		"    vec3 vEyeNormal = normalize(normalMatrix * in_normal);\n"
+		"    vec3 vPosition3 = vPosition4.xyz / vPosition4.w;\n"
+		"    vec3 vLightDir = normalize(lightSource.xyz - vPosition3);\n"
+		"    float diff = max(0.0, dot(vEyeNormal, vLightDir));\n"
+		"    vVaryingColor = vec4(diff * vec3(1.0, 1.0, 1.0), 1.0);\n"
+		"    vTexCoord = in_TexCoord;       \n"
+		"    vStream = in_stream;           \n"
+		"}                                  \n";
+
+/* Samplers can only be indexed with constants in GLES2, hence the chain
+ * of ifs; the stream index is the same across a cube, so there is no
+ * divergence within a face.  Every sampler takes a texture unit, so
+ * there are only as many as there are streams:
+ */
+static const char *fragment_shader_head =
+		"#extension GL_OES_EGL_image_external : enable\n"
+		"precision mediump float;           \n"
+		"                                   \n"
+		"uniform samplerExternalOES uTex[%u];\n"
+		"                                   \n"
+		"varying vec4 vVaryingColor;        \n"
+		"varying vec2 vTexCoord;            \n"
+		"varying float vStream;             \n"
+		"                                   \n"
+		"vec4 video()                       \n"
+		"{                                  \n";
+
+static const char *fragment_shader_tail =
+		"}                                  \n"
+		"                                   \n"
+		"void main()                        \n"
+		"{                                  \n"
+		"    gl_FragColor = vVaryingColor * video();\n"
+		"}                                  \n";
+
+static char *fragment_shader_source(unsigned streams)
+{
+	size_t size = 2048;
+	char *src = malloc(size);
+	size_t len;
+
+	len = snprintf(src, size, fragment_shader_head, streams);
+	for (unsigned n = 0; n + 1 < streams; n++)
+		len += snprintf(src + len, size - len,
+				"    if (vStream < %u.5) return texture2D(uTex[%u], vTexCoord);\n",
+				n, n);
+	len += snprintf(src + len, size - len,
+			"    return texture2D(uTex[%u], vTexCoord);\n", streams - 1);
+	snprintf(src + len, size - len, "%s", fragment_shader_tail);
+
+	return src;
+}
+
+static void restart_stream(unsigned n)
+{
+	gl.units[n] = 0;
+	gl.restarted[n] = true;
+	gl.decoders[n] = video_init(&gl.egl, gl.gbm, gl.filenames[n], gl.loop);
+	if (!gl.decoders[n]) {
+		printf("cannot restart video decoder for stream %u, retrying in a second\n", n);
+		gl.retry_ns[n] = get_time_ns() + NSEC_PER_SEC;
+		return;
+	}
+
+	video_play(gl.decoders[n]);
+}
+
+/* An external texture can take more than one unit (eg. one per plane),
+ * which is only known once a frame is bound to it.  Streams that don't
+ * fit in GL_MAX_TEXTURE_IMAGE_UNITS are dropped, the last ones first:
+ */
+static void check_texture_units(unsigned n)
+{
+	glGetTexParameteriv(GL_TEXTURE_EXTERNAL_OES, GL_REQUIRED_TEXTURE_IMAGE_UNITS_OES,
+			&gl.units[n]);
+	gl.units[n] = MAX2(gl.units[n], 1);
+
+	while (gl.num_streams > 1) {
+		GLint total = 0;
+
+		/* unused samplers, and ones without a frame yet, take one: */
+		for (unsigned i = 0; i < gl.num_samplers; i++)
+			total += (i < gl.num_streams && gl.units[i]) ? gl.units[i] : 1;
+
+		if (total <= gl.max_units)
+			break;
+
+		gl.num_streams--;
+		printf("not enough texture units (%d) for stream %u, dropping it\n",
+				gl.max_units, gl.num_streams);
+		if (gl.decoders[gl.num_streams]) {
+			video_deinit(gl.decoders[gl.num_streams]);
+			gl.decoders[gl.num_streams] = NULL;
+		}
+	}
+}
+
+static void update_video_frames(int64_t time_ns)
+{
+	if (gl.last_fence) {
+		egl->eglClientWaitSyncKHR(egl->display, gl.last_fence, 0, EGL_FOREVER_KHR);
+		egl->eglDestroySyncKHR(egl->display, gl.last_fence);
+		gl.last_fence = NULL;
+	}
+
+	for (unsigned n = 0; n < gl.num_streams; n++) {
+		GLuint frame = 0;
+		bool eos = false;
+
+		if (!gl.decoders[n] && get_time_ns() >= gl.retry_ns[n])
+			restart_stream(n);
+
+		/* only the first start waits for the first frame, a
+		 * restart would hold up the other streams with it:
+		 */
+		if (gl.decoders[n])
+			frame = video_frame(gl.decoders[n], time_ns,
+					!gl.restarted[n], &eos);
+
+		/* restart at the end, without --loop or if segment seeks
+		 * don't work for the file.  The cube is hidden until the
+		 * new decoder has a frame:
+		 */
+		if (eos) {
+			video_deinit(gl.decoders[n]);
+			restart_stream(n);
+		}
+
+		gl.shown[n] = frame != 0;
+
+		glActiveTexture(GL_TEXTURE0 + n);
+		glBindTexture(GL_TEXTURE_EXTERNAL_OES, frame);
+
+		if (frame && !gl.units[n])
+			check_texture_units(n);
+	}
+	glActiveTexture(GL_TEXTURE0);
+}
+
+static void draw_cube_video_multi(unsigned i, int64_t time_ns)
+{
+	ESMatrix modelview[MAX_STREAMS];
+	float t = anim_step(time_ns);
+	/* the visible size of the z=-8 plane, for the frustum below: */
+	float width = 2.1f * 8.0f / 6.0f * 2.0f;
+	float height = width * gl.aspect;
+	float cell_w = width / gl.cols, cell_h = height / gl.rows;
+	/* the cube spans ~3.5 units at its widest: */
+	float scale = MIN2(cell_w, cell_h) / 3.6f;
+
+	(void)i;
+
+	update_video_frames(time_ns);
+
+	/* clear the color buffer */
+	glClearColor(0.5, 0.5, 0.5, 1.0);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	for (unsigned n = 0; n < gl.num_streams; n++) {
+		unsigned col = n % gl.cols, row = n / gl.cols;
+		/* each cube a little out of phase with the others: */
+		float tn = t + n * 20.0f;
+
+		/* degenerate, so it isn't drawn: */
+		if (!gl.shown[n]) {
+			memset(&modelview[n], 0, sizeof(modelview[n]));
+			continue;
+		}
+
+		transform_modelview(&modelview[n], tn, scale,
+				-width / 2 + (col + 0.5f) * cell_w,
+				height / 2 - (row + 0.5f) * cell_h,
+				-8.0f);
+	}
+
+	glUseProgram(gl.program);
+
+	glUniformMatrix4fv(gl.modelviewmatrix, gl.num_streams, GL_FALSE, &modelview[0].m[0][0]);
+	glUniformMatrix4fv(gl.projectionmatrix, 1, GL_FALSE, &gl.xf.projection.m[0][0]);
+
+	glDrawElements(GL_TRIANGLES, gl.num_streams * INDICES_PER_CUBE, GL_UNSIGNED_SHORT, 0);
+
+	gl.last_fence = egl->eglCreateSyncKHR(egl->display, EGL_SYNC_FENCE_KHR, NULL);
+}
+
+/* Stops the decoders, which prints each stream's dropped and repeated
+ * frame counts:
+ */
+static void fini_cube_video_multi(void)
+{
+	for (unsigned n = 0; n < gl.num_streams; n++) {
+		if (!gl.decoders[n])
+			continue;
+		printf("stream %u (%s):\n", n, gl.filenames[n]);
+		video_deinit(gl.decoders[n]);
+		gl.decoders[n] = NULL;
+	}
+
+	video_wait();
+}
+
+/* A copy of the cube per stream, with the stream index as an extra
+ * attribute.  The faces are strips of four vertices in the tables above,
+ * here they become two triangles each, so the cubes can be drawn at
+ * once:
+ */
+static void init_geometry(void)
+{
+	unsigned nverts = gl.num_streams * VERTS_PER_CUBE;
+	GLfloat *positions = malloc(nverts * 3 * sizeof(GLfloat));
+	GLfloat *texcoords = malloc(nverts * 2 * sizeof(GLfloat));
+	GLfloat *normals = malloc(nverts * 3 * sizeof(GLfloat));
+	GLfloat *streams = malloc(nverts * sizeof(GLfloat));
+	GLushort *indices = malloc(gl.num_streams * INDICES_PER_CUBE * sizeof(GLushort));
+	size_t positionsoffset = 0;
+	size_t texcoordsoffset = positionsoffset + nverts * 3 * sizeof(GLfloat);
+	size_t normalsoffset = texcoordsoffset + nverts * 2 * sizeof(GLfloat);
+	size_t streamsoffset = normalsoffset + nverts * 3 * sizeof(GLfloat);
+	size_t size = streamsoffset + nverts * sizeof(GLfloat);
+	GLushort *idx = indices;
+
+	assert(ARRAY_SIZE(vVertices) == VERTS_PER_CUBE * 3);
+
+	for (unsigned n = 0; n < gl.num_streams; n++) {
+		unsigned base = n * VERTS_PER_CUBE;
+
+		memcpy(&positions[base * 3], vVertices, sizeof(vVertices));
+		memcpy(&texcoords[base * 2], vTexCoords, sizeof(vTexCoords));
+		memcpy(&normals[base * 3], vNormals, sizeof(vNormals));
+
+		for (unsigned v = 0; v < VERTS_PER_CUBE; v++)
+			streams[base + v] = n;
+
+		for (unsigned v = base; v < base + VERTS_PER_CUBE; v += 4) {
+			*idx++ = v + 0; *idx++ = v + 1; *idx++ = v + 2;
+			*idx++ = v + 2; *idx++ = v + 1; *idx++ = v + 3;
+		}
+	}
+
+	glGenBuffers(1, &gl.vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, gl.vbo);
+	glBufferData(GL_ARRAY_BUFFER, size, 0, GL_STATIC_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, positionsoffset, nverts * 3 * sizeof(GLfloat), positions);
+	glBufferSubData(GL_ARRAY_BUFFER, texcoordsoffset, nverts * 2 * sizeof(GLfloat), texcoords);
+	glBufferSubData(GL_ARRAY_BUFFER, normalsoffset, nverts * 3 * sizeof(GLfloat), normals);
+	glBufferSubData(GL_ARRAY_BUFFER, streamsoffset, nverts * sizeof(GLfloat), streams);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (const GLvoid *)(intptr_t)positionsoffset);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, (const GLvoid *)(intptr_t)texcoordsoffset);
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, (const GLvoid *)(intptr_t)normalsoffset);
+	glEnableVertexAttribArray(2);
+	glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, 0, (const GLvoid *)(intptr_t)streamsoffset);
+	glEnableVertexAttribArray(3);
+
+	glGenBuffers(1, &gl.ibo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gl.ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+			gl.num_streams * INDICES_PER_CUBE * sizeof(GLushort),
+			indices, GL_STATIC_DRAW);
+
+	free(positions);
+	free(texcoords);
+	free(normals);
+	free(streams);
+	free(indices);
+}
+
+const struct egl * init_cube_video_multi(const struct gbm *gbm, const char *filenames,
+		unsigned streams, int samples, bool loop)
+{
+	const char *names[MAX_STREAMS];
+	unsigned count = 0;
+	char *fnames, *s;
+	char *fragment_shader;
+	int ret;
+
+	if (streams < 1 || streams > MAX_STREAMS) {
+		printf("invalid number of streams: %u (must be 1..%d)\n",
+				streams, MAX_STREAMS);
+		return NULL;
+	}
+
+	ret = init_egl(&gl.egl, gbm, samples);
+	if (ret)
+		return NULL;
+
+	glGetIntegerv(GL_MAX_TEXTURE_IMAGE_UNITS, &gl.max_units);
+	if ((GLint)streams > gl.max_units) {
+		printf("only %d texture units, playing %d streams\n",
+				gl.max_units, gl.max_units);
+		streams = gl.max_units;
+	}
+
+	if (egl_check(&gl.egl, glEGLImageTargetTexture2DOES) ||
+	    egl_check(egl, eglCreateSyncKHR) ||
+	    egl_check(egl, eglDestroySyncKHR) ||
+	    egl_check(egl, eglClientWaitSyncKHR))
+		return NULL;
+
+	/* with fewer files than streams, the files are reused: */
+	fnames = strdup(filenames);
+	while ((s = strstr(fnames, ",")) && count < MAX_STREAMS - 1) {
+		names[count++] = fnames;
+		s[0] = '\0';
+		fnames = &s[1];
+	}
+	names[count++] = fnames;
+
+	gl.gbm = gbm;
+	gl.loop = loop;
+	gl.num_streams = streams;
+	gl.cols = ceilf(sqrtf(streams));
+	gl.rows = (streams + gl.cols - 1) / gl.cols;
+	gl.aspect = (GLfloat)(gbm->height) / (GLfloat)(gbm->width);
+	transform_init(&gl.xf, 2.1f, gl.aspect);
+
+	for (unsigned n = 0; n < streams; n++) {
+		gl.filenames[n] = names[n % count];
+		gl.decoders[n] = video_init(&gl.egl, gbm, gl.filenames[n], loop);
+		if (!gl.decoders[n]) {
+			printf("cannot create video decoder for stream %u\n", n);
+			return NULL;
+		}
+	}
+
+	/* start them all once they are set up, rather than staggered: */
+	for (unsigned n = 0; n < streams; n++)
+		video_play(gl.decoders[n]);
+
+	gl.num_samplers = streams;
+	fragment_shader = fragment_shader_source(streams);
+	ret = create_program(vertex_shader_source, fragment_shader);
+	free(fragment_shader);
+	if (ret < 0)
+		return NULL;
+
+	gl.program = ret;
+
+	glBindAttribLocation(gl.program, 0, "in_position");
+	glBindAttribLocation(gl.program, 1, "in_TexCoord");
+	glBindAttribLocation(gl.program, 2, "in_normal");
+	glBindAttribLocation(gl.program, 3, "in_stream");
+
+	ret = link_program(gl.program);
+	if (ret)
+		return NULL;
+
+	gl.modelviewmatrix = glGetUniformLocation(gl.program, "modelviewMatrix");
+	gl.projectionmatrix = glGetUniformLocation(gl.program, "projectionMatrix");
+
+	glUseProgram(gl.program);
+	for (unsigned n = 0; n < streams; n++) {
+		char name[16];
+
+		/* every sampler on its own unit: */
+		snprintf(name, sizeof(name), "uTex[%u]", n);
+		glUniform1i(glGetUniformLocation(gl.program, name), n);
+	}
+
+	glViewport(0, 0, gbm->width, gbm->height);
+	glEnable(GL_CULL_FACE);
+
+	init_geometry();
+
+	printf("Playing %u streams\n", streams);
+
+	gl.egl.draw = draw_cube_video_multi;
+	gl.egl.fini = fini_cube_video_multi;
+
+	return &gl.egl;
+}
@@ -30,11 +30,13 @@
 
 #include "common.h"
 #include "esUtil.h"
+#include "transform.h"
 
 static struct {
 	struct egl egl;
 
 	GLfloat aspect;
+	struct transform xf;
 	const struct gbm *gbm;
 
 	GLuint program, blit_program;
@@ -43,14 +45,24 @@ static struct {
 	GLint texture, blit_texture;
 	GLuint vbo;
 	GLuint positionsoffset, texcoordsoffset, normalsoffset;
-	GLuint tex;
+	GLuint tex;            /* current frame, owned by the decoder */
 
-	/* video decoder: */
-	struct decoder *decoder;
+	/* video decoder, and the one for the next file in the playlist
+	 * which prerolls while this one plays:
+	 */
+	struct decoder *decoder, *next_decoder;
 	int filenames_count, idx;
 	const char *filenames[32];
+	bool loop;             /* a single file, looped with segment seeks */
+	int64_t retry_ns;      /* when to try the playlist again, if none opened */
 
 	EGLSyncKHR last_fence;
+
+	/* with --layers the video goes on its own layer, instead of
+	 * being blitted as background:
+	 */
+	bool layered;
+	struct layer layer;
 } gl;
 
 static const struct egl *egl = &gl.egl;
@@ -220,10 +232,56 @@ static const char *fragment_shader_source =
 		"}                                  \n";
 
 
-static void draw_cube_video(unsigned i)
+/* Preroll the next file of the playlist (or the same one again), to
+ * switch to it at the end of the stream without a gap.  With --loop a
+ * single file loops by itself instead:
+ */
+static void preroll_next(void)
+{
+	if (!gl.loop)
+		gl.next_decoder = video_init(&gl.egl, gl.gbm,
+				gl.filenames[(gl.idx + 1) % gl.filenames_count], false);
+}
+
+/* At the end of the stream, switch to the prerolled next file, or the
+ * first one after it that opens.  If none does, the current decoder
+ * stays (on its last frame), and the playlist is tried again a second
+ * later:
+ */
+static bool next_file(void)
+{
+	struct decoder *next = gl.next_decoder;
+	int idx = (gl.idx + 1) % gl.filenames_count;
+
+	if (get_time_ns() < gl.retry_ns)
+		return false;
+
+	for (int n = 0; !next && n < gl.filenames_count; n++) {
+		next = video_init(&gl.egl, gl.gbm, gl.filenames[idx], gl.loop);
+		if (!next)
+			idx = (idx + 1) % gl.filenames_count;
+	}
+
+	if (!next) {
+		printf("no file of the playlist opens, retrying in a second\n");
+		gl.retry_ns = get_time_ns() + NSEC_PER_SEC;
+		return false;
+	}
+
+	video_deinit(gl.decoder);
+	gl.decoder = next;
+	gl.idx = idx;
+	video_play(gl.decoder);
+	preroll_next();
+
+	return true;
+}
+
+/* Show the video frame due at time_ns, see video_frame(): */
+static void update_video_frame(int64_t time_ns)
 {
-	ESMatrix modelview;
-	EGLImage frame;
+	GLuint frame;
+	bool eos;
 
 	if (gl.last_fence) {
 		egl->eglClientWaitSyncKHR(egl->display, gl.last_fence, 0, EGL_FOREVER_KHR);
@@ -231,64 +289,65 @@ static void draw_cube_video(unsigned i)
 		gl.last_fence = NULL;
 	}
 
-	frame = video_frame(gl.decoder);
-	if (!frame) {
-		/* end of stream */
-		glDeleteTextures(1, &gl.tex);
-		glGenTextures(1, &gl.tex);
-		video_deinit(gl.decoder);
-		gl.idx = (gl.idx + 1) % gl.filenames_count;
-		gl.decoder = video_init(&gl.egl, gl.gbm, gl.filenames[gl.idx]);
-	}
+	/* the decoder keeps the imported frames (and their textures)
+	 * around, so this is just a bind:
+	 */
+	frame = video_frame(gl.decoder, time_ns, true, &eos);
+	if (eos && next_file())
+		frame = video_frame(gl.decoder, time_ns, true, &eos);
+	else if (eos)
+		frame = gl.tex;
+	gl.tex = frame;
 
 	glUseProgram(gl.blit_program);
 
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_EXTERNAL_OES, gl.tex);
-	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	egl->glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, frame);
+}
+
+static void blit_video_frame(void)
+{
+	glUseProgram(gl.blit_program);
+	glUniform1i(gl.blit_texture, 0); /* '0' refers to texture unit 0. */
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+}
+
+/* the layer framebuffer is already bound by draw_layers(): */
+static void draw_video_layer(struct layer *layer, unsigned i, int64_t time_ns)
+{
+	(void)layer; (void)i;
+
+	update_video_frame(time_ns);
+	blit_video_frame();
+}
+
+static void draw_cube_video(unsigned i, int64_t time_ns)
+{
+	float t = anim_step(time_ns);
+
+	(void)i;
+
+	if (gl.layered) {
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_EXTERNAL_OES, gl.tex);
+	} else {
+		update_video_frame(time_ns);
+	}
 
 	/* clear the color buffer */
 	glClearColor(0.5, 0.5, 0.5, 1.0);
 	glClear(GL_COLOR_BUFFER_BIT);
 
-	glUseProgram(gl.blit_program);
-	glUniform1i(gl.blit_texture, 0); /* '0' refers to texture unit 0. */
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	if (!gl.layered)
+		blit_video_frame();
 
 	glUseProgram(gl.program);
 
-	esMatrixLoadIdentity(&modelview);
-	esTranslate(&modelview, 0.0f, 0.0f, -8.0f);
-	esRotate(&modelview, 45.0f + (0.25f * i), 1.0f, 0.0f, 0.0f);
-	esRotate(&modelview, 45.0f - (0.5f * i), 0.0f, 1.0f, 0.0f);
-	esRotate(&modelview, 10.0f + (0.15f * i), 0.0f, 0.0f, 1.0f);
-
-	ESMatrix projection;
-	esMatrixLoadIdentity(&projection);
-	esFrustum(&projection, -2.1f, +2.1f, -2.1f * gl.aspect, +2.1f * gl.aspect, 6.0f, 10.0f);
-
-	ESMatrix modelviewprojection;
-	esMatrixLoadIdentity(&modelviewprojection);
-	esMatrixMultiply(&modelviewprojection, &modelview, &projection);
-
-	float normal[9];
-	normal[0] = modelview.m[0][0];
-	normal[1] = modelview.m[0][1];
-	normal[2] = modelview.m[0][2];
-	normal[3] = modelview.m[1][0];
-	normal[4] = modelview.m[1][1];
-	normal[5] = modelview.m[1][2];
-	normal[6] = modelview.m[2][0];
-	normal[7] = modelview.m[2][1];
-	normal[8] = modelview.m[2][2];
-
-	glUniformMatrix4fv(gl.modelviewmatrix, 1, GL_FALSE, &modelview.m[0][0]);
-	glUniformMatrix4fv(gl.modelviewprojectionmatrix, 1, GL_FALSE, &modelviewprojection.m[0][0]);
-	glUniformMatrix3fv(gl.normalmatrix, 1, GL_FALSE, normal);
+	transform_update(&gl.xf, t);
+
+	glUniformMatrix4fv(gl.modelviewmatrix, 1, GL_FALSE, &gl.xf.modelview.m[0][0]);
+	glUniformMatrix4fv(gl.modelviewprojectionmatrix, 1, GL_FALSE, &gl.xf.modelviewprojection.m[0][0]);
+	glUniformMatrix3fv(gl.normalmatrix, 1, GL_FALSE, gl.xf.normal);
 	glUniform1i(gl.texture, 0); /* '0' refers to texture unit 0. */
 
 	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
@@ -301,7 +360,16 @@ static void draw_cube_video(unsigned i)
 	gl.last_fence = egl->eglCreateSyncKHR(egl->display, EGL_SYNC_FENCE_KHR, NULL);
 }
 
-const struct egl * init_cube_video(const struct gbm *gbm, const char *filenames, int samples)
+static void fini_cube_video(void)
+{
+	if (gl.decoder)
+		video_deinit(gl.decoder);
+	if (gl.next_decoder)
+		video_deinit(gl.next_decoder);
+	video_wait();
+}
+
+const struct egl * init_cube_video(const struct gbm *gbm, const char *filenames, int samples, bool layers, bool loop)
 {
 	char *fnames, *s;
 	int ret, i = 0;
@@ -326,14 +394,19 @@ const struct egl * init_cube_video(const struct gbm *gbm, const char *filenames,
 	gl.filenames[i] = fnames;
 	gl.filenames_count = ++i;
 
-	gl.decoder = video_init(&gl.egl, gbm, gl.filenames[gl.idx]);
+	gl.gbm = gbm;
+	gl.loop = loop && gl.filenames_count == 1;
+
+	gl.decoder = video_init(&gl.egl, gbm, gl.filenames[gl.idx], gl.loop);
 	if (!gl.decoder) {
 		printf("cannot create video decoder\n");
 		return NULL;
 	}
+	video_play(gl.decoder);
+	preroll_next();
 
 	gl.aspect = (GLfloat)(gbm->height) / (GLfloat)(gbm->width);
-	gl.gbm = gbm;
+	transform_init(&gl.xf, 2.1f, gl.aspect);
 
 	ret = create_program(blit_vs, blit_fs);
 	if (ret < 0)
@@ -389,9 +462,24 @@ const struct egl * init_cube_video(const struct gbm *gbm, const char *filenames,
 	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, (const GLvoid *)(intptr_t)gl.normalsoffset);
 	glEnableVertexAttribArray(2);
 
-	glGenTextures(1, &gl.tex);
+	if (layers) {
+		/* video picture-in-picture in the bottom right quarter: */
+		gl.layered = true;
+		gl.layer.name = "video";
+		gl.layer.x = gbm->width / 2;
+		gl.layer.y = gbm->height / 2;
+		gl.layer.draw = draw_video_layer;
+
+		if (init_layer(&gl.egl, gbm, &gl.layer, DRM_FORMAT_XRGB8888,
+				gbm->width / 2, gbm->height / 2))
+			return NULL;
+
+		if (init_hud_layer(&gl.egl, gbm))
+			return NULL;
+	}
 
 	gl.egl.draw = draw_cube_video;
+	gl.egl.fini = fini_cube_video;
 
 	return &gl.egl;
 }
@@ -0,0 +1,171 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <GLES3/gl3.h>
+
+#include "common.h"
+
+/* The cube modes draw their cube (the 24 vertices of 6 four vertex
+ * strips, in the same layout in each mode) as indexed triangles in a
+ * single draw.  With --cubes there are more of them, in a 3d grid that
+ * fills the space of the one cube, positioned by a per-instance
+ * attribute (offset, scale) that the vertex shaders apply to
+ * in_position.  With GLES3 that is one instanced draw for all cubes,
+ * otherwise the attribute is set per cube and each cube is a draw.
+ */
+
+#define VERTS_PER_CUBE     24
+#define INDICES_PER_CUBE   36
+
+static struct {
+	unsigned count;
+	bool instanced;
+	GLuint ibo, instance_vbo;
+	GLfloat *instances;      /* without instancing */
+} cubes;
+
+static bool has_instancing(void)
+{
+	const char *version = (const char *)glGetString(GL_VERSION);
+	int major = 0;
+
+	if (!version || sscanf(version, "OpenGL ES %d", &major) != 1)
+		return false;
+
+	return major >= 3;
+}
+
+int init_cubes(unsigned count)
+{
+	static const GLushort strip[] = { 0, 1, 2, 2, 1, 3 };
+	GLushort indices[INDICES_PER_CUBE];
+	GLfloat *instances;
+	unsigned side, n = 0;
+	float scale;
+
+	if (count < 1 || count > MAX_CUBES) {
+		printf("invalid number of cubes: %u (must be 1..%d)\n",
+				count, MAX_CUBES);
+		return -1;
+	}
+
+	/* each face's strip as two triangles, same winding: */
+	for (unsigned i = 0; i < INDICES_PER_CUBE; i++)
+		indices[i] = (i / 6) * 4 + strip[i % 6];
+
+	glGenBuffers(1, &cubes.ibo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cubes.ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+
+	/* a side x side x side grid, with half a cube's width of space
+	 * between the cubes (a pitch of 3 for cubes 2 wide), scaled down
+	 * to the size of the single cube:
+	 */
+	side = ceilf(cbrtf(count));
+	while (side * side * side < count)
+		side++;
+	scale = 1.0f / (1.5f * side - 0.5f);
+
+	instances = malloc(count * 4 * sizeof(GLfloat));
+	for (unsigned z = 0; z < side && n < count; z++) {
+		for (unsigned y = 0; y < side && n < count; y++) {
+			for (unsigned x = 0; x < side && n < count; x++, n++) {
+				instances[n * 4 + 0] = (3.0f * x - 1.5f * (side - 1)) * scale;
+				instances[n * 4 + 1] = (3.0f * y - 1.5f * (side - 1)) * scale;
+				instances[n * 4 + 2] = (3.0f * z - 1.5f * (side - 1)) * scale;
+				instances[n * 4 + 3] = scale;
+			}
+		}
+	}
+
+	cubes.count = count;
+	cubes.instanced = count > 1 && has_instancing();
+
+	if (cubes.instanced) {
+		glGenBuffers(1, &cubes.instance_vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, cubes.instance_vbo);
+		glBufferData(GL_ARRAY_BUFFER, count * 4 * sizeof(GLfloat),
+				instances, GL_STATIC_DRAW);
+		free(instances);
+	} else {
+		cubes.instances = instances;
+	}
+
+	if (count > 1)
+		printf("Drawing %u cubes, %s\n", count,
+				cubes.instanced ? "instanced" : "one draw per cube");
+
+	return 0;
+}
+
+/* Draw the cube(s), with the mode's program and vertex arrays set up: */
+void draw_cubes(void)
+{
+	GLint vbo;
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cubes.ibo);
+
+	if (cubes.count == 1) {
+		/* the attribute's default of (0, 0, 0, 1) is the one cube: */
+		glDrawElements(GL_TRIANGLES, INDICES_PER_CUBE, GL_UNSIGNED_SHORT, 0);
+		return;
+	}
+
+	if (!cubes.instanced) {
+		for (unsigned n = 0; n < cubes.count; n++) {
+			glVertexAttrib4fv(CUBES_ATTRIB, &cubes.instances[n * 4]);
+			glDrawElements(GL_TRIANGLES, INDICES_PER_CUBE, GL_UNSIGNED_SHORT, 0);
+		}
+		glVertexAttrib4f(CUBES_ATTRIB, 0.0f, 0.0f, 0.0f, 1.0f);
+		return;
+	}
+
+	glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &vbo);
+
+	glBindBuffer(GL_ARRAY_BUFFER, cubes.instance_vbo);
+	glVertexAttribPointer(CUBES_ATTRIB, 4, GL_FLOAT, GL_FALSE, 0, 0);
+	glEnableVertexAttribArray(CUBES_ATTRIB);
+	glVertexAttribDivisor(CUBES_ATTRIB, 1);
+
+	glDrawElementsInstanced(GL_TRIANGLES, INDICES_PER_CUBE, GL_UNSIGNED_SHORT,
+			0, cubes.count);
+
+	/* so the other draws get the default again: */
+	glVertexAttribDivisor(CUBES_ATTRIB, 0);
+	glDisableVertexAttribArray(CUBES_ATTRIB);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+}
+
+void dump_cubes(unsigned frames, double secs)
+{
+	unsigned draws = cubes.instanced ? 1 : cubes.count;
+
+	if (cubes.count < 2 || secs <= 0.0)
+		return;
+
+	printf("  %u cubes: %.0f draws/s, %.2f Mtriangles/s\n", cubes.count,
+			frames * draws / secs,
+			frames * 12.0 * cubes.count / secs / 1000000.0);
+}
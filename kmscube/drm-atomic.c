@@ -23,143 +23,1155 @@
 
 #include <assert.h>
 #include <errno.h>
-#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "common.h"
+#include "capture.h"
 #include "drm-common.h"
+#include "evloop.h"
+#include "pacing.h"
+#include "spsc-queue.h"
+#include "stats.h"
 
 #define VOID2U64(x) ((uint64_t)(unsigned long)(x))
 
 static struct drm drm = {
-	.kms_out_fence_fd = -1,
+	.kms_in_fence_fd = -1,
+	.outputs = {
+		[0 ... MAX_OUTPUTS - 1] = { .kms_out_fence_fd = -1 },
+	},
 };
 
-static int add_connector_property(drmModeAtomicReq *req, uint32_t obj_id,
-					const char *name, uint64_t value)
-{
-	struct connector *obj = drm.connector;
-	unsigned int i;
-	int prop_id = 0;
+static const char * const plane_prop_names[PLANE_PROP_COUNT] = {
+	[PLANE_FB_ID]       = "FB_ID",
+	[PLANE_CRTC_ID]     = "CRTC_ID",
+	[PLANE_SRC_X]       = "SRC_X",
+	[PLANE_SRC_Y]       = "SRC_Y",
+	[PLANE_SRC_W]       = "SRC_W",
+	[PLANE_SRC_H]       = "SRC_H",
+	[PLANE_CRTC_X]      = "CRTC_X",
+	[PLANE_CRTC_Y]      = "CRTC_Y",
+	[PLANE_CRTC_W]      = "CRTC_W",
+	[PLANE_CRTC_H]      = "CRTC_H",
+	[PLANE_IN_FENCE_FD] = "IN_FENCE_FD",
+	[PLANE_ZPOS]        = "zpos",
+};
 
-	for (i = 0 ; i < obj->props->count_props ; i++) {
-		if (strcmp(obj->props_info[i]->name, name) == 0) {
-			prop_id = obj->props_info[i]->prop_id;
-			break;
+static const char * const crtc_prop_names[CRTC_PROP_COUNT] = {
+	[CRTC_MODE_ID]       = "MODE_ID",
+	[CRTC_ACTIVE]        = "ACTIVE",
+	[CRTC_OUT_FENCE_PTR] = "OUT_FENCE_PTR",
+};
+
+static const char * const connector_prop_names[CONNECTOR_PROP_COUNT] = {
+	[CONNECTOR_CRTC_ID] = "CRTC_ID",
+};
+
+/* Resolve the property ids in the order of the names table, so the
+ * per-frame code doesn't need any string lookups.  Properties the
+ * object doesn't have are left as 0.
+ */
+static void lookup_prop_ids(drmModeObjectProperties *props,
+		drmModePropertyRes **props_info, const char * const *names,
+		unsigned count, uint32_t *prop_id)
+{
+	for (unsigned i = 0; i < count; i++) {
+		prop_id[i] = 0;
+		for (unsigned j = 0; j < props->count_props; j++) {
+			if (strcmp(props_info[j]->name, names[i]) == 0) {
+				prop_id[i] = props_info[j]->prop_id;
+				break;
+			}
 		}
 	}
+}
 
-	if (prop_id < 0) {
-		printf("no connector property: %s\n", name);
+static int add_connector_property(drmModeAtomicReq *req, struct connector *obj,
+					enum connector_prop prop, uint64_t value)
+{
+	if (!obj->prop_id[prop]) {
+		printf("no connector property: %s\n", connector_prop_names[prop]);
 		return -EINVAL;
 	}
 
-	return drmModeAtomicAddProperty(req, obj_id, prop_id, value);
+	return drmModeAtomicAddProperty(req, obj->connector->connector_id,
+			obj->prop_id[prop], value);
 }
 
-static int add_crtc_property(drmModeAtomicReq *req, uint32_t obj_id,
-				const char *name, uint64_t value)
+static int add_crtc_property(drmModeAtomicReq *req, struct crtc *obj,
+				enum crtc_prop prop, uint64_t value)
 {
-	struct crtc *obj = drm.crtc;
-	unsigned int i;
-	int prop_id = -1;
+	if (!obj->prop_id[prop]) {
+		printf("no crtc property: %s\n", crtc_prop_names[prop]);
+		return -EINVAL;
+	}
 
-	for (i = 0 ; i < obj->props->count_props ; i++) {
-		if (strcmp(obj->props_info[i]->name, name) == 0) {
-			prop_id = obj->props_info[i]->prop_id;
-			break;
+	return drmModeAtomicAddProperty(req, obj->crtc->crtc_id,
+			obj->prop_id[prop], value);
+}
+
+static int add_plane_property(drmModeAtomicReq *req, struct plane *obj,
+				enum plane_prop prop, uint64_t value)
+{
+	if (!obj->prop_id[prop]) {
+		printf("no plane property: %s\n", plane_prop_names[prop]);
+		return -EINVAL;
+	}
+
+	return drmModeAtomicAddProperty(req, obj->plane->plane_id,
+			obj->prop_id[prop], value);
+}
+
+/* Outputs with the same mode timings flip on the same vblank (as far as
+ * we can tell), so they are committed together in one request.  Any
+ * other output gets a request, and a commit, of its own.
+ *
+ * The part of a request that is the same for every frame is built
+ * once, per frame we just rewind the cursor to the end of it and add
+ * what changes (FB_ID and IN_FENCE_FD, plus the modeset state on the
+ * first commit).
+ */
+static struct {
+	drmModeAtomicReq *req;
+	int base_cursor;
+	unsigned outputs;          /* mask of drm.outputs[] */
+	uint32_t flags;            /* ALLOW_MODESET until the first commit */
+} groups[MAX_OUTPUTS];
+static unsigned num_groups;
+
+static bool same_timings(const drmModeModeInfo *a, const drmModeModeInfo *b)
+{
+	return a->clock == b->clock && a->htotal == b->htotal &&
+	       a->vtotal == b->vtotal && a->vscan == b->vscan &&
+	       a->flags == b->flags;
+}
+
+static int add_output(drmModeAtomicReq *req, struct output *output)
+{
+	struct plane *plane = output->plane;
+	const drmModeModeInfo *mode = output->mode;
+	int ret = 0;
+
+	/* the output's part of the canvas: */
+	ret |= add_plane_property(req, plane, PLANE_CRTC_ID, output->crtc_id);
+	ret |= add_plane_property(req, plane, PLANE_SRC_X, output->x << 16);
+	ret |= add_plane_property(req, plane, PLANE_SRC_Y, 0);
+	ret |= add_plane_property(req, plane, PLANE_SRC_W, mode->hdisplay << 16);
+	ret |= add_plane_property(req, plane, PLANE_SRC_H, mode->vdisplay << 16);
+	ret |= add_plane_property(req, plane, PLANE_CRTC_X, 0);
+	ret |= add_plane_property(req, plane, PLANE_CRTC_Y, 0);
+	ret |= add_plane_property(req, plane, PLANE_CRTC_W, mode->hdisplay);
+	ret |= add_plane_property(req, plane, PLANE_CRTC_H, mode->vdisplay);
+
+	/* the out-fence is what the commit thread polls on to know when
+	 * the flip completed, so always ask for it:
+	 */
+	ret |= add_crtc_property(req, output->crtc, CRTC_OUT_FENCE_PTR,
+			VOID2U64(&output->kms_out_fence_fd));
+
+	return ret;
+}
+
+static int init_requests(void)
+{
+	unsigned n, g;
+
+	for (n = 0; n < drm.num_outputs; n++) {
+		for (g = 0; g < num_groups; g++) {
+			unsigned first = ffs(groups[g].outputs) - 1;
+			if (same_timings(drm.outputs[first].mode, drm.outputs[n].mode))
+				break;
+		}
+
+		if (g == num_groups) {
+			groups[g].req = drmModeAtomicAlloc();
+			if (!groups[g].req)
+				return -1;
+			groups[g].flags = DRM_MODE_ATOMIC_NONBLOCK |
+					DRM_MODE_ATOMIC_ALLOW_MODESET;
+			num_groups++;
 		}
+
+		groups[g].outputs |= 1 << n;
+
+		if (add_output(groups[g].req, &drm.outputs[n]) < 0)
+			return -1;
 	}
 
-	if (prop_id < 0) {
-		printf("no crtc property: %s\n", name);
-		return -EINVAL;
+	for (g = 0; g < num_groups; g++)
+		groups[g].base_cursor = drmModeAtomicGetCursor(groups[g].req);
+
+	if (num_groups > 1)
+		printf("Outputs don't share a vblank, flipping %u groups of them independently\n",
+				num_groups);
+
+	return 0;
+}
+
+static void free_requests(void)
+{
+	for (unsigned g = 0; g < num_groups; g++)
+		drmModeAtomicFree(groups[g].req);
+	memset(groups, 0, sizeof(groups));
+	num_groups = 0;
+}
+
+/* Layer to plane assignment.
+ *
+ * Every plane other than the primary that can be used on our crtc is a
+ * candidate.  A configuration puts each layer either on one of the
+ * candidate planes, or composites it into the primary buffer on the gpu.
+ * The solver enumerates the configurations that can work on paper (the
+ * plane scans out the layer's format and modifier, stacking order is
+ * kept), and validates them cheapest first with TEST_ONLY commits.  The
+ * results are memoized, keyed by the whole configuration, so solving
+ * again (when a commit got rejected, ie. because the display setup
+ * changed under us) doesn't repeat the trial and error.
+ */
+#define MAX_CANDIDATE_PLANES 8
+#define MAX_CONFIG_MEMO      64
+#define COMPOSITED           -1
+
+WEAK uint64_t
+gbm_bo_get_modifier(struct gbm_bo *bo);
+
+struct layer_config {
+	int plane[MAX_LAYERS];     /* candidate plane index, or COMPOSITED */
+};
+
+struct config_key {
+	drmModeModeInfo mode;
+	uint32_t crtc_id;
+	uint32_t flags;
+	uint32_t plane_ids[MAX_LAYERS];
+	uint32_t formats[MAX_LAYERS];
+	uint64_t modifiers[MAX_LAYERS];
+};
+
+static struct {
+	const struct egl *egl;
+
+	struct plane planes[MAX_CANDIDATE_PLANES];
+	unsigned plane_cost[MAX_CANDIDATE_PLANES];
+	unsigned num_planes;
+
+	/* current configuration, and the planes enabled by the last
+	 * commit (which need to be turned off if no longer used):
+	 */
+	struct layer_config config;
+	unsigned active_planes;
+
+	struct {
+		struct config_key key;
+		bool ok;
+	} memo[MAX_CONFIG_MEMO];
+	unsigned num_memo, next_memo;
+} solver;
+
+/* layers to composite on the gpu, read by the render thread: */
+static unsigned composite_mask;
+
+static int get_plane(uint32_t plane_id, struct plane *plane)
+{
+	plane->plane = drmModeGetPlane(drm.fd, plane_id);
+	if (!plane->plane) {
+		printf("could not get plane %u: %s\n", plane_id, strerror(errno));
+		return -1;
 	}
 
-	return drmModeAtomicAddProperty(req, obj_id, prop_id, value);
+	plane->props = drmModeObjectGetProperties(drm.fd, plane_id,
+			DRM_MODE_OBJECT_PLANE);
+	if (!plane->props) {
+		printf("could not get plane %u properties: %s\n",
+				plane_id, strerror(errno));
+		drmModeFreePlane(plane->plane);
+		return -1;
+	}
+
+	plane->props_info = calloc(plane->props->count_props,
+			sizeof(*plane->props_info));
+	for (uint32_t i = 0; i < plane->props->count_props; i++)
+		plane->props_info[i] = drmModeGetProperty(drm.fd,
+				plane->props->props[i]);
+
+	lookup_prop_ids(plane->props, plane->props_info, plane_prop_names,
+			ARRAY_SIZE(plane->prop_id), plane->prop_id);
+
+	return 0;
 }
 
-static int add_plane_property(drmModeAtomicReq *req, uint32_t obj_id,
-				const char *name, uint64_t value)
+static void free_plane(struct plane *plane)
 {
-	struct plane *obj = drm.plane;
-	unsigned int i;
-	int prop_id = -1;
+	for (uint32_t i = 0; i < plane->props->count_props; i++)
+		drmModeFreeProperty(plane->props_info[i]);
+	free(plane->props_info);
+	drmModeFreeObjectProperties(plane->props);
+	drmModeFreePlane(plane->plane);
+	memset(plane, 0, sizeof(*plane));
+}
+
+static drmModePropertyRes * find_plane_prop(const struct plane *plane,
+		const char *name, uint64_t *value)
+{
+	for (uint32_t i = 0; i < plane->props->count_props; i++) {
+		if (strcmp(plane->props_info[i]->name, name) == 0) {
+			if (value)
+				*value = plane->props->prop_values[i];
+			return plane->props_info[i];
+		}
+	}
+
+	return NULL;
+}
 
-	for (i = 0 ; i < obj->props->count_props ; i++) {
-		if (strcmp(obj->props_info[i]->name, name) == 0) {
-			prop_id = obj->props_info[i]->prop_id;
+/* Can the plane scan out this format/modifier combination?  Without
+ * IN_FORMATS (or for buffers with an implicit modifier) the plane's
+ * format list is all there is to check.
+ */
+static bool plane_supports(const struct plane *plane, uint32_t format,
+		uint64_t modifier)
+{
+	const struct drm_format_modifier_blob *hdr;
+	const struct drm_format_modifier *mods;
+	const uint32_t *formats;
+	drmModePropertyBlobRes *blob;
+	uint64_t blob_id;
+	bool found = false;
+	uint32_t i, j;
+
+	for (i = 0; i < plane->plane->count_formats; i++)
+		if (plane->plane->formats[i] == format)
 			break;
+	if (i == plane->plane->count_formats)
+		return false;
+
+	if ((modifier == DRM_FORMAT_MOD_INVALID) ||
+	    !find_plane_prop(plane, "IN_FORMATS", &blob_id))
+		return true;
+
+	blob = drmModeGetPropertyBlob(drm.fd, blob_id);
+	if (!blob)
+		return true;
+
+	hdr = blob->data;
+	formats = (const void *)((const char *)hdr + hdr->formats_offset);
+	mods = (const void *)((const char *)hdr + hdr->modifiers_offset);
+
+	for (i = 0; i < hdr->count_formats && !found; i++) {
+		if (formats[i] != format)
+			continue;
+
+		for (j = 0; j < hdr->count_modifiers && !found; j++) {
+			if ((mods[j].modifier == modifier) &&
+			    (i >= mods[j].offset) && (i < mods[j].offset + 64))
+				found = !!(mods[j].formats & (1ULL << (i - mods[j].offset)));
 		}
 	}
 
+	drmModeFreePropertyBlob(blob);
 
-	if (prop_id < 0) {
-		printf("no plane property: %s\n", name);
-		return -EINVAL;
+	return found;
+}
+
+/* zpos a layer gets on a plane, clamped to what the plane allows, or -1
+ * when the plane has no zpos:
+ */
+static int64_t layer_zpos(const struct plane *plane, const struct layer *layer)
+{
+	drmModePropertyRes *zpos;
+	uint64_t value;
+
+	zpos = find_plane_prop(plane, "zpos", &value);
+	if (!zpos)
+		return -1;
+
+	if (zpos->flags & DRM_MODE_PROP_IMMUTABLE)
+		return value;
+
+	value = layer->zpos;
+	if ((zpos->flags & DRM_MODE_PROP_RANGE) && zpos->count_values == 2)
+		value = MIN2(MAX2(value, zpos->values[0]), zpos->values[1]);
+
+	return value;
+}
+
+static int load_candidate_planes(void)
+{
+	drmModePlaneRes *res;
+
+	res = drmModeGetPlaneResources(drm.fd);
+	if (!res) {
+		printf("drmModeGetPlaneResources failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	for (uint32_t i = 0; i < res->count_planes; i++) {
+		struct plane *plane = &solver.planes[solver.num_planes];
+		uint64_t type;
+
+		if (solver.num_planes == MAX_CANDIDATE_PLANES)
+			break;
+
+		if (res->planes[i] == drm.outputs[0].plane->plane->plane_id)
+			continue;
+
+		if (get_plane(res->planes[i], plane))
+			continue;
+
+		if ((plane->plane->possible_crtcs & crtc_bit(drm.crtc_index)) &&
+		    find_plane_prop(plane, "type", &type) &&
+		    (type != DRM_PLANE_TYPE_PRIMARY)) {
+			/* cursor planes usually come with restrictions,
+			 * so prefer overlays:
+			 */
+			solver.plane_cost[solver.num_planes++] =
+				(type == DRM_PLANE_TYPE_CURSOR) ? 2 : 1;
+			continue;
+		}
+
+		free_plane(plane);
 	}
 
-	return drmModeAtomicAddProperty(req, obj_id, prop_id, value);
+	drmModeFreePlaneResources(res);
+
+	return 0;
 }
 
-static int drm_atomic_commit(uint32_t fb_id, uint32_t flags)
+static int add_layer_plane(drmModeAtomicReq *req, struct plane *plane,
+		const struct layer *layer, uint32_t fb_id)
 {
-	drmModeAtomicReq *req;
-	uint32_t plane_id = drm.plane->plane->plane_id;
+	drmModePropertyRes *zpos;
+	int ret = 0;
+
+	ret |= add_plane_property(req, plane, PLANE_FB_ID, fb_id);
+	ret |= add_plane_property(req, plane, PLANE_CRTC_ID, drm.crtc_id);
+	ret |= add_plane_property(req, plane, PLANE_SRC_X, 0);
+	ret |= add_plane_property(req, plane, PLANE_SRC_Y, 0);
+	ret |= add_plane_property(req, plane, PLANE_SRC_W, layer->width << 16);
+	ret |= add_plane_property(req, plane, PLANE_SRC_H, layer->height << 16);
+	ret |= add_plane_property(req, plane, PLANE_CRTC_X, layer->x);
+	ret |= add_plane_property(req, plane, PLANE_CRTC_Y, layer->y);
+	ret |= add_plane_property(req, plane, PLANE_CRTC_W, layer->width);
+	ret |= add_plane_property(req, plane, PLANE_CRTC_H, layer->height);
+
+	/* not every driver exposes zpos, or lets us change it, in which
+	 * case the plane order is fixed by the hardware:
+	 */
+	zpos = find_plane_prop(plane, "zpos", NULL);
+	if (zpos && !(zpos->flags & DRM_MODE_PROP_IMMUTABLE))
+		ret |= add_plane_property(req, plane, PLANE_ZPOS,
+				layer_zpos(plane, layer));
+
+	return ret;
+}
+
+static int get_layer_fbs(struct gbm_bo * const *bos, uint32_t *fb_ids)
+{
+	for (unsigned n = 0; n < solver.egl->num_layers; n++) {
+		struct drm_fb *fb = drm_fb_get_from_bo(bos[n]);
+		if (!fb)
+			return -1;
+		fb_ids[n] = fb->fb_id;
+	}
+
+	return 0;
+}
+
+/* MODE_ID blobs, keyed by the mode contents, so repeated modesets (mode
+ * switches, re-init after hotplug) reuse the blob instead of creating a
+ * new one every time.  The kernel keeps its own reference to a blob that
+ * is in use, so evicting (destroying) an entry is always safe.
+ */
+#define MAX_MODE_BLOBS 8
+
+static struct {
+	drmModeModeInfo mode;
+	uint32_t blob_id;
+} mode_blobs[MAX_MODE_BLOBS];
+static unsigned num_mode_blobs, next_mode_blob;
+
+static uint32_t get_mode_blob(const drmModeModeInfo *mode)
+{
+	unsigned i;
+
+	for (i = 0; i < num_mode_blobs; i++) {
+		if (memcmp(&mode_blobs[i].mode, mode, sizeof(*mode)) == 0)
+			return mode_blobs[i].blob_id;
+	}
+
+	/* cache is full, evict the oldest entry: */
+	if (num_mode_blobs == MAX_MODE_BLOBS) {
+		i = next_mode_blob;
+		next_mode_blob = (next_mode_blob + 1) % MAX_MODE_BLOBS;
+		drmModeDestroyPropertyBlob(drm.fd, mode_blobs[i].blob_id);
+	} else {
+		i = num_mode_blobs++;
+	}
+
+	if (drmModeCreatePropertyBlob(drm.fd, mode, sizeof(*mode),
+				      &mode_blobs[i].blob_id) != 0) {
+		/* drop the slot again, keeping the table dense: */
+		mode_blobs[i] = mode_blobs[--num_mode_blobs];
+		return 0;
+	}
+	mode_blobs[i].mode = *mode;
+
+	return mode_blobs[i].blob_id;
+}
+
+static void destroy_mode_blobs(void)
+{
+	for (unsigned i = 0; i < num_mode_blobs; i++)
+		drmModeDestroyPropertyBlob(drm.fd, mode_blobs[i].blob_id);
+	num_mode_blobs = next_mode_blob = 0;
+}
+
+/* Commit the outputs of one group.  The in-fence is left open, the
+ * other groups may still need it.
+ */
+static int drm_atomic_commit(unsigned group, uint32_t fb_id,
+		const struct layer_config *config, const uint32_t *layer_fb_ids,
+		uint32_t flags)
+{
+	drmModeAtomicReq *req = groups[group].req;
+	unsigned planes = 0;
 	uint32_t blob_id;
 	int ret;
 
-	req = drmModeAtomicAlloc();
+	drmModeAtomicSetCursor(req, groups[group].base_cursor);
+
+	for (unsigned n = 0; n < drm.num_outputs; n++) {
+		struct output *output = &drm.outputs[n];
 
-	if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
-		if (add_connector_property(req, drm.connector_id, "CRTC_ID",
-						drm.crtc_id) < 0)
+		if (!(groups[group].outputs & (1 << n)))
+			continue;
+
+		if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
+			if (add_connector_property(req, output->connector, CONNECTOR_CRTC_ID,
+							output->crtc_id) < 0)
+					return -1;
+
+			blob_id = get_mode_blob(output->mode);
+			if (!blob_id)
 				return -1;
 
-		if (drmModeCreatePropertyBlob(drm.fd, drm.mode, sizeof(*drm.mode),
-					      &blob_id) != 0)
-			return -1;
+			if (add_crtc_property(req, output->crtc, CRTC_MODE_ID, blob_id) < 0)
+				return -1;
 
-		if (add_crtc_property(req, drm.crtc_id, "MODE_ID", blob_id) < 0)
-			return -1;
+			if (add_crtc_property(req, output->crtc, CRTC_ACTIVE, 1) < 0)
+				return -1;
+		}
 
-		if (add_crtc_property(req, drm.crtc_id, "ACTIVE", 1) < 0)
-			return -1;
+		add_plane_property(req, output->plane, PLANE_FB_ID, fb_id);
+
+		if (drm.kms_in_fence_fd != -1)
+			add_plane_property(req, output->plane, PLANE_IN_FENCE_FD,
+					drm.kms_in_fence_fd);
 	}
 
-	add_plane_property(req, plane_id, "FB_ID", fb_id);
-	add_plane_property(req, plane_id, "CRTC_ID", drm.crtc_id);
-	add_plane_property(req, plane_id, "SRC_X", 0);
-	add_plane_property(req, plane_id, "SRC_Y", 0);
-	add_plane_property(req, plane_id, "SRC_W", drm.mode->hdisplay << 16);
-	add_plane_property(req, plane_id, "SRC_H", drm.mode->vdisplay << 16);
-	add_plane_property(req, plane_id, "CRTC_X", 0);
-	add_plane_property(req, plane_id, "CRTC_Y", 0);
-	add_plane_property(req, plane_id, "CRTC_W", drm.mode->hdisplay);
-	add_plane_property(req, plane_id, "CRTC_H", drm.mode->vdisplay);
+	/* layers are only supported with a single output: */
+	if (group != 0)
+		return drmModeAtomicCommit(drm.fd, req, flags, NULL);
+
+	for (unsigned n = 0; solver.egl && n < solver.egl->num_layers; n++) {
+		int p = config->plane[n];
+
+		if (p == COMPOSITED)
+			continue;
+
+		if (add_layer_plane(req, &solver.planes[p], solver.egl->layers[n],
+				layer_fb_ids[n]) < 0)
+			return -1;
+
+		planes |= 1 << p;
+	}
 
-	if (drm.kms_in_fence_fd != -1) {
-		add_crtc_property(req, drm.crtc_id, "OUT_FENCE_PTR",
-				VOID2U64(&drm.kms_out_fence_fd));
-		add_plane_property(req, plane_id, "IN_FENCE_FD", drm.kms_in_fence_fd);
+	/* turn off planes the previous configuration used: */
+	for (unsigned p = 0; p < solver.num_planes; p++) {
+		if (!(solver.active_planes & ~planes & (1 << p)))
+			continue;
+		add_plane_property(req, &solver.planes[p], PLANE_FB_ID, 0);
+		add_plane_property(req, &solver.planes[p], PLANE_CRTC_ID, 0);
 	}
 
 	ret = drmModeAtomicCommit(drm.fd, req, flags, NULL);
 	if (ret)
+		return ret;
+
+	if (flags & DRM_MODE_ATOMIC_TEST_ONLY)
+		return 0;
+
+	solver.active_planes = planes;
+
+	return 0;
+}
+
+static void make_config_key(const struct layer_config *config, uint32_t flags,
+		struct config_key *key)
+{
+	const struct egl *egl = solver.egl;
+
+	memset(key, 0, sizeof(*key));
+	key->mode = *drm.mode;
+	key->crtc_id = drm.crtc_id;
+	key->flags = flags & DRM_MODE_ATOMIC_ALLOW_MODESET;
+
+	for (unsigned n = 0; n < egl->num_layers; n++) {
+		const struct layer *layer = egl->layers[n];
+		int p = config->plane[n];
+
+		key->plane_ids[n] = (p == COMPOSITED) ? 0 :
+				solver.planes[p].plane->plane_id;
+		key->formats[n] = layer->format;
+		key->modifiers[n] = gbm_bo_get_modifier ?
+				gbm_bo_get_modifier(layer->bos[0]) :
+				DRM_FORMAT_MOD_INVALID;
+	}
+}
+
+static void memo_store(const struct config_key *key, bool ok)
+{
+	unsigned i;
+
+	for (i = 0; i < solver.num_memo; i++)
+		if (memcmp(&solver.memo[i].key, key, sizeof(*key)) == 0)
+			break;
+
+	if (i == solver.num_memo) {
+		if (solver.num_memo < MAX_CONFIG_MEMO) {
+			solver.num_memo++;
+		} else {
+			i = solver.next_memo;
+			solver.next_memo = (solver.next_memo + 1) % MAX_CONFIG_MEMO;
+		}
+	}
+
+	solver.memo[i].key = *key;
+	solver.memo[i].ok = ok;
+}
+
+static bool test_config(const struct layer_config *config, uint32_t fb_id,
+		const uint32_t *layer_fb_ids, uint32_t flags)
+{
+	struct config_key key;
+	bool ok;
+
+	make_config_key(config, flags, &key);
+
+	for (unsigned i = 0; i < solver.num_memo; i++)
+		if (memcmp(&solver.memo[i].key, &key, sizeof(key)) == 0)
+			return solver.memo[i].ok;
+
+	ok = !drm_atomic_commit(0, fb_id, config, layer_fb_ids,
+			flags | DRM_MODE_ATOMIC_TEST_ONLY);
+	memo_store(&key, ok);
+
+	return ok;
+}
+
+static bool rects_overlap(const struct layer *a, const struct layer *b)
+{
+	return a->x < b->x + (int)b->width && b->x < a->x + (int)a->width &&
+	       a->y < b->y + (int)b->height && b->y < a->y + (int)a->height;
+}
+
+/* Check the stacking order: a composited layer ends up in the primary
+ * buffer, below all planes, so it can't be above a layer on a plane it
+ * overlaps with.  And the planes have to end up in order: a fixed zpos,
+ * or one clamped to the plane's range, can put two layers at the same
+ * zpos, where the order is undefined, so one of them has to go to the
+ * gpu instead.
+ */
+static bool config_valid(const struct layer_config *config)
+{
+	const struct egl *egl = solver.egl;
+	uint64_t value;
+	int64_t primary = -1;
+
+	if (find_plane_prop(drm.outputs[0].plane, "zpos", &value))
+		primary = value;
+
+	for (unsigned n = 0; n < egl->num_layers; n++) {
+		int pn = config->plane[n];
+
+		/* and above the primary plane, which we leave where it is: */
+		if (pn != COMPOSITED) {
+			int64_t zn = layer_zpos(&solver.planes[pn], egl->layers[n]);
+			if (zn >= 0 && primary >= 0 && zn <= primary)
+				return false;
+		}
+
+		for (unsigned m = 0; m < n; m++) {
+			int pm = config->plane[m];
+
+			if (pm == COMPOSITED)
+				continue;
+
+			if (pn == COMPOSITED) {
+				if (rects_overlap(egl->layers[n], egl->layers[m]))
+					return false;
+				continue;
+			}
+
+			int64_t zn = layer_zpos(&solver.planes[pn], egl->layers[n]);
+			int64_t zm = layer_zpos(&solver.planes[pm], egl->layers[m]);
+			if (zn >= 0 && zm >= 0 && zn <= zm)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/* gpu composition costs a blit of the layer every frame, a plane
+ * (almost) nothing:
+ */
+static uint64_t config_cost(const struct layer_config *config)
+{
+	const struct egl *egl = solver.egl;
+	uint64_t cost = 0;
+
+	for (unsigned n = 0; n < egl->num_layers; n++) {
+		const struct layer *layer = egl->layers[n];
+		int p = config->plane[n];
+
+		if (p == COMPOSITED)
+			cost += (uint64_t)layer->width * layer->height;
+		else
+			cost += solver.plane_cost[p];
+	}
+
+	return cost;
+}
+
+struct candidate {
+	struct layer_config config;
+	uint64_t cost;
+	unsigned order;
+};
+
+static int candidate_cmp(const void *a, const void *b)
+{
+	const struct candidate *ca = a, *cb = b;
+
+	if (ca->cost != cb->cost)
+		return (ca->cost < cb->cost) ? -1 : 1;
+
+	/* keep the enumeration order for equal cost, so the result is
+	 * deterministic:
+	 */
+	return (int)ca->order - (int)cb->order;
+}
+
+static void enumerate_configs(unsigned n, struct layer_config *config,
+		const bool usable[MAX_LAYERS][MAX_CANDIDATE_PLANES],
+		struct candidate *out, unsigned *count)
+{
+	if (n == solver.egl->num_layers) {
+		if (config_valid(config)) {
+			out[*count].config = *config;
+			out[*count].cost = config_cost(config);
+			out[*count].order = *count;
+			(*count)++;
+		}
+		return;
+	}
+
+	for (int p = COMPOSITED; p < (int)solver.num_planes; p++) {
+		bool taken = false;
+
+		if (p != COMPOSITED) {
+			if (!usable[n][p])
+				continue;
+			for (unsigned m = 0; m < n; m++)
+				taken |= (config->plane[m] == p);
+			if (taken)
+				continue;
+		}
+
+		config->plane[n] = p;
+		enumerate_configs(n + 1, config, usable, out, count);
+	}
+}
+
+/* Pick the cheapest configuration the driver accepts and make it the
+ * current one.  Returns the mask of layers to composite on the gpu.
+ */
+static unsigned solve_layer_config(uint32_t fb_id, const uint32_t *layer_fb_ids,
+		uint32_t flags)
+{
+	const struct egl *egl = solver.egl;
+	bool usable[MAX_LAYERS][MAX_CANDIDATE_PLANES];
+	struct layer_config config;
+	struct candidate *candidates;
+	unsigned count = 0, max = 1, mask = 0;
+
+	for (unsigned n = 0; n < egl->num_layers; n++) {
+		const struct layer *layer = egl->layers[n];
+		uint64_t modifier = gbm_bo_get_modifier ?
+				gbm_bo_get_modifier(layer->bos[0]) :
+				DRM_FORMAT_MOD_INVALID;
+
+		for (unsigned p = 0; p < solver.num_planes; p++)
+			usable[n][p] = plane_supports(&solver.planes[p],
+					layer->format, modifier);
+
+		max *= solver.num_planes + 1;
+	}
+
+	/* everything on the gpu always works, and is the fallback: */
+	for (unsigned n = 0; n < egl->num_layers; n++)
+		solver.config.plane[n] = COMPOSITED;
+
+	candidates = calloc(max, sizeof(*candidates));
+	if (candidates) {
+		enumerate_configs(0, &config, usable, candidates, &count);
+		qsort(candidates, count, sizeof(*candidates), candidate_cmp);
+
+		for (unsigned i = 0; i < count; i++) {
+			if (test_config(&candidates[i].config, fb_id, layer_fb_ids, flags)) {
+				solver.config = candidates[i].config;
+				break;
+			}
+		}
+
+		free(candidates);
+	}
+
+	for (unsigned n = 0; n < egl->num_layers; n++) {
+		int p = solver.config.plane[n];
+
+		if (p == COMPOSITED) {
+			printf("Layer %s: gpu composition\n", egl->layers[n]->name);
+			mask |= 1 << n;
+		} else {
+			printf("Layer %s: plane %u\n", egl->layers[n]->name,
+					solver.planes[p].plane->plane_id);
+		}
+	}
+
+	return mask;
+}
+
+/* Solve the initial layer configuration, before the first commit.  In
+ * the gbm surface case there is no primary buffer before the first
+ * frame, so test with a scratch one.
+ */
+static void init_layer_planes(const struct gbm *gbm, const struct egl *egl)
+{
+	uint32_t layer_fb_ids[MAX_LAYERS];
+	struct gbm_bo *layer_bos[MAX_LAYERS];
+	struct gbm_bo *bo;
+	struct drm_fb *fb;
+
+	solver.egl = egl;
+	composite_mask = (1 << egl->num_layers) - 1;
+	for (unsigned n = 0; n < egl->num_layers; n++)
+		solver.config.plane[n] = COMPOSITED;
+
+	if (!egl->num_layers || load_candidate_planes())
+		return;
+
+	bo = gbm_bo_create(gbm->dev, gbm->width, gbm->height, gbm->format,
+			GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+	fb = bo ? drm_fb_get_from_bo(bo) : NULL;
+
+	for (unsigned n = 0; n < egl->num_layers; n++)
+		layer_bos[n] = egl->layers[n]->bos[0];
+
+	if (fb && !get_layer_fbs(layer_bos, layer_fb_ids)) {
+		composite_mask = solve_layer_config(fb->fb_id, layer_fb_ids,
+				DRM_MODE_ATOMIC_ALLOW_MODESET);
+	}
+
+	if (bo)
+		gbm_bo_destroy(bo);
+}
+
+/* Rendering and KMS run in separate threads.  The render thread (the
+ * caller of atomic_run) draws into FREE swapchain buffers and pushes
+ * them, together with the gpu out-fence, to the commit thread through
+ * a lock-free queue.  The commit thread owns the DRM fd: it polls on the
+ * out-fence of the pending commit, and once that one landed issues a
+ * nonblocking commit for the next ready buffer, with the gpu fence as
+ * in-fence.  Completed flips are sent back through a second queue, for
+ * pacing and the stats, and buffers no output shows any more through a
+ * third, so the render thread can recycle them.
+ *
+ * Frames are paced to the first group of outputs (see init_requests()).
+ * The other groups flip on their own vblanks, each to the latest frame
+ * whenever its previous flip completed, skipping frames if slower.
+ */
+struct frame {
+	int idx;              /* swapchain buffer index */
+	struct gbm_bo *bo;
+	int fence_fd;         /* gpu out-fence, -1 if rendering is finished */
+	unsigned users;       /* groups showing it, or flipping to it */
+	int gpu_fence_fd;     /* dup of it, to get the time it signaled at */
+	struct gbm_bo *layer_bos[MAX_LAYERS];   /* for the layer planes */
+
+	struct frame_times t;
+
+	int64_t present_ns;   /* predicted t.flip */
+	uint64_t flip_seq;    /* vblank sequence of the flip, 0 if not known */
+};
+
+static struct {
+	struct frame frames[MAX_BUFFERS];
+
+	struct spsc_queue ready;   /* render -> commit */
+	struct spsc_queue flipped; /* commit -> render, on the first group */
+	struct spsc_queue done;    /* commit -> render, off screen everywhere */
+	int ready_efd, done_efd;
+
+	pthread_t commit_thread;
+	bool quit;
+	bool error;
+} pipeline;
+
+static void wake(int efd)
+{
+	uint64_t one = 1;
+	if (write(efd, &one, sizeof(one)) != sizeof(one))
+		printf("eventfd write failed: %s\n", strerror(errno));
+}
+
+static int drain(struct evloop *loop, int efd, void *data)
+{
+	uint64_t count;
+
+	(void)loop; (void)data;
+
+	if (read(efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		printf("eventfd read failed: %s\n", strerror(errno));
+
+	return 0;
+}
+
+WEAK int
+drmCrtcGetSequence(int fd, uint32_t crtcId, uint64_t *sequence, uint64_t *ns);
+
+/* The out-fence signals at the vblank the flip happened at, so that is
+ * the crtc's last vblank.  Without drmCrtcGetSequence() the time we got
+ * woken up for the fence is the best guess.
+ */
+static void get_flip_time(const struct output *output, struct frame *f)
+{
+	uint64_t seq, ns;
+
+	if (drmCrtcGetSequence &&
+	    !drmCrtcGetSequence(drm.fd, output->crtc_id, &seq, &ns)) {
+		f->flip_seq = seq;
+		f->t.flip = ns;
+	} else {
+		f->flip_seq = 0;
+		f->t.flip = get_time_ns();
+	}
+}
+
+/* Per group of outputs, the frame on screen and the one on its way
+ * there, with the outputs whose flip to it hasn't completed yet.  Only
+ * touched by the commit thread.
+ */
+static struct {
+	struct frame *shown, *flipping;
+	unsigned outputs;
+} pending[MAX_OUTPUTS];
+
+/* the frame last committed on the first group, for the others: */
+static struct frame *latest;
+
+static void put_frame(struct frame *f)
+{
+	if (--f->users)
+		return;
+
+	if (f->fence_fd != -1) {
+		close(f->fence_fd);
+		f->fence_fd = -1;
+	}
+
+	spsc_queue_push(&pipeline.done, f);
+	wake(pipeline.done_efd);
+}
+
+/* the out-fence of an output signaled, ie. its flip completed: */
+static int flip_done(struct evloop *loop, int fd, void *data)
+{
+	struct output *output = data;
+	unsigned bit = 1 << (output - drm.outputs);
+	unsigned g = 0;
+	struct frame *f;
+
+	evloop_remove_fd(loop, fd);
+	close(fd);
+	output->kms_out_fence_fd = -1;
+
+	while (!(groups[g].outputs & bit))
+		g++;
+	f = pending[g].flipping;
+
+	/* the first output is the one frames are paced to: */
+	if (output == &drm.outputs[0])
+		get_flip_time(output, f);
+
+	pending[g].outputs &= ~bit;
+	if (pending[g].outputs)
+		return 0;
+
+	if (g == 0) {
+		/* the gpu is long done by now: */
+		f->t.gpu_done = 0;
+		if (f->gpu_fence_fd != -1) {
+			f->t.gpu_done = fence_signal_time(f->gpu_fence_fd);
+			close(f->gpu_fence_fd);
+			f->gpu_fence_fd = -1;
+		}
+		if (!f->t.gpu_done)
+			f->t.gpu_done = f->t.draw_end;
+
+		spsc_queue_push(&pipeline.flipped, f);
+		wake(pipeline.done_efd);
+	}
+
+	if (pending[g].shown)
+		put_frame(pending[g].shown);
+	pending[g].shown = f;
+	pending[g].flipping = NULL;
+
+	return 0;
+}
+
+static int commit_frame(struct evloop *loop, unsigned g, struct frame *f)
+{
+	struct drm_fb *fb = drm_fb_get_from_bo(f->bo);
+	uint32_t layer_fb_ids[MAX_LAYERS];
+	uint32_t flags = groups[g].flags;
+	int ret;
+
+	if (!fb || get_layer_fbs(f->layer_bos, layer_fb_ids)) {
+		printf("Failed to get a new framebuffer BO\n");
+		return -1;
+	}
+
+	/* the kernel takes its own reference to the in-fence, the frame
+	 * keeps it for the other groups:
+	 */
+	drm.kms_in_fence_fd = f->fence_fd;
+
+	if (g == 0)
+		f->t.commit = get_time_ns();
+
+	ret = drm_atomic_commit(g, fb->fb_id, &solver.config,
+			layer_fb_ids, flags);
+
+	/* only the first group carries the layer planes: */
+	if (ret && g == 0 && solver.num_planes) {
+		/* The layer configuration stopped working, find one
+		 * that does.  Layers that move to gpu composition are
+		 * missing from this one frame.
+		 */
+		struct config_key key;
+		unsigned mask;
+
+		printf("failed to commit: %s, solving layer planes again\n",
+				strerror(errno));
+
+		make_config_key(&solver.config, flags, &key);
+		memo_store(&key, false);
+
+		mask = solve_layer_config(fb->fb_id, layer_fb_ids, flags);
+		__atomic_store_n(&composite_mask, mask, __ATOMIC_RELEASE);
+
+		ret = drm_atomic_commit(g, fb->fb_id, &solver.config,
+				layer_fb_ids, flags);
+	}
+
+	drm.kms_in_fence_fd = -1;
+
+	if (ret) {
+		printf("failed to commit: %s\n", strerror(errno));
+		return ret;
+	}
+
+	groups[g].flags &= ~DRM_MODE_ATOMIC_ALLOW_MODESET;
+
+	f->users++;
+	pending[g].flipping = f;
+	pending[g].outputs = groups[g].outputs;
+
+	for (unsigned n = 0; n < drm.num_outputs; n++) {
+		struct output *output = &drm.outputs[n];
+
+		if (!(groups[g].outputs & (1 << n)))
+			continue;
+
+		if (evloop_add_fd(loop, output->kms_out_fence_fd,
+				flip_done, output) < 0) {
+			printf("failed to watch out-fence: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void * commit_thread_func(void *arg)
+{
+	struct evloop loop;
+
+	(void)arg;
+
+	if (evloop_init(&loop) ||
+	    evloop_add_fd(&loop, pipeline.ready_efd, drain, NULL) < 0)
 		goto out;
 
-	if (drm.kms_in_fence_fd != -1) {
-		close(drm.kms_in_fence_fd);
-		drm.kms_in_fence_fd = -1;
+	while (true) {
+		unsigned g;
+
+		if (!pending[0].flipping) {
+			struct frame *f = spsc_queue_pop(&pipeline.ready);
+
+			if (f) {
+				if (commit_frame(&loop, 0, f))
+					break;
+				latest = f;
+			} else if (__atomic_load_n(&pipeline.quit, __ATOMIC_ACQUIRE)) {
+				break;
+			}
+		}
+
+		/* the other groups catch up with the first one, without
+		 * holding it back:
+		 */
+		for (g = 1; g < num_groups; g++) {
+			if (latest && !pending[g].flipping &&
+			    pending[g].shown != latest &&
+			    commit_frame(&loop, g, latest))
+				break;
+		}
+		if (g < num_groups)
+			break;
+
+		if (evloop_dispatch(&loop, -1) < 0)
+			break;
 	}
 
+	evloop_fini(&loop);
+
 out:
-	drmModeAtomicFree(req);
+	if (!__atomic_load_n(&pipeline.quit, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&pipeline.error, true, __ATOMIC_RELEASE);
+		wake(pipeline.done_efd);
+	}
 
-	return ret;
+	return NULL;
 }
 
 static EGLSyncKHR create_fence(const struct egl *egl, int fd)
@@ -176,45 +1188,88 @@ static EGLSyncKHR create_fence(const struct egl *egl, int fd)
 
 static int atomic_run(const struct gbm *gbm, const struct egl *egl)
 {
-	struct gbm_bo *bo = NULL;
-	struct drm_fb *fb;
+	struct swapchain sc;
+	struct evloop loop;
+	struct pacing pacing;
 	uint32_t i = 0;
-	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK;
 	int64_t start_time, report_time, cur_time;
-	int ret;
+	bool native_fences;
+	int ret = 0;
 
-	if (egl_check(egl, eglDupNativeFenceFDANDROID) ||
-	    egl_check(egl, eglCreateSyncKHR) ||
-	    egl_check(egl, eglDestroySyncKHR) ||
-	    egl_check(egl, eglWaitSyncKHR) ||
-	    egl_check(egl, eglClientWaitSyncKHR))
+	/* Without native fences (ie. llvmpipe) we have to finish rendering
+	 * before handing the buffer to KMS:
+	 */
+	native_fences = egl->eglDupNativeFenceFDANDROID &&
+			egl->eglCreateSyncKHR && egl->eglDestroySyncKHR;
+	if (!native_fences)
+		printf("no native fence support, using glFinish()\n");
+
+	swapchain_init(&sc, gbm);
+	pacing_init(&pacing, drm.mode, drm.pacing);
+
+	init_layer_planes(gbm, egl);
+
+	memset(pending, 0, sizeof(pending));
+	latest = NULL;
+
+	spsc_queue_init(&pipeline.ready);
+	spsc_queue_init(&pipeline.flipped);
+	spsc_queue_init(&pipeline.done);
+	pipeline.ready_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	pipeline.done_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (pipeline.ready_efd < 0 || pipeline.done_efd < 0) {
+		printf("failed to create eventfd: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (evloop_init(&loop) ||
+	    evloop_add_interrupts(&loop) || stats_add_signal(&loop) ||
+	    evloop_add_fd(&loop, pipeline.done_efd, drain, NULL) < 0 ||
+	    (egl->add_sources && egl->add_sources(&loop)))
 		return -1;
 
-	/* Allow a modeset change for the first commit only. */
-	flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	ret = pthread_create(&pipeline.commit_thread, NULL, commit_thread_func, NULL);
+	if (ret) {
+		printf("failed to create commit thread: %s\n", strerror(ret));
+		return -1;
+	}
 
 	start_time = report_time = get_time_ns();
 
 	while (i < drm.count) {
-		unsigned frame = i;
-		struct gbm_bo *next_bo;
-		EGLSyncKHR gpu_fence = NULL;   /* out-fence from gpu, in-fence to kms */
-		EGLSyncKHR kms_fence = NULL;   /* in-fence to gpu, out-fence from kms */
-
-		if (drm.kms_out_fence_fd != -1) {
-			kms_fence = create_fence(egl, drm.kms_out_fence_fd);
-			assert(kms_fence);
-
-			/* driver now has ownership of the fence fd: */
-			drm.kms_out_fence_fd = -1;
-
-			/* wait "on the gpu" (ie. this won't necessarily block, but
-			 * will block the rendering until fence is signaled), until
-			 * the previous pageflip completes so we don't render into
-			 * the buffer that is still on screen.
-			 */
-			egl->eglWaitSyncKHR(egl->display, kms_fence, 0);
+		struct frame *f;
+		int64_t render_start;
+		int idx;
+
+		if (__atomic_load_n(&pipeline.error, __ATOMIC_ACQUIRE)) {
+			ret = -1;
+			break;
+		}
+
+		/* recycle buffers the commit thread is done with.  A
+		 * frame's flip is queued before it goes off screen, so
+		 * taking the flips after this still gets its stats before
+		 * the buffer is rendered into again:
+		 */
+		while ((f = spsc_queue_pop(&pipeline.done)))
+			swapchain_release(&sc, f->idx);
+		while ((f = spsc_queue_pop(&pipeline.flipped))) {
+			pacing_flip(&pacing, f->flip_seq, f->t.flip, f->present_ns);
+			stats_add(&f->t);
+		}
+
+		/* Check for user input, and if no buffer is free wait
+		 * for the commit thread to complete a flip:
+		 */
+		idx = swapchain_acquire(&sc);
+
+		ret = evloop_dispatch(&loop, idx < 0 ? -1 : 0);
+		if (ret) {
+			ret = ret > 0 ? 0 : ret;
+			break;
 		}
+		if (idx < 0)
+			continue;
 
 		/* Start fps measuring on second frame, to remove the time spent
 		 * compiling shader, etc, from the fps:
@@ -223,61 +1278,79 @@ static int atomic_run(const struct gbm *gbm, const struct egl *egl)
 			start_time = report_time = get_time_ns();
 		}
 
-		if (!gbm->surface) {
-			glBindFramebuffer(GL_FRAMEBUFFER, egl->fbs[frame % NUM_BUFFERS].fb);
+		/* hold rendering back until the deadline for the vblank it
+		 * targets, with --pacing:
+		 */
+		f = &pipeline.frames[idx];
+		f->present_ns = pacing_schedule(&pacing, get_time_ns(), &render_start);
+		ret = evloop_dispatch_until(&loop, render_start);
+		if (ret) {
+			ret = ret > 0 ? 0 : ret;
+			break;
 		}
 
-		egl->draw(i++);
+		f->idx = idx;
+		f->fence_fd = -1;
+		f->gpu_fence_fd = -1;
+		f->t.draw_start = get_time_ns();
 
-		/* insert fence to be singled in cmdstream.. this fence will be
-		 * signaled when gpu rendering done
-		 */
-		gpu_fence = create_fence(egl, EGL_NO_NATIVE_FENCE_FD_ANDROID);
-		assert(gpu_fence);
+		if (egl->num_layers)
+			draw_layers(egl, gbm, idx, i, pacing_time(&pacing, f->present_ns));
 
-		if (gbm->surface) {
-			eglSwapBuffers(egl->display, egl->surface);
+		if (!gbm->surface) {
+			glBindFramebuffer(GL_FRAMEBUFFER, egl->fbs[idx].fb);
+		} else if (egl->num_layers) {
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
 		}
 
-		/* after swapbuffers, gpu_fence should be flushed, so safe
-		 * to get fd:
-		 */
-		drm.kms_in_fence_fd = egl->eglDupNativeFenceFDANDROID(egl->display, gpu_fence);
-		egl->eglDestroySyncKHR(egl->display, gpu_fence);
-		assert(drm.kms_in_fence_fd != -1);
+		egl->draw(i, pacing_time(&pacing, f->present_ns));
+
+		composite_layers(egl, gbm,
+				__atomic_load_n(&composite_mask, __ATOMIC_ACQUIRE));
+
+		/* layers on planes are not in the capture: */
+		capture_frame(egl, i++);
 
-		if (gbm->surface) {
-			next_bo = gbm_surface_lock_front_buffer(gbm->surface);
+		for (unsigned n = 0; n < egl->num_layers; n++)
+			f->layer_bos[n] = egl->layers[n]->bos[idx];
+
+		if (native_fences) {
+			/* insert fence to be singled in cmdstream.. this fence will be
+			 * signaled when gpu rendering done
+			 */
+			EGLSyncKHR gpu_fence = create_fence(egl, EGL_NO_NATIVE_FENCE_FD_ANDROID);
+
+			if (gbm->surface) {
+				eglSwapBuffers(egl->display, egl->surface);
+			} else {
+				glFlush();
+			}
+
+			/* after swapbuffers, gpu_fence should be flushed, so safe
+			 * to get fd:
+			 */
+			f->fence_fd = egl->eglDupNativeFenceFDANDROID(egl->display, gpu_fence);
+			egl->eglDestroySyncKHR(egl->display, gpu_fence);
+			assert(f->fence_fd != -1);
+			f->gpu_fence_fd = dup(f->fence_fd);
 		} else {
-			next_bo = gbm->bos[frame % NUM_BUFFERS];
+			glFinish();
+			if (gbm->surface) {
+				eglSwapBuffers(egl->display, egl->surface);
+			}
 		}
-		if (!next_bo) {
+
+		f->bo = swapchain_queue(&sc, idx);
+		if (!f->bo) {
 			printf("Failed to lock frontbuffer\n");
-			return -1;
-		}
-		fb = drm_fb_get_from_bo(next_bo);
-		if (!fb) {
-			printf("Failed to get a new framebuffer BO\n");
-			return -1;
+			ret = -1;
+			break;
 		}
+		f->t.draw_end = get_time_ns();
+		pacing_rendered(&pacing, f->t.draw_end - f->t.draw_start);
 
-		if (kms_fence) {
-			EGLint status;
-
-			/* Wait on the CPU side for the _previous_ commit to
-			 * complete before we post the flip through KMS, as
-			 * atomic will reject the commit if we post a new one
-			 * whilst the previous one is still pending.
-			 */
-			do {
-				status = egl->eglClientWaitSyncKHR(egl->display,
-								   kms_fence,
-								   0,
-								   EGL_FOREVER_KHR);
-			} while (status != EGL_CONDITION_SATISFIED_KHR);
-
-			egl->eglDestroySyncKHR(egl->display, kms_fence);
-		}
+		spsc_queue_push(&pipeline.ready, f);
+		wake(pipeline.ready_efd);
 
 		cur_time = get_time_ns();
 		if (cur_time > (report_time + 2 * NSEC_PER_SEC)) {
@@ -286,38 +1359,20 @@ static int atomic_run(const struct gbm *gbm, const struct egl *egl)
 			unsigned frames = i - 1;  /* first frame ignored */
 			printf("Rendered %u frames in %f sec (%f fps)\n",
 				frames, secs, (double)frames/secs);
+			dump_cubes(frames, secs);
 			report_time = cur_time;
 		}
+	}
 
-		/* Check for user input: */
-		struct pollfd fdset[] = { {
-			.fd = STDIN_FILENO,
-			.events = POLLIN,
-		} };
-		ret = poll(fdset, ARRAY_SIZE(fdset), 0);
-		if (ret > 0) {
-			printf("user interrupted!\n");
-			return 0;
-		}
-
-		/*
-		 * Here you could also update drm plane layers if you want
-		 * hw composition
-		 */
-		ret = drm_atomic_commit(fb->fb_id, flags);
-		if (ret) {
-			printf("failed to commit: %s\n", strerror(errno));
-			return -1;
-		}
-
-		/* release last buffer to render on again: */
-		if (bo && gbm->surface)
-			gbm_surface_release_buffer(gbm->surface, bo);
-		bo = next_bo;
+	/* let the commit thread flush what is queued, and stop: */
+	__atomic_store_n(&pipeline.quit, true, __ATOMIC_RELEASE);
+	wake(pipeline.ready_efd);
+	pthread_join(pipeline.commit_thread, NULL);
 
-		/* Allow a modeset change for the first commit only. */
-		flags &= ~(DRM_MODE_ATOMIC_ALLOW_MODESET);
-	}
+	destroy_mode_blobs();
+	while (solver.num_planes > 0)
+		free_plane(&solver.planes[--solver.num_planes]);
+	free_requests();
 
 	finish_perfcntrs();
 
@@ -327,19 +1382,30 @@ static int atomic_run(const struct gbm *gbm, const struct egl *egl)
 	unsigned frames = i - 1;  /* first frame ignored */
 	printf("Rendered %u frames in %f sec (%f fps)\n",
 		frames, secs, (double)frames/secs);
+	dump_cubes(frames, secs);
+
+	if (pacing.missed)
+		printf("Missed %u vblanks\n", pacing.missed);
+
+	stats_dump();
 
 	dump_perfcntrs(frames, elapsed_time);
 
+	evloop_fini(&loop);
+	close(pipeline.ready_efd);
+	close(pipeline.done_efd);
+
 	return ret;
 }
 
 /* Pick a plane.. something that at a minimum can be connected to
- * the chosen crtc, but prefer primary plane.
+ * the chosen crtc, but prefer primary plane.  Skip the planes picked
+ * for the outputs before this one.
  *
  * Seems like there is some room for a drmModeObjectGetNamedProperty()
  * type helper in libdrm..
  */
-static int get_plane_id(void)
+static int get_plane_id(unsigned n)
 {
 	drmModePlaneResPtr plane_resources;
 	uint32_t i, j;
@@ -360,7 +1426,11 @@ static int get_plane_id(void)
 			continue;
 		}
 
-		if (plane->possible_crtcs & (1 << drm.crtc_index)) {
+		for (j = 0; j < n; j++)
+			if (drm.outputs[j].plane->plane->plane_id == id)
+				break;
+
+		if (j == n && (plane->possible_crtcs & crtc_bit(drm.outputs[n].crtc_index))) {
 			drmModeObjectPropertiesPtr props =
 				drmModeObjectGetProperties(drm.fd, id, DRM_MODE_OBJECT_PLANE);
 
@@ -391,72 +1461,100 @@ static int get_plane_id(void)
 	return ret;
 }
 
-const struct drm * init_drm_atomic(const char *device, const char *mode_str,
-		unsigned int vrefresh, unsigned int count)
+/* Grab the plane/crtc/connector property info for the output: */
+static int init_output_objects(struct output *output, uint32_t plane_id)
 {
-	uint32_t plane_id;
-	int ret;
-
-	ret = init_drm(&drm, device, mode_str, vrefresh, count);
-	if (ret)
-		return NULL;
-
-	ret = drmSetClientCap(drm.fd, DRM_CLIENT_CAP_ATOMIC, 1);
-	if (ret) {
-		printf("no atomic modesetting support: %s\n", strerror(errno));
-		return NULL;
-	}
-
-	ret = get_plane_id();
-	if (!ret) {
-		printf("could not find a suitable plane\n");
-		return NULL;
-	} else {
-		plane_id = ret;
-	}
-
-	/* We only do single plane to single crtc to single connector, no
-	 * fancy multi-monitor or multi-plane stuff.  So just grab the
-	 * plane/crtc/connector property info for one of each:
-	 */
-	drm.plane = calloc(1, sizeof(*drm.plane));
-	drm.crtc = calloc(1, sizeof(*drm.crtc));
-	drm.connector = calloc(1, sizeof(*drm.connector));
+	output->plane = calloc(1, sizeof(*output->plane));
+	output->crtc = calloc(1, sizeof(*output->crtc));
+	output->connector = calloc(1, sizeof(*output->connector));
 
 #define get_resource(type, Type, id) do { 					\
-		drm.type->type = drmModeGet##Type(drm.fd, id);			\
-		if (!drm.type->type) {						\
+		output->type->type = drmModeGet##Type(drm.fd, id);		\
+		if (!output->type->type) {					\
 			printf("could not get %s %i: %s\n",			\
 					#type, id, strerror(errno));		\
-			return NULL;						\
+			return -1;						\
 		}								\
 	} while (0)
 
 	get_resource(plane, Plane, plane_id);
-	get_resource(crtc, Crtc, drm.crtc_id);
-	get_resource(connector, Connector, drm.connector_id);
+	get_resource(crtc, Crtc, output->crtc_id);
+	get_resource(connector, Connector, output->connector_id);
 
 #define get_properties(type, TYPE, id) do {					\
 		uint32_t i;							\
-		drm.type->props = drmModeObjectGetProperties(drm.fd,		\
+		output->type->props = drmModeObjectGetProperties(drm.fd,	\
 				id, DRM_MODE_OBJECT_##TYPE);			\
-		if (!drm.type->props) {						\
+		if (!output->type->props) {					\
 			printf("could not get %s %u properties: %s\n", 		\
 					#type, id, strerror(errno));		\
-			return NULL;						\
+			return -1;						\
 		}								\
-		drm.type->props_info = calloc(drm.type->props->count_props,	\
-				sizeof(*drm.type->props_info));			\
-		for (i = 0; i < drm.type->props->count_props; i++) {		\
-			drm.type->props_info[i] = drmModeGetProperty(drm.fd,	\
-					drm.type->props->props[i]);		\
+		output->type->props_info = calloc(output->type->props->count_props, \
+				sizeof(*output->type->props_info));		\
+		for (i = 0; i < output->type->props->count_props; i++) {	\
+			output->type->props_info[i] = drmModeGetProperty(drm.fd, \
+					output->type->props->props[i]);		\
 		}								\
 	} while (0)
 
 	get_properties(plane, PLANE, plane_id);
-	get_properties(crtc, CRTC, drm.crtc_id);
-	get_properties(connector, CONNECTOR, drm.connector_id);
+	get_properties(crtc, CRTC, output->crtc_id);
+	get_properties(connector, CONNECTOR, output->connector_id);
+
+#define get_prop_ids(type) do {						\
+		lookup_prop_ids(output->type->props, output->type->props_info, \
+				type##_prop_names,				\
+				ARRAY_SIZE(output->type->prop_id),		\
+				output->type->prop_id);			\
+	} while (0)
+
+	get_prop_ids(plane);
+	get_prop_ids(crtc);
+	get_prop_ids(connector);
+
+	return 0;
+}
+
+const struct drm * init_drm_atomic(const char *device, const char *mode_str,
+		unsigned int vrefresh, unsigned int count, bool all_outputs,
+		bool pacing)
+{
+	int ret;
+
+	ret = init_drm(&drm, device, mode_str, vrefresh, count, all_outputs);
+	if (ret)
+		return NULL;
+
+	ret = drmSetClientCap(drm.fd, DRM_CLIENT_CAP_ATOMIC, 1);
+	if (ret) {
+		printf("no atomic modesetting support: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	/* One plane to one crtc to one connector per output, the planes
+	 * for --layers are picked later:
+	 */
+	for (unsigned n = 0; n < drm.num_outputs; n++) {
+		ret = get_plane_id(n);
+		if (!ret) {
+			printf("could not find a suitable plane\n");
+			return NULL;
+		}
+
+		if (init_output_objects(&drm.outputs[n], ret))
+			return NULL;
+
+		/* init_drm() may have cleared the slot, after a failed output: */
+		drm.outputs[n].kms_out_fence_fd = -1;
+	}
+
+	if (init_requests()) {
+		printf("failed to build atomic request\n");
+		return NULL;
+	}
 
+	drm.pacing = pacing;
 	drm.run = atomic_run;
 
 	return &drm;
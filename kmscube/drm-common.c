@@ -21,6 +21,7 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <fcntl.h>
@@ -124,8 +125,80 @@ struct drm_fb * drm_fb_get_from_bo(struct gbm_bo *bo)
 	return fb;
 }
 
+void swapchain_init(struct swapchain *sc, const struct gbm *gbm)
+{
+	memset(sc, 0, sizeof(*sc));
+	sc->gbm = gbm;
+
+	for (unsigned i = 0; i < gbm->num_buffers; i++) {
+		if (!gbm->surface)
+			sc->buffers[i].bo = gbm->bos[i];
+		sc->buffers[i].state = BUFFER_FREE;
+	}
+}
+
+void swapchain_release(struct swapchain *sc, int idx)
+{
+	if (sc->gbm->surface) {
+		gbm_surface_release_buffer(sc->gbm->surface, sc->buffers[idx].bo);
+		sc->buffers[idx].bo = NULL;
+	}
+	sc->buffers[idx].state = BUFFER_FREE;
+}
+
+/* Get a FREE buffer to render into, returns -1 if all buffers are
+ * still queued or on screen:
+ */
+int swapchain_acquire(struct swapchain *sc)
+{
+	if (sc->gbm->surface && !gbm_surface_has_free_buffers(sc->gbm->surface))
+		return -1;
+
+	for (unsigned i = 0; i < sc->gbm->num_buffers; i++) {
+		if (sc->buffers[i].state == BUFFER_FREE) {
+			sc->buffers[i].state = BUFFER_BACK;
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* Mark a rendered buffer as handed to KMS, returns the bo to flip to.
+ * In the gbm surface case the caller must have done eglSwapBuffers()
+ * already.
+ */
+struct gbm_bo * swapchain_queue(struct swapchain *sc, int idx)
+{
+	assert(sc->buffers[idx].state == BUFFER_BACK);
+
+	if (sc->gbm->surface) {
+		sc->buffers[idx].bo = gbm_surface_lock_front_buffer(sc->gbm->surface);
+		if (!sc->buffers[idx].bo)
+			return NULL;
+	}
+	sc->buffers[idx].state = BUFFER_QUEUED;
+
+	return sc->buffers[idx].bo;
+}
+
+/* The flip to buffer idx completed, the previous one can be reused: */
+void swapchain_scanout(struct swapchain *sc, int idx)
+{
+	for (unsigned i = 0; i < sc->gbm->num_buffers; i++) {
+		if (sc->buffers[i].state == BUFFER_SCANOUT)
+			swapchain_release(sc, i);
+	}
+
+	assert(sc->buffers[idx].state == BUFFER_QUEUED);
+	sc->buffers[idx].state = BUFFER_SCANOUT;
+}
+
+/* Find a crtc for the encoder, that isn't in use by another output
+ * already (taken is a mask of crtc indices):
+ */
 static uint32_t find_crtc_for_encoder(const drmModeRes *resources,
-		const drmModeEncoder *encoder) {
+		const drmModeEncoder *encoder, uint32_t taken) {
 	int i;
 
 	for (i = 0; i < resources->count_crtcs; i++) {
@@ -134,17 +207,17 @@ static uint32_t find_crtc_for_encoder(const drmModeRes *resources,
 		 */
 		const uint32_t crtc_mask = 1 << i;
 		const uint32_t crtc_id = resources->crtcs[i];
-		if (encoder->possible_crtcs & crtc_mask) {
+		if ((encoder->possible_crtcs & crtc_mask) && !(taken & crtc_mask)) {
 			return crtc_id;
 		}
 	}
 
 	/* no match found */
-	return -1;
+	return 0;
 }
 
 static uint32_t find_crtc_for_connector(const struct drm *drm, const drmModeRes *resources,
-		const drmModeConnector *connector) {
+		const drmModeConnector *connector, uint32_t taken) {
 	int i;
 
 	for (i = 0; i < connector->count_encoders; i++) {
@@ -152,7 +225,7 @@ static uint32_t find_crtc_for_connector(const struct drm *drm, const drmModeRes
 		drmModeEncoder *encoder = drmModeGetEncoder(drm->fd, encoder_id);
 
 		if (encoder) {
-			const uint32_t crtc_id = find_crtc_for_encoder(resources, encoder);
+			const uint32_t crtc_id = find_crtc_for_encoder(resources, encoder, taken);
 
 			drmModeFreeEncoder(encoder);
 			if (crtc_id != 0) {
@@ -162,7 +235,7 @@ static uint32_t find_crtc_for_connector(const struct drm *drm, const drmModeRes
 	}
 
 	/* no match found */
-	return -1;
+	return 0;
 }
 
 static int get_resources(int fd, drmModeRes **resources)
@@ -212,51 +285,22 @@ static int find_drm_device(drmModeRes **resources)
 	return fd;
 }
 
-int init_drm(struct drm *drm, const char *device, const char *mode_str,
-		unsigned int vrefresh, unsigned int count)
+static int crtc_index(const drmModeRes *resources, uint32_t crtc_id)
 {
-	drmModeRes *resources;
-	drmModeConnector *connector = NULL;
-	drmModeEncoder *encoder = NULL;
-	int i, ret, area;
-
-	if (device) {
-		drm->fd = open(device, O_RDWR);
-		ret = get_resources(drm->fd, &resources);
-		if (ret < 0 && errno == EOPNOTSUPP)
-			printf("%s does not look like a modeset device\n", device);
-	} else {
-		drm->fd = find_drm_device(&resources);
-	}
-
-	if (drm->fd < 0) {
-		printf("could not open drm device\n");
-		return -1;
-	}
-
-	if (!resources) {
-		printf("drmModeGetResources failed: %s\n", strerror(errno));
-		return -1;
-	}
-
-	/* find a connected connector: */
-	for (i = 0; i < resources->count_connectors; i++) {
-		connector = drmModeGetConnector(drm->fd, resources->connectors[i]);
-		if (connector->connection == DRM_MODE_CONNECTED) {
-			/* it's connected, let's use this! */
-			break;
-		}
-		drmModeFreeConnector(connector);
-		connector = NULL;
-	}
+	for (int i = 0; i < resources->count_crtcs; i++)
+		if (resources->crtcs[i] == crtc_id)
+			return i;
+	return -1;
+}
 
-	if (!connector) {
-		/* we could be fancy and listen for hotplug events and wait for
-		 * a connector..
-		 */
-		printf("no connected connector!\n");
-		return -1;
-	}
+/* Pick the mode and crtc for a connected connector: */
+static int init_output(struct drm *drm, const drmModeRes *resources,
+		drmModeConnector *connector, const char *mode_str,
+		unsigned int vrefresh, struct output *output)
+{
+	drmModeEncoder *encoder = NULL;
+	uint32_t taken = 0;
+	int i, area;
 
 	/* find user requested mode: */
 	if (mode_str && *mode_str) {
@@ -265,38 +309,41 @@ int init_drm(struct drm *drm, const char *device, const char *mode_str,
 
 			if (strcmp(current_mode->name, mode_str) == 0) {
 				if (vrefresh == 0 || current_mode->vrefresh == vrefresh) {
-					drm->mode = current_mode;
+					output->mode = current_mode;
 					break;
 				}
 			}
 		}
-		if (!drm->mode)
+		if (!output->mode)
 			printf("requested mode not found, using default mode!\n");
 	}
 
 	/* find preferred mode or the highest resolution mode: */
-	if (!drm->mode) {
+	if (!output->mode) {
 		for (i = 0, area = 0; i < connector->count_modes; i++) {
 			drmModeModeInfo *current_mode = &connector->modes[i];
 
 			if (current_mode->type & DRM_MODE_TYPE_PREFERRED) {
-				drm->mode = current_mode;
+				output->mode = current_mode;
 				break;
 			}
 
 			int current_area = current_mode->hdisplay * current_mode->vdisplay;
 			if (current_area > area) {
-				drm->mode = current_mode;
+				output->mode = current_mode;
 				area = current_area;
 			}
 		}
 	}
 
-	if (!drm->mode) {
+	if (!output->mode) {
 		printf("could not find mode!\n");
 		return -1;
 	}
 
+	for (unsigned n = 0; n < drm->num_outputs; n++)
+		taken |= crtc_bit(drm->outputs[n].crtc_index);
+
 	/* find encoder: */
 	for (i = 0; i < resources->count_encoders; i++) {
 		encoder = drmModeGetEncoder(drm->fd, resources->encoders[i]);
@@ -306,28 +353,126 @@ int init_drm(struct drm *drm, const char *device, const char *mode_str,
 		encoder = NULL;
 	}
 
-	if (encoder) {
-		drm->crtc_id = encoder->crtc_id;
+	/* keep the crtc the connector is currently driven by, if we can: */
+	if (encoder && encoder->crtc_id &&
+	    crtc_index(resources, encoder->crtc_id) >= 0 &&
+	    !(taken & crtc_bit(crtc_index(resources, encoder->crtc_id)))) {
+		output->crtc_id = encoder->crtc_id;
 	} else {
-		uint32_t crtc_id = find_crtc_for_connector(drm, resources, connector);
+		uint32_t crtc_id = find_crtc_for_connector(drm, resources, connector, taken);
 		if (crtc_id == 0) {
 			printf("no crtc found!\n");
+			if (encoder)
+				drmModeFreeEncoder(encoder);
 			return -1;
 		}
 
-		drm->crtc_id = crtc_id;
+		output->crtc_id = crtc_id;
 	}
 
-	for (i = 0; i < resources->count_crtcs; i++) {
-		if (resources->crtcs[i] == drm->crtc_id) {
-			drm->crtc_index = i;
+	if (encoder)
+		drmModeFreeEncoder(encoder);
+
+	output->crtc_index = crtc_index(resources, output->crtc_id);
+	if (output->crtc_index < 0) {
+		printf("crtc %u not found!\n", output->crtc_id);
+		return -1;
+	}
+	output->connector_id = connector->connector_id;
+	output->kms_out_fence_fd = -1;
+
+	return 0;
+}
+
+int init_drm(struct drm *drm, const char *device, const char *mode_str,
+		unsigned int vrefresh, unsigned int count, bool all_outputs)
+{
+	drmModeRes *resources;
+	drmModeConnector *connector;
+	int i, ret;
+
+	if (device) {
+		drm->fd = open(device, O_RDWR);
+		ret = get_resources(drm->fd, &resources);
+		if (ret < 0 && errno == EOPNOTSUPP)
+			printf("%s does not look like a modeset device\n", device);
+	} else {
+		drm->fd = find_drm_device(&resources);
+	}
+
+	if (drm->fd < 0) {
+		printf("could not open drm device\n");
+		return -1;
+	}
+
+	if (!resources) {
+		printf("drmModeGetResources failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* find connected connectors, just the first one unless asked
+	 * for all of them:
+	 */
+	for (i = 0; i < resources->count_connectors; i++) {
+		struct output *output = &drm->outputs[drm->num_outputs];
+
+		if (drm->num_outputs == (all_outputs ? MAX_OUTPUTS : 1))
 			break;
+
+		connector = drmModeGetConnector(drm->fd, resources->connectors[i]);
+		if (connector->connection != DRM_MODE_CONNECTED) {
+			drmModeFreeConnector(connector);
+			continue;
+		}
+
+		/* the connector stays around, the mode points into it: */
+		if (init_output(drm, resources, connector, mode_str, vrefresh, output)) {
+			drmModeFreeConnector(connector);
+			if (!all_outputs)
+				return -1;
+			memset(output, 0, sizeof(*output));
+			continue;
 		}
+
+		drm->num_outputs++;
+	}
+
+	if (!drm->num_outputs) {
+		/* we could be fancy and listen for hotplug events and wait for
+		 * a connector..
+		 */
+		printf("no connected connector!\n");
+		return -1;
+	}
+
+	for (unsigned n = 0; n < drm->num_outputs; n++) {
+		struct output *output = &drm->outputs[n];
+
+		output->x = drm->width;
+		drm->width += output->mode->hdisplay;
+		drm->height = MAX2(drm->height, output->mode->vdisplay);
+
+		if (all_outputs) {
+			printf("Output %u: connector %u, crtc %u, %s at %d,0\n", n,
+					output->connector_id, output->crtc_id,
+					output->mode->name, output->x);
+		}
+	}
+
+	if ((uint32_t)drm->width > resources->max_width ||
+	    (uint32_t)drm->height > resources->max_height) {
+		printf("%dx%d canvas is too large for the device (max %ux%u)\n",
+				drm->width, drm->height,
+				resources->max_width, resources->max_height);
+		return -1;
 	}
 
 	drmModeFreeResources(resources);
 
-	drm->connector_id = connector->connector_id;
+	drm->mode = drm->outputs[0].mode;
+	drm->crtc_id = drm->outputs[0].crtc_id;
+	drm->connector_id = drm->outputs[0].connector_id;
+	drm->crtc_index = drm->outputs[0].crtc_index;
 	drm->count = count;
 
 	return 0;
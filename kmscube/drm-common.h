@@ -30,42 +30,100 @@
 struct gbm;
 struct egl;
 
+/* Atomic properties we use, their ids are looked up once at init: */
+enum plane_prop {
+	PLANE_FB_ID,
+	PLANE_CRTC_ID,
+	PLANE_SRC_X,
+	PLANE_SRC_Y,
+	PLANE_SRC_W,
+	PLANE_SRC_H,
+	PLANE_CRTC_X,
+	PLANE_CRTC_Y,
+	PLANE_CRTC_W,
+	PLANE_CRTC_H,
+	PLANE_IN_FENCE_FD,
+	PLANE_ZPOS,
+	PLANE_PROP_COUNT
+};
+
+enum crtc_prop {
+	CRTC_MODE_ID,
+	CRTC_ACTIVE,
+	CRTC_OUT_FENCE_PTR,
+	CRTC_PROP_COUNT
+};
+
+enum connector_prop {
+	CONNECTOR_CRTC_ID,
+	CONNECTOR_PROP_COUNT
+};
+
 struct plane {
 	drmModePlane *plane;
 	drmModeObjectProperties *props;
 	drmModePropertyRes **props_info;
+	uint32_t prop_id[PLANE_PROP_COUNT];
 };
 
 struct crtc {
 	drmModeCrtc *crtc;
 	drmModeObjectProperties *props;
 	drmModePropertyRes **props_info;
+	uint32_t prop_id[CRTC_PROP_COUNT];
 };
 
 struct connector {
 	drmModeConnector *connector;
 	drmModeObjectProperties *props;
 	drmModePropertyRes **props_info;
+	uint32_t prop_id[CONNECTOR_PROP_COUNT];
 };
 
-struct drm {
-	int fd;
+/* A connector and the crtc driving it.  With multiple outputs they are
+ * laid out left to right on one canvas, which is rendered once per frame,
+ * and each output scans out its part of it.
+ */
+#define MAX_OUTPUTS 4
+
+struct output {
+	drmModeModeInfo *mode;
+	uint32_t crtc_id;
+	uint32_t connector_id;
+	int crtc_index;
+	int x;                     /* position on the canvas */
 
 	/* only used for atomic: */
 	struct plane *plane;
 	struct crtc *crtc;
 	struct connector *connector;
-	int crtc_index;
-	int kms_in_fence_fd;
 	int kms_out_fence_fd;
+};
 
+struct drm {
+	int fd;
+
+	/* only used for atomic: */
+	int kms_in_fence_fd;
+
+	struct output outputs[MAX_OUTPUTS];
+	unsigned num_outputs;
+
+	/* size of the canvas covering all outputs: */
+	int width, height;
+
+	/* the first output, the only one for legacy (none offscreen): */
 	drmModeModeInfo *mode;
 	uint32_t crtc_id;
 	uint32_t connector_id;
+	int crtc_index;
 
 	/* number of frames to run for: */
 	unsigned int count;
 
+	/* delay rendering until just before the target vblank: */
+	bool pacing;
+
 	int (*run)(const struct gbm *gbm, const struct egl *egl);
 };
 
@@ -76,8 +134,51 @@ struct drm_fb {
 
 struct drm_fb * drm_fb_get_from_bo(struct gbm_bo *bo);
 
-int init_drm(struct drm *drm, const char *device, const char *mode_str, unsigned int vrefresh, unsigned int count);
-const struct drm * init_drm_legacy(const char *device, const char *mode_str, unsigned int vrefresh, unsigned int count);
-const struct drm * init_drm_atomic(const char *device, const char *mode_str, unsigned int vrefresh, unsigned int count);
+/* Swapchain buffer tracking, shared by the legacy and atomic backends.
+ *
+ * A buffer cycles FREE -> BACK -> QUEUED -> SCANOUT -> FREE: it is BACK
+ * while being rendered, QUEUED once handed to KMS, and SCANOUT once the
+ * flip to it has completed.  When the next flip completes the previous
+ * scanout buffer becomes FREE again.  With three or more buffers frame
+ * N+2 can be rendered while N is on screen and N+1 waits for its flip.
+ *
+ * In the gbm surface case the bo's are owned by the gbm_surface, so
+ * the slots only track the locked front buffers, and a buffer going
+ * back to FREE is released to the surface.
+ */
+enum buffer_state {
+	BUFFER_FREE,
+	BUFFER_BACK,
+	BUFFER_QUEUED,
+	BUFFER_SCANOUT,
+};
+
+struct swapchain {
+	const struct gbm *gbm;
+	struct {
+		struct gbm_bo *bo;
+		enum buffer_state state;
+	} buffers[MAX_BUFFERS];
+};
+
+void swapchain_init(struct swapchain *sc, const struct gbm *gbm);
+int swapchain_acquire(struct swapchain *sc);
+struct gbm_bo * swapchain_queue(struct swapchain *sc, int idx);
+void swapchain_scanout(struct swapchain *sc, int idx);
+/* Make a buffer FREE right away, for a caller that tracks itself when
+ * a buffer is off screen (atomic, with outputs flipping independently):
+ */
+void swapchain_release(struct swapchain *sc, int idx);
+
+/* The possible_crtcs bit of a crtc index, none for -1 (not found): */
+static inline uint32_t crtc_bit(int crtc_index)
+{
+	return crtc_index >= 0 ? 1u << crtc_index : 0;
+}
+
+int init_drm(struct drm *drm, const char *device, const char *mode_str, unsigned int vrefresh, unsigned int count, bool all_outputs);
+const struct drm * init_drm_legacy(const char *device, const char *mode_str, unsigned int vrefresh, unsigned int count, bool pacing);
+const struct drm * init_drm_atomic(const char *device, const char *mode_str, unsigned int vrefresh, unsigned int count, bool all_outputs, bool pacing);
+const struct drm * init_drm_offscreen(const char *device, int width, int height, unsigned int count);
 
 #endif /* _DRM_COMMON_H */
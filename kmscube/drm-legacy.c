@@ -24,41 +24,101 @@
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/select.h>
 
 #include "common.h"
+#include "capture.h"
 #include "drm-common.h"
+#include "evloop.h"
+#include "pacing.h"
+#include "stats.h"
 
 static struct drm drm;
+static struct swapchain sc;
+static struct evloop loop;
+static struct pacing pacing;
+
+/* predicted present time, and the stage timestamps, of the frame in
+ * each swapchain buffer:
+ */
+static int64_t targets[MAX_BUFFERS];
+static struct frame_times times[MAX_BUFFERS];
+
+/* are the flip event timestamps on the get_time_ns() clock? */
+static bool monotonic_timestamps;
 
 static void page_flip_handler(int fd, unsigned int frame,
 		  unsigned int sec, unsigned int usec, void *data)
 {
 	/* suppress 'unused parameter' warnings */
-	(void)fd, (void)frame, (void)sec, (void)usec;
+	(void)fd;
+
+	int *pending_flip = data;
+	int64_t vblank_ns = monotonic_timestamps ?
+			sec * NSEC_PER_SEC + usec * (NSEC_PER_SEC / USEC_PER_SEC) :
+			get_time_ns();
 
-	int *waiting_for_flip = data;
-	*waiting_for_flip = 0;
+	pacing_flip(&pacing, frame, vblank_ns, targets[*pending_flip]);
+
+	times[*pending_flip].flip = vblank_ns;
+	stats_add(&times[*pending_flip]);
+
+	swapchain_scanout(&sc, *pending_flip);
+	*pending_flip = -1;
 }
 
-static int legacy_run(const struct gbm *gbm, const struct egl *egl)
+static int drm_event(struct evloop *loop, int fd, void *data)
 {
-	fd_set fds;
 	drmEventContext evctx = {
 			.version = 2,
 			.page_flip_handler = page_flip_handler,
 	};
+
+	(void)loop; (void)data;
+
+	drmHandleEvent(fd, &evctx);
+
+	return 0;
+}
+
+/* Wait for the flip in flight (if any) to complete.  Returns 1 if the
+ * user interrupted, 0 when the flip completed, negative on error.
+ */
+static int wait_for_flip(int *pending_flip)
+{
+	int ret;
+
+	while (*pending_flip >= 0) {
+		ret = evloop_dispatch(&loop, -1);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int legacy_loop(const struct gbm *gbm, const struct egl *egl)
+{
 	struct gbm_bo *bo;
 	struct drm_fb *fb;
 	uint32_t i = 0;
 	int64_t start_time, report_time, cur_time;
-	int ret;
+	int64_t present_ns, render_start;
+	int pending_flip = -1;
+	int idx, ret;
+	uint64_t cap;
 
-	if (gbm->surface) {
+	swapchain_init(&sc, gbm);
+
+	monotonic_timestamps = !drmGetCap(drm.fd, DRM_CAP_TIMESTAMP_MONOTONIC, &cap) && cap;
+	pacing_init(&pacing, drm.mode, drm.pacing);
+
+	idx = swapchain_acquire(&sc);
+	if (gbm->surface)
 		eglSwapBuffers(egl->display, egl->surface);
-		bo = gbm_surface_lock_front_buffer(gbm->surface);
-	} else {
-		bo = gbm->bos[0];
+	bo = swapchain_queue(&sc, idx);
+	if (!bo) {
+		fprintf(stderr, "Failed to lock frontbuffer\n");
+		return -1;
 	}
 	fb = drm_fb_get_from_bo(bo);
 	if (!fb) {
@@ -73,13 +133,24 @@ static int legacy_run(const struct gbm *gbm, const struct egl *egl)
 		printf("failed to set mode: %s\n", strerror(errno));
 		return ret;
 	}
+	swapchain_scanout(&sc, idx);
 
 	start_time = report_time = get_time_ns();
 
 	while (i < drm.count) {
-		unsigned frame = i;
-		struct gbm_bo *next_bo;
-		int waiting_for_flip = 1;
+		/* wait until a flip hands us back a buffer to render into: */
+		while ((idx = swapchain_acquire(&sc)) < 0) {
+			if (pending_flip < 0) {
+				printf("no free buffer to render into\n");
+				ret = -1;
+				goto out;
+			}
+			ret = wait_for_flip(&pending_flip);
+			if (ret) {
+				ret = ret > 0 ? 0 : ret;
+				goto out;
+			}
+		}
 
 		/* Start fps measuring on second frame, to remove the time spent
 		 * compiling shader, etc, from the fps:
@@ -88,23 +159,55 @@ static int legacy_run(const struct gbm *gbm, const struct egl *egl)
 			start_time = report_time = get_time_ns();
 		}
 
+		/* hold rendering back until the deadline for the vblank it
+		 * targets, with --pacing:
+		 */
+		present_ns = pacing_schedule(&pacing, get_time_ns(), &render_start);
+		ret = evloop_dispatch_until(&loop, render_start);
+		if (ret) {
+			ret = ret > 0 ? 0 : ret;
+			goto out;
+		}
+		render_start = times[idx].draw_start = get_time_ns();
+
 		if (!gbm->surface) {
-			glBindFramebuffer(GL_FRAMEBUFFER, egl->fbs[frame % NUM_BUFFERS].fb);
+			glBindFramebuffer(GL_FRAMEBUFFER, egl->fbs[idx].fb);
 		}
 
-		egl->draw(i++);
+		egl->draw(i, pacing_time(&pacing, present_ns));
+		capture_frame(egl, i++);
 
 		if (gbm->surface) {
 			eglSwapBuffers(egl->display, egl->surface);
-			next_bo = gbm_surface_lock_front_buffer(gbm->surface);
 		} else {
 			glFinish();
-			next_bo = gbm->bos[frame % NUM_BUFFERS];
 		}
-		fb = drm_fb_get_from_bo(next_bo);
+		/* no fences here, so the gpu done time is just a guess, in
+		 * the surfaceless case glFinish() makes it a good one:
+		 */
+		times[idx].draw_end = times[idx].gpu_done = get_time_ns();
+		pacing_rendered(&pacing, times[idx].draw_end - render_start);
+		targets[idx] = present_ns;
+		bo = swapchain_queue(&sc, idx);
+		if (!bo) {
+			fprintf(stderr, "Failed to lock frontbuffer\n");
+			ret = -1;
+			goto out;
+		}
+		fb = drm_fb_get_from_bo(bo);
 		if (!fb) {
 			fprintf(stderr, "Failed to get a new framebuffer BO\n");
-			return -1;
+			ret = -1;
+			goto out;
+		}
+
+		/* only one flip can be in flight at a time, with more than
+		 * two buffers this is where the previous one gets retired:
+		 */
+		ret = wait_for_flip(&pending_flip);
+		if (ret) {
+			ret = ret > 0 ? 0 : ret;
+			goto out;
 		}
 
 		/*
@@ -112,31 +215,15 @@ static int legacy_run(const struct gbm *gbm, const struct egl *egl)
 		 * hw composition
 		 */
 
+		times[idx].commit = get_time_ns();
 		ret = drmModePageFlip(drm.fd, drm.crtc_id, fb->fb_id,
-				DRM_MODE_PAGE_FLIP_EVENT, &waiting_for_flip);
+				DRM_MODE_PAGE_FLIP_EVENT, &pending_flip);
 		if (ret) {
 			printf("failed to queue page flip: %s\n", strerror(errno));
-			return -1;
-		}
-
-		while (waiting_for_flip) {
-			FD_ZERO(&fds);
-			FD_SET(0, &fds);
-			FD_SET(drm.fd, &fds);
-
-			ret = select(drm.fd + 1, &fds, NULL, NULL, NULL);
-			if (ret < 0) {
-				printf("select err: %s\n", strerror(errno));
-				return ret;
-			} else if (ret == 0) {
-				printf("select timeout!\n");
-				return -1;
-			} else if (FD_ISSET(0, &fds)) {
-				printf("user interrupted!\n");
-				return 0;
-			}
-			drmHandleEvent(drm.fd, &evctx);
+			ret = -1;
+			goto out;
 		}
+		pending_flip = idx;
 
 		cur_time = get_time_ns();
 		if (cur_time > (report_time + 2 * NSEC_PER_SEC)) {
@@ -145,16 +232,13 @@ static int legacy_run(const struct gbm *gbm, const struct egl *egl)
 			unsigned frames = i - 1;  /* first frame ignored */
 			printf("Rendered %u frames in %f sec (%f fps)\n",
 				frames, secs, (double)frames/secs);
+			dump_cubes(frames, secs);
 			report_time = cur_time;
 		}
-
-		/* release last buffer to render on again: */
-		if (gbm->surface) {
-			gbm_surface_release_buffer(gbm->surface, bo);
-		}
-		bo = next_bo;
 	}
 
+out:
+	/* also on an interrupt or error, so the stats make it out: */
 	finish_perfcntrs();
 
 	cur_time = get_time_ns();
@@ -163,21 +247,50 @@ static int legacy_run(const struct gbm *gbm, const struct egl *egl)
 	unsigned frames = i - 1;  /* first frame ignored */
 	printf("Rendered %u frames in %f sec (%f fps)\n",
 		frames, secs, (double)frames/secs);
+	dump_cubes(frames, secs);
+
+	if (pacing.missed)
+		printf("Missed %u vblanks\n", pacing.missed);
+
+	stats_dump();
 
 	dump_perfcntrs(frames, elapsed_time);
 
-	return 0;
+	return ret;
+}
+
+static int legacy_run(const struct gbm *gbm, const struct egl *egl)
+{
+	int ret;
+
+	ret = evloop_init(&loop);
+	if (ret)
+		return ret;
+
+	if (evloop_add_fd(&loop, drm.fd, drm_event, NULL) < 0 ||
+	    evloop_add_interrupts(&loop) || stats_add_signal(&loop) ||
+	    (egl->add_sources && egl->add_sources(&loop))) {
+		evloop_fini(&loop);
+		return -1;
+	}
+
+	ret = legacy_loop(gbm, egl);
+
+	evloop_fini(&loop);
+
+	return ret;
 }
 
 const struct drm * init_drm_legacy(const char *device, const char *mode_str,
-		unsigned int vrefresh, unsigned int count)
+		unsigned int vrefresh, unsigned int count, bool pacing)
 {
 	int ret;
 
-	ret = init_drm(&drm, device, mode_str, vrefresh, count);
+	ret = init_drm(&drm, device, mode_str, vrefresh, count, false);
 	if (ret)
 		return NULL;
 
+	drm.pacing = pacing;
 	drm.run = legacy_run;
 
 	return &drm;
@@ -0,0 +1,205 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "common.h"
+#include "drm-common.h"
+#include "evloop.h"
+#include "stats.h"
+
+/* Headless backend: renders into surfaceless buffers on a render node,
+ * without any modeset or flips, as fast as the gpu goes.  Up to the
+ * swapchain depth frames are in flight, each buffer is reused once
+ * the fence of the frame last rendered into it signaled.
+ */
+
+static struct drm drm;
+
+#define MAX_DRM_DEVICES 64
+
+static int find_render_node(void)
+{
+	drmDevicePtr devices[MAX_DRM_DEVICES] = { NULL };
+	int num_devices, fd = -1;
+
+	num_devices = drmGetDevices2(0, devices, MAX_DRM_DEVICES);
+	if (num_devices < 0) {
+		printf("drmGetDevices2 failed: %s\n", strerror(-num_devices));
+		return -1;
+	}
+
+	for (int i = 0; i < num_devices && fd < 0; i++) {
+		if (devices[i]->available_nodes & (1 << DRM_NODE_RENDER))
+			fd = open(devices[i]->nodes[DRM_NODE_RENDER], O_RDWR | O_CLOEXEC);
+	}
+	drmFreeDevices(devices, num_devices);
+
+	if (fd < 0)
+		printf("no render node found!\n");
+	return fd;
+}
+
+static int offscreen_run(const struct gbm *gbm, const struct egl *egl)
+{
+	EGLSyncKHR fences[MAX_BUFFERS] = { EGL_NO_SYNC_KHR };
+	struct frame_times times[MAX_BUFFERS];
+	struct evloop loop;
+	uint32_t i = 0;
+	int64_t start_time, report_time, cur_time;
+	bool use_fences;
+	int ret = 0;
+
+	use_fences = egl->eglCreateSyncKHR && egl->eglClientWaitSyncKHR &&
+			egl->eglDestroySyncKHR;
+	if (!use_fences)
+		printf("no fence support, using glFinish()\n");
+
+	if (evloop_init(&loop))
+		return -1;
+
+	if (evloop_add_interrupts(&loop) || stats_add_signal(&loop) ||
+	    (egl->add_sources && egl->add_sources(&loop))) {
+		evloop_fini(&loop);
+		return -1;
+	}
+
+	start_time = report_time = get_time_ns();
+
+	while (i < drm.count) {
+		unsigned idx = i % gbm->num_buffers;
+		struct frame_times *t = &times[idx];
+
+		/* retire the frame last rendered into this buffer: */
+		if (fences[idx] != EGL_NO_SYNC_KHR) {
+			egl->eglClientWaitSyncKHR(egl->display, fences[idx], 0, EGL_FOREVER_KHR);
+			egl->eglDestroySyncKHR(egl->display, fences[idx]);
+			fences[idx] = EGL_NO_SYNC_KHR;
+
+			t->gpu_done = t->commit = t->flip = get_time_ns();
+			stats_add(t);
+		}
+
+		ret = evloop_dispatch(&loop, 0);
+		if (ret) {
+			ret = ret > 0 ? 0 : ret;
+			break;
+		}
+
+		/* Start fps measuring on second frame, to remove the time spent
+		 * compiling shader, etc, from the fps:
+		 */
+		if (i == 1) {
+			start_time = report_time = get_time_ns();
+		}
+
+		t->draw_start = get_time_ns();
+
+		glBindFramebuffer(GL_FRAMEBUFFER, egl->fbs[idx].fb);
+
+		/* nothing is presented, so animate at a fixed 60 steps per
+		 * second of frames, which keeps the output reproducible:
+		 */
+		egl->draw(i, i * (NSEC_PER_SEC / 60));
+		capture_frame(egl, i++);
+
+		if (use_fences) {
+			fences[idx] = egl->eglCreateSyncKHR(egl->display,
+					EGL_SYNC_FENCE_KHR, NULL);
+			glFlush();
+			t->draw_end = get_time_ns();
+		} else {
+			glFinish();
+			t->draw_end = t->gpu_done = t->commit = t->flip = get_time_ns();
+			stats_add(t);
+		}
+
+		cur_time = get_time_ns();
+		if (cur_time > (report_time + 2 * NSEC_PER_SEC)) {
+			double elapsed_time = cur_time - start_time;
+			double secs = elapsed_time / (double)NSEC_PER_SEC;
+			unsigned frames = i - 1;  /* first frame ignored */
+			printf("Rendered %u frames in %f sec (%f fps)\n",
+				frames, secs, (double)frames/secs);
+			dump_cubes(frames, secs);
+			report_time = cur_time;
+		}
+	}
+
+	/* the rendered frames only count once they are done: */
+	glFinish();
+	for (unsigned n = 0; n < gbm->num_buffers; n++) {
+		if (fences[n] != EGL_NO_SYNC_KHR)
+			egl->eglDestroySyncKHR(egl->display, fences[n]);
+	}
+
+	finish_perfcntrs();
+
+	cur_time = get_time_ns();
+	double elapsed_time = cur_time - start_time;
+	double secs = elapsed_time / (double)NSEC_PER_SEC;
+	unsigned frames = i - 1;  /* first frame ignored */
+	printf("Rendered %u frames in %f sec (%f fps, %f Mpixels/s)\n",
+		frames, secs, (double)frames/secs,
+		(double)frames * gbm->width * gbm->height / secs / 1000000.0);
+	dump_cubes(frames, secs);
+
+	stats_dump();
+
+	dump_perfcntrs(frames, elapsed_time);
+
+	evloop_fini(&loop);
+
+	return ret;
+}
+
+const struct drm * init_drm_offscreen(const char *device, int width, int height,
+		unsigned int count)
+{
+	if (width <= 0 || height <= 0) {
+		printf("invalid offscreen size: %dx%d\n", width, height);
+		return NULL;
+	}
+
+	if (device)
+		drm.fd = open(device, O_RDWR | O_CLOEXEC);
+	else
+		drm.fd = find_render_node();
+
+	if (drm.fd < 0) {
+		printf("could not open drm device\n");
+		return NULL;
+	}
+
+	drm.width = width;
+	drm.height = height;
+	drm.count = count;
+	drm.run = offscreen_run;
+
+	printf("Rendering offscreen at %dx%d\n", width, height);
+
+	return &drm;
+}
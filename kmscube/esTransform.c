@@ -44,8 +44,68 @@
 #include <math.h>
 #include <string.h>
 
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #define PI 3.1415926535897932384626433832795f
 
+///
+//  SIMD helpers
+//
+//  A row of the product A * B is the rows of B weighted by the elements
+//  of the same row of A, so with a row of B per register it is one
+//  multiply and three multiply-adds.  The matrices need not be aligned.
+//
+#if defined(__SSE__)
+#define ES_SIMD "sse"
+typedef __m128 esvec4;
+#define vload(p)          _mm_loadu_ps(p)
+#define vstore(p, v)      _mm_storeu_ps(p, v)
+#define vsplat(f)         _mm_set1_ps(f)
+#define vmul(a, b)        _mm_mul_ps(a, b)
+#define vmadd(acc, a, b)  _mm_add_ps(acc, _mm_mul_ps(a, b))
+#elif defined(__ARM_NEON)
+#define ES_SIMD "neon"
+typedef float32x4_t esvec4;
+#define vload(p)          vld1q_f32(p)
+#define vstore(p, v)      vst1q_f32(p, v)
+#define vsplat(f)         vdupq_n_f32(f)
+#define vmul(a, b)        vmulq_f32(a, b)
+#define vmadd(acc, a, b)  vmlaq_f32(acc, a, b)
+#endif
+
+#ifdef ES_SIMD
+static inline esvec4
+combine4(const GLfloat w[4], esvec4 b0, esvec4 b1, esvec4 b2, esvec4 b3)
+{
+    esvec4 r = vmul(vsplat(w[0]), b0);
+    r = vmadd(r, vsplat(w[1]), b1);
+    r = vmadd(r, vsplat(w[2]), b2);
+    return vmadd(r, vsplat(w[3]), b3);
+}
+
+static inline esvec4
+combine3(const GLfloat w[3], esvec4 b0, esvec4 b1, esvec4 b2)
+{
+    esvec4 r = vmul(vsplat(w[0]), b0);
+    r = vmadd(r, vsplat(w[1]), b1);
+    return vmadd(r, vsplat(w[2]), b2);
+}
+#endif
+
+const char * ESUTIL_API
+esMatrixImplementation(void)
+{
+#ifdef ES_SIMD
+    return ES_SIMD;
+#else
+    return "scalar";
+#endif
+}
+
 void ESUTIL_API
 esScale(ESMatrix *result, GLfloat sx, GLfloat sy, GLfloat sz)
 {
@@ -74,57 +134,92 @@ esTranslate(ESMatrix *result, GLfloat tx, GLfloat ty, GLfloat tz)
     result->m[3][3] += (result->m[0][3] * tx + result->m[1][3] * ty + result->m[2][3] * tz);
 }
 
-void ESUTIL_API
-esRotate(ESMatrix *result, GLfloat angle, GLfloat x, GLfloat y, GLfloat z)
+// The 3x3 rotation about (x, y, z), false for a zero axis:
+static int
+rotation(GLfloat rot[3][3], GLfloat angle, GLfloat x, GLfloat y, GLfloat z)
 {
    GLfloat sinAngle, cosAngle;
    GLfloat mag = sqrtf(x * x + y * y + z * z);
-      
+   GLfloat xx, yy, zz, xy, yz, zx, xs, ys, zs;
+   GLfloat oneMinusCos;
+
+   if ( mag <= 0.0f )
+      return 0;
+
    sinAngle = sinf ( angle * PI / 180.0f );
    cosAngle = cosf ( angle * PI / 180.0f );
-   if ( mag > 0.0f )
-   {
-      GLfloat xx, yy, zz, xy, yz, zx, xs, ys, zs;
-      GLfloat oneMinusCos;
-      ESMatrix rotMat;
-   
-      x /= mag;
-      y /= mag;
-      z /= mag;
-
-      xx = x * x;
-      yy = y * y;
-      zz = z * z;
-      xy = x * y;
-      yz = y * z;
-      zx = z * x;
-      xs = x * sinAngle;
-      ys = y * sinAngle;
-      zs = z * sinAngle;
-      oneMinusCos = 1.0f - cosAngle;
-
-      rotMat.m[0][0] = (oneMinusCos * xx) + cosAngle;
-      rotMat.m[0][1] = (oneMinusCos * xy) - zs;
-      rotMat.m[0][2] = (oneMinusCos * zx) + ys;
-      rotMat.m[0][3] = 0.0F; 
-
-      rotMat.m[1][0] = (oneMinusCos * xy) + zs;
-      rotMat.m[1][1] = (oneMinusCos * yy) + cosAngle;
-      rotMat.m[1][2] = (oneMinusCos * yz) - xs;
-      rotMat.m[1][3] = 0.0F;
-
-      rotMat.m[2][0] = (oneMinusCos * zx) - ys;
-      rotMat.m[2][1] = (oneMinusCos * yz) + xs;
-      rotMat.m[2][2] = (oneMinusCos * zz) + cosAngle;
-      rotMat.m[2][3] = 0.0F; 
-
-      rotMat.m[3][0] = 0.0F;
-      rotMat.m[3][1] = 0.0F;
-      rotMat.m[3][2] = 0.0F;
-      rotMat.m[3][3] = 1.0F;
-
-      esMatrixMultiply( result, &rotMat, result );
-   }
+
+   x /= mag;
+   y /= mag;
+   z /= mag;
+
+   xx = x * x;
+   yy = y * y;
+   zz = z * z;
+   xy = x * y;
+   yz = y * z;
+   zx = z * x;
+   xs = x * sinAngle;
+   ys = y * sinAngle;
+   zs = z * sinAngle;
+   oneMinusCos = 1.0f - cosAngle;
+
+   rot[0][0] = (oneMinusCos * xx) + cosAngle;
+   rot[0][1] = (oneMinusCos * xy) - zs;
+   rot[0][2] = (oneMinusCos * zx) + ys;
+
+   rot[1][0] = (oneMinusCos * xy) + zs;
+   rot[1][1] = (oneMinusCos * yy) + cosAngle;
+   rot[1][2] = (oneMinusCos * yz) - xs;
+
+   rot[2][0] = (oneMinusCos * zx) - ys;
+   rot[2][1] = (oneMinusCos * yz) + xs;
+   rot[2][2] = (oneMinusCos * zz) + cosAngle;
+
+   return 1;
+}
+
+// The rest of the rotation matrix is identity, so only the first three
+// rows of result change, and only by the 3x3 part.
+
+void ESUTIL_API
+esRotateScalar(ESMatrix *result, GLfloat angle, GLfloat x, GLfloat y, GLfloat z)
+{
+   GLfloat rot[3][3];
+   GLfloat tmp[3][4];
+   int i, j;
+
+   if ( !rotation(rot, angle, x, y, z) )
+      return;
+
+   for (i = 0; i < 3; i++)
+      for (j = 0; j < 4; j++)
+         tmp[i][j] = rot[i][0] * result->m[0][j] +
+                     rot[i][1] * result->m[1][j] +
+                     rot[i][2] * result->m[2][j];
+   memcpy(result->m, tmp, sizeof(tmp));
+}
+
+void ESUTIL_API
+esRotate(ESMatrix *result, GLfloat angle, GLfloat x, GLfloat y, GLfloat z)
+{
+#ifdef ES_SIMD
+   GLfloat rot[3][3];
+   esvec4 r0, r1, r2;
+
+   if ( !rotation(rot, angle, x, y, z) )
+      return;
+
+   r0 = vload(result->m[0]);
+   r1 = vload(result->m[1]);
+   r2 = vload(result->m[2]);
+
+   vstore(result->m[0], combine3(rot[0], r0, r1, r2));
+   vstore(result->m[1], combine3(rot[1], r0, r1, r2));
+   vstore(result->m[2], combine3(rot[2], r0, r1, r2));
+#else
+   esRotateScalar(result, angle, x, y, z);
+#endif
 }
 
 void ESUTIL_API
@@ -192,7 +287,7 @@ esOrtho(ESMatrix *result, float left, float right, float bottom, float top, floa
 
 
 void ESUTIL_API
-esMatrixMultiply(ESMatrix *result, ESMatrix *srcA, ESMatrix *srcB)
+esMatrixMultiplyScalar(ESMatrix *result, ESMatrix *srcA, ESMatrix *srcB)
 {
     ESMatrix    tmp;
     int         i;
@@ -222,6 +317,37 @@ esMatrixMultiply(ESMatrix *result, ESMatrix *srcA, ESMatrix *srcB)
     memcpy(result, &tmp, sizeof(ESMatrix));
 }
 
+void ESUTIL_API
+esMatrixMultiply(ESMatrix *result, ESMatrix *srcA, ESMatrix *srcB)
+{
+#ifdef ES_SIMD
+    // All of srcB is loaded up front, and each row of srcA is read before
+    // the same row of result is written, so result may alias either:
+    esvec4 b0 = vload(srcB->m[0]);
+    esvec4 b1 = vload(srcB->m[1]);
+    esvec4 b2 = vload(srcB->m[2]);
+    esvec4 b3 = vload(srcB->m[3]);
+    int i;
+
+    for (i = 0; i < 4; i++)
+        vstore(result->m[i], combine4(srcA->m[i], b0, b1, b2, b3));
+#else
+    esMatrixMultiplyScalar(result, srcA, srcB);
+#endif
+}
+
+void ESUTIL_API
+esNormalMatrix(GLfloat normal[9], ESMatrix *modelview)
+{
+    // The upper 3x3, which is the normal matrix as long as modelview is
+    // only rotations, translations and uniform scales (the inverse
+    // transpose differs from it only by a factor then, and the shaders
+    // normalize):
+    memcpy(&normal[0], modelview->m[0], 3 * sizeof(GLfloat));
+    memcpy(&normal[3], modelview->m[1], 3 * sizeof(GLfloat));
+    memcpy(&normal[6], modelview->m[2], 3 * sizeof(GLfloat));
+}
+
 
 void ESUTIL_API
 esMatrixLoadIdentity(ESMatrix *result)
@@ -255,6 +255,11 @@ void ESUTIL_API esTranslate(ESMatrix *result, GLfloat tx, GLfloat ty, GLfloat tz
 //
 void ESUTIL_API esRotate(ESMatrix *result, GLfloat angle, GLfloat x, GLfloat y, GLfloat z);
 
+//
+/// \brief same as esRotate, without SIMD (for comparison)
+//
+void ESUTIL_API esRotateScalar(ESMatrix *result, GLfloat angle, GLfloat x, GLfloat y, GLfloat z);
+
 //
 // \brief multiply matrix specified by result with a perspective matrix and return new matrix in result
 /// \param result Specifies the input matrix.  new matrix is returned in result.
@@ -290,6 +295,23 @@ void ESUTIL_API esOrtho(ESMatrix *result, float left, float right, float bottom,
 //
 void ESUTIL_API esMatrixMultiply(ESMatrix *result, ESMatrix *srcA, ESMatrix *srcB);
 
+//
+/// \brief same as esMatrixMultiply, without SIMD (for comparison)
+//
+void ESUTIL_API esMatrixMultiplyScalar(ESMatrix *result, ESMatrix *srcA, ESMatrix *srcB);
+
+//
+/// \brief extract the 3x3 normal matrix (column major, for glUniformMatrix3fv)
+/// \param normal Returns the normal matrix
+/// \param modelview Rotation, translation and uniform scale only
+//
+void ESUTIL_API esNormalMatrix(GLfloat normal[9], ESMatrix *modelview);
+
+//
+/// \brief name of the matrix code in use: "sse", "neon" or "scalar"
+//
+const char * ESUTIL_API esMatrixImplementation(void);
+
 //
 //// \brief return an indentity matrix 
 //// \param result returns identity matrix
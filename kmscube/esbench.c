@@ -0,0 +1,160 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* Microbenchmark for the esTransform matrix code: the SIMD (sse or neon,
+ * whichever the build targets) paths against the plain C ones, on what
+ * the cube modes do per frame.
+ *
+ *   esbench [iterations]
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "esUtil.h"
+#include "transform.h"
+
+#define BATCH 256
+
+static ESMatrix src[BATCH], dst[BATCH], ref[BATCH];
+
+/* so the compiler can't drop the benchmarked code: */
+static volatile float sink;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void report(const char *name, unsigned ops, double secs)
+{
+	printf("%-28s %8.2f ns/op  %8.2f Mops/s\n", name,
+			secs * 1000000000.0 / ops, ops / secs / 1000000.0);
+}
+
+static float max_diff(const ESMatrix *a, const ESMatrix *b, unsigned count)
+{
+	float diff = 0.0f;
+
+	for (unsigned n = 0; n < count; n++)
+		for (unsigned i = 0; i < 4; i++)
+			for (unsigned j = 0; j < 4; j++)
+				diff = fmaxf(diff, fabsf(a[n].m[i][j] - b[n].m[i][j]));
+
+	return diff;
+}
+
+static void modelview(ESMatrix *m, float t)
+{
+	esMatrixLoadIdentity(m);
+	esTranslate(m, 0.0f, 0.0f, -8.0f);
+	esRotate(m, 45.0f + (0.25f * t), 1.0f, 0.0f, 0.0f);
+	esRotate(m, 45.0f - (0.5f * t), 0.0f, 1.0f, 0.0f);
+	esRotate(m, 10.0f + (0.15f * t), 0.0f, 0.0f, 1.0f);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned iterations = 1000000;
+	ESMatrix projection, m;
+	struct transform xf;
+	GLfloat normal[9];
+	double start;
+
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 0);
+	if (iterations < BATCH)
+		iterations = BATCH;
+
+	printf("matrix code: %s, %u iterations\n", esMatrixImplementation(), iterations);
+
+	esMatrixLoadIdentity(&projection);
+	esFrustum(&projection, -2.8f, +2.8f, -2.8f, +2.8f, 6.0f, 10.0f);
+
+	for (unsigned n = 0; n < BATCH; n++)
+		modelview(&src[n], n);
+
+	start = now();
+	for (unsigned i = 0; i < iterations; i++) {
+		esMatrixMultiplyScalar(&m, &src[i % BATCH], &projection);
+		sink += m.m[3][3];
+	}
+	report("multiply (scalar)", iterations, now() - start);
+
+	start = now();
+	for (unsigned i = 0; i < iterations; i++) {
+		esMatrixMultiply(&m, &src[i % BATCH], &projection);
+		sink += m.m[3][3];
+	}
+	report("multiply", iterations, now() - start);
+
+	for (unsigned n = 0; n < BATCH; n++) {
+		esMatrixMultiply(&dst[n], &src[n], &projection);
+		esMatrixMultiplyScalar(&ref[n], &src[n], &projection);
+	}
+
+	start = now();
+	for (unsigned i = 0; i < iterations; i++) {
+		esRotateScalar(&m, i * 0.01f, 0.0f, 1.0f, 0.0f);
+		sink += m.m[0][0];
+	}
+	report("rotate (scalar)", iterations, now() - start);
+
+	start = now();
+	for (unsigned i = 0; i < iterations; i++) {
+		esRotate(&m, i * 0.01f, 0.0f, 1.0f, 0.0f);
+		sink += m.m[0][0];
+	}
+	report("rotate", iterations, now() - start);
+
+	start = now();
+	for (unsigned i = 0; i < iterations; i++) {
+		esNormalMatrix(normal, &src[i % BATCH]);
+		sink += normal[8];
+	}
+	report("normal matrix", iterations, now() - start);
+
+	start = now();
+	for (unsigned i = 0; i < iterations; i++) {
+		modelview(&m, i);
+		esMatrixMultiply(&m, &m, &projection);
+		sink += m.m[3][3];
+	}
+	report("per frame cube transforms", iterations, now() - start);
+
+	transform_init(&xf, 2.8f, 1.0f);
+	start = now();
+	for (unsigned i = 0; i < iterations; i++) {
+		transform_update(&xf, i);
+		sink += xf.modelviewprojection.m[3][3];
+	}
+	report("  with transform_update()", iterations, now() - start);
+
+	/* the SIMD code must match the plain C code, within rounding: */
+	printf("max difference from scalar: %g\n", max_diff(dst, ref, BATCH));
+
+	return 0;
+}
@@ -0,0 +1,318 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "common.h"
+#include "evloop.h"
+
+int evloop_init(struct evloop *loop)
+{
+	for (unsigned i = 0; i < EVLOOP_MAX_SOURCES; i++)
+		loop->sources[i].fd = -1;
+
+	loop->deadline_fd = -1;
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		printf("epoll_create1 failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+void evloop_fini(struct evloop *loop)
+{
+	for (unsigned i = 0; i < EVLOOP_MAX_SOURCES; i++) {
+		struct evloop_source *src = &loop->sources[i];
+
+		/* plain fds are owned by whoever added them: */
+		if (src->fd >= 0 && src->type != EVLOOP_FD)
+			close(src->fd);
+		src->fd = -1;
+	}
+
+	close(loop->epoll_fd);
+	loop->epoll_fd = -1;
+	loop->deadline_fd = -1;
+}
+
+static int add_source(struct evloop *loop, int fd, enum evloop_type type,
+		evloop_func func, void *data)
+{
+	struct evloop_source *src = NULL;
+	struct epoll_event ev = { .events = EPOLLIN };
+
+	for (unsigned i = 0; i < EVLOOP_MAX_SOURCES && !src; i++)
+		if (loop->sources[i].fd < 0)
+			src = &loop->sources[i];
+
+	if (!src) {
+		printf("too many event sources\n");
+		return -1;
+	}
+
+	ev.data.ptr = src;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return -1;
+
+	src->fd = fd;
+	src->type = type;
+	src->func = func;
+	src->data = data;
+
+	return fd;
+}
+
+int evloop_add_fd(struct evloop *loop, int fd, evloop_func func, void *data)
+{
+	return add_source(loop, fd, EVLOOP_FD, func, data);
+}
+
+void evloop_remove_fd(struct evloop *loop, int fd)
+{
+	for (unsigned i = 0; i < EVLOOP_MAX_SOURCES; i++) {
+		struct evloop_source *src = &loop->sources[i];
+
+		if (src->fd == fd) {
+			epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+			/* like in evloop_fini(), plain fds stay open: */
+			if (src->type != EVLOOP_FD)
+				close(fd);
+			src->fd = -1;
+			return;
+		}
+	}
+}
+
+int evloop_add_timer(struct evloop *loop, evloop_func func, void *data)
+{
+	int fd, ret;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (fd < 0) {
+		printf("timerfd_create failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	ret = add_source(loop, fd, EVLOOP_TIMER, func, data);
+	if (ret < 0)
+		close(fd);
+
+	return ret;
+}
+
+static void ns_to_timespec(int64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / NSEC_PER_SEC;
+	ts->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+/* Periodic timer, first expiring one interval from now, 0 disarms: */
+int evloop_timer_set(int fd, int64_t interval_ns)
+{
+	struct itimerspec its;
+
+	ns_to_timespec(interval_ns, &its.it_value);
+	ns_to_timespec(interval_ns, &its.it_interval);
+
+	return timerfd_settime(fd, 0, &its, NULL);
+}
+
+/* One-shot timer, expiring at the given get_time_ns() time: */
+int evloop_timer_set_abs(int fd, int64_t time_ns)
+{
+	struct itimerspec its = {};
+
+	/* a zero it_value would disarm the timer instead: */
+	ns_to_timespec(MAX2(time_ns, 1), &its.it_value);
+
+	return timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+int evloop_block_signals(void)
+{
+	sigset_t mask;
+	int ret;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+
+	ret = pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	if (ret) {
+		printf("failed to block signals: %s\n", strerror(ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int add_signalfd(struct evloop *loop, const sigset_t *mask,
+		evloop_func func, void *data)
+{
+	int fd, ret;
+
+	fd = signalfd(-1, mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (fd < 0) {
+		printf("signalfd failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	ret = add_source(loop, fd, EVLOOP_SIGNAL, func, data);
+	if (ret < 0)
+		close(fd);
+
+	return ret;
+}
+
+int evloop_add_signals(struct evloop *loop, evloop_func func, void *data)
+{
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+
+	return add_signalfd(loop, &mask, func, data);
+}
+
+int evloop_add_signal(struct evloop *loop, int signo, evloop_func func, void *data)
+{
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, signo);
+
+	return add_signalfd(loop, &mask, func, data);
+}
+
+static int user_interrupt(struct evloop *loop, int fd, void *data)
+{
+	(void)loop; (void)fd; (void)data;
+	printf("user interrupted!\n");
+	return 1;
+}
+
+static int signal_interrupt(struct evloop *loop, int fd, void *data)
+{
+	(void)loop; (void)fd; (void)data;
+	printf("interrupted by signal\n");
+	return 1;
+}
+
+int evloop_add_interrupts(struct evloop *loop)
+{
+	/* stdin may well be something epoll can't watch (ie. /dev/null
+	 * when started from a script), that is not an error:
+	 */
+	evloop_add_fd(loop, STDIN_FILENO, user_interrupt, NULL);
+
+	if (evloop_add_signals(loop, signal_interrupt, NULL) < 0)
+		return -1;
+
+	return 0;
+}
+
+int evloop_dispatch(struct evloop *loop, int timeout_ms)
+{
+	struct epoll_event events[EVLOOP_MAX_SOURCES];
+	int n, ret = 0;
+
+	n = epoll_wait(loop->epoll_fd, events, ARRAY_SIZE(events), timeout_ms);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+		printf("epoll_wait err: %s\n", strerror(errno));
+		return -1;
+	}
+
+	for (int i = 0; i < n && !ret; i++) {
+		struct evloop_source *src = events[i].data.ptr;
+		union {
+			uint64_t expirations;
+			struct signalfd_siginfo info;
+		} u;
+
+		/* removed by an earlier callback in this batch: */
+		if (src->fd < 0)
+			continue;
+
+		/* timers and signals need to be consumed, or they stay
+		 * readable:
+		 */
+		if (src->type == EVLOOP_TIMER &&
+		    read(src->fd, &u.expirations, sizeof(u.expirations)) < 0)
+			continue;
+		if (src->type == EVLOOP_SIGNAL &&
+		    read(src->fd, &u.info, sizeof(u.info)) < 0)
+			continue;
+
+		ret = src->func(loop, src->fd, src->data);
+	}
+
+	return ret;
+}
+
+static int deadline_passed(struct evloop *loop, int fd, void *data)
+{
+	(void)fd; (void)data;
+	loop->deadline_passed = true;
+	return 0;
+}
+
+int evloop_dispatch_until(struct evloop *loop, int64_t time_ns)
+{
+	int ret;
+
+	if (time_ns <= get_time_ns())
+		return 0;
+
+	if (loop->deadline_fd < 0) {
+		loop->deadline_fd = evloop_add_timer(loop, deadline_passed, NULL);
+		if (loop->deadline_fd < 0)
+			return -1;
+	}
+
+	/* (re)arming the timer also drops an expiration not read yet: */
+	loop->deadline_passed = false;
+	if (evloop_timer_set_abs(loop->deadline_fd, time_ns) < 0) {
+		printf("failed to arm timer: %s\n", strerror(errno));
+		return -1;
+	}
+
+	while (!loop->deadline_passed) {
+		ret = evloop_dispatch(loop, -1);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
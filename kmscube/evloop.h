@@ -0,0 +1,108 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _EVLOOP_H
+#define _EVLOOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Minimal epoll based event loop, used by the legacy and atomic
+ * backends to wait for flips, fences and input.  The set of fds is
+ * registered once, so waiting for the next event is a single
+ * epoll_wait() no matter how many fds are watched.
+ *
+ * Besides plain fds (readable -> callback) there are timers (timerfd,
+ * on CLOCK_MONOTONIC like get_time_ns()) and SIGINT/SIGTERM delivered
+ * through a signalfd, for a clean shutdown.
+ */
+
+#define EVLOOP_MAX_SOURCES 16
+
+struct evloop;
+
+/* Return 0 to keep going, > 0 to make evloop_dispatch() return that
+ * (ie. to quit), < 0 on error.
+ */
+typedef int (*evloop_func)(struct evloop *loop, int fd, void *data);
+
+enum evloop_type {
+	EVLOOP_FD,
+	EVLOOP_TIMER,
+	EVLOOP_SIGNAL,
+};
+
+struct evloop {
+	int epoll_fd;
+	int deadline_fd;           /* for evloop_dispatch_until() */
+	bool deadline_passed;
+	struct evloop_source {
+		int fd;          /* -1 for an unused slot */
+		enum evloop_type type;
+		evloop_func func;
+		void *data;
+	} sources[EVLOOP_MAX_SOURCES];
+};
+
+int evloop_init(struct evloop *loop);
+void evloop_fini(struct evloop *loop);
+
+/* Plain fds stay owned by the caller, who closes them after removing
+ * them.  The timer and signal fds belong to the loop, and are closed
+ * when removed, or by evloop_fini():
+ */
+int evloop_add_fd(struct evloop *loop, int fd, evloop_func func, void *data);
+void evloop_remove_fd(struct evloop *loop, int fd);
+
+/* Timers are created disarmed, and return the timerfd to arm them: */
+int evloop_add_timer(struct evloop *loop, evloop_func func, void *data);
+int evloop_timer_set(int fd, int64_t interval_ns);
+int evloop_timer_set_abs(int fd, int64_t time_ns);
+
+/* Block SIGINT, SIGTERM and SIGUSR1 for the calling thread and the
+ * threads it creates after.  Call it from main() before any thread
+ * exists (gstreamer, capture, ...), or the kernel picks one of those to
+ * deliver the signal to, and the default action kills the process
+ * before the signalfd ever sees it.
+ */
+int evloop_block_signals(void);
+
+/* Delivers SIGINT and SIGTERM to func, which only works once they are
+ * blocked, see evloop_block_signals():
+ */
+int evloop_add_signals(struct evloop *loop, evloop_func func, void *data);
+
+/* Same, for any other (blocked) signal: */
+int evloop_add_signal(struct evloop *loop, int signo, evloop_func func, void *data);
+
+/* Quit (dispatch returns 1) on input on stdin, or on a signal: */
+int evloop_add_interrupts(struct evloop *loop);
+
+/* Wait up to timeout_ms (-1 for forever) and dispatch what is ready: */
+int evloop_dispatch(struct evloop *loop, int timeout_ms);
+
+/* Dispatch until the given get_time_ns() time, with timerfd precision
+ * (rather than the milliseconds of a timeout).  Returns early if a
+ * callback returns non-zero.
+ */
+int evloop_dispatch_until(struct evloop *loop, int64_t time_ns);
+
+#endif /* _EVLOOP_H */
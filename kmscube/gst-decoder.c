@@ -39,20 +39,49 @@
 #include <gst/allocators/gstdmabuf.h>
 #include <gst/app/gstappsink.h>
 #include <gst/video/gstvideometa.h>
+#include <gst/video/gstvideopool.h>
 
 GST_DEBUG_CATEGORY_EXTERN(kmscube_debug);
 #define GST_CAT_DEFAULT kmscube_debug
 
 #define MAX_NUM_PLANES 3
 
+/* Decoders recycle a small pool of buffers, so importing each one once
+ * and keeping the EGLImage and texture around saves re-validating (and
+ * re-mapping) the same dmabuf every frame:
+ */
+#define MAX_CACHED_IMAGES 32
+
+/* Decoded frames queued ahead of the render loop: */
+#define VIDEO_QUEUE_SIZE 4
+
 inline static const char *
 yesno(int yes)
 {
 	return yes ? "yes" : "no";
 }
 
+/* An imported frame.  For dmabuf memory it is attached (as qdata) to
+ * the GstMemory it was imported from, which holds a reference until the
+ * memory is freed, ie. when the pool goes away.  The GL objects can only
+ * be destroyed on the render thread, so that only marks it dead, and
+ * the next video_frame() does the cleanup.
+ */
+struct cached_image {
+	EGLImage            image;
+	GLuint              tex;
+	int                 refcnt;       /* the cache, and the memory */
+	bool                dead;         /* memory was freed */
+	bool                evicted;      /* GL objects are gone */
+};
+
 struct decoder {
+	/* each decoder runs its own context, so the next one in a playlist
+	 * can preroll while the current one still plays:
+	 */
+	GMainContext       *context;
 	GMainLoop          *loop;
+	GSource            *bus_watch;
 	GstElement         *pipeline;
 	GstElement         *sink;
 	pthread_t           gst_thread;
@@ -64,10 +93,187 @@ struct decoder {
 	const struct egl   *egl;
 	unsigned            frame;
 
-	EGLImage            last_frame;
+	/* imported frames, most recently used at the end: */
+	struct cached_image *cache[MAX_CACHED_IMAGES];
+	unsigned            num_cached;
+	/* for a frame not in dmabuf memory, which is imported every time: */
+	struct cached_image *transient;
+	bool                flush_cache;  /* caps changed */
+
+	/* the frame currently shown: */
 	GstSample          *last_samp;
+	GLuint              last_tex;
+
+	/* Frames queued by the gst thread, which blocks while it is full.
+	 * The render loop picks the frame due at the time it will be on
+	 * screen, from the pts (as running time) relative to the first frame:
+	 */
+	pthread_mutex_t     lock;
+	pthread_cond_t      cond;
+	GstSample          *queue[VIDEO_QUEUE_SIZE];
+	unsigned            queue_head, queue_len;
+	bool                eos, flushing;
+	GstClockTime        base_pts;     /* in running time */
+	int64_t             base_time;
+	unsigned            dropped, repeated;
+	unsigned            import_failed;
+
+	/* loop with segment seeks, rather than ending at eos: */
+	bool                loop_segments;
+	bool                looping;
+
+	/* offered to upstream in the allocation query: */
+	GstBufferPool      *pool;
 };
 
+static GQuark image_quark;
+
+/* A buffer pool of linear GBM buffers, wrapped as dmabuf memory, which
+ * software decoders can decode straight into.  The gpu then imports
+ * the frames as is (and video_frame() caches them), instead of them
+ * being copied into a new bo every frame by buf_to_fd().
+ */
+typedef struct {
+	GstBufferPool       parent;
+	const struct gbm   *gbm;
+	GstAllocator       *allocator;
+	GstVideoInfo        info;
+	gboolean            add_meta;
+} GbmPool;
+
+typedef struct {
+	GstBufferPoolClass  parent_class;
+} GbmPoolClass;
+
+GType gbm_pool_get_type(void);
+G_DEFINE_TYPE(GbmPool, gbm_pool, GST_TYPE_BUFFER_POOL)
+
+/* The bo is only a way to get at linear, gpu importable memory, so it
+ * is allocated as R8 rows of this size:
+ */
+#define GBM_POOL_ROW 4096
+
+static const gchar **
+gbm_pool_get_options(GstBufferPool *bpool)
+{
+	static const gchar *options[] = { GST_BUFFER_POOL_OPTION_VIDEO_META, NULL };
+
+	(void)bpool;
+
+	return options;
+}
+
+static gboolean
+gbm_pool_set_config(GstBufferPool *bpool, GstStructure *config)
+{
+	GbmPool *pool = (GbmPool *)bpool;
+	GstCaps *caps;
+	guint size, min, max;
+
+	if (!gst_buffer_pool_config_get_params(config, &caps, &size, &min, &max) || !caps)
+		return FALSE;
+
+	if (!gst_video_info_from_caps(&pool->info, caps))
+		return FALSE;
+
+	pool->add_meta = gst_buffer_pool_config_has_option(config,
+			GST_BUFFER_POOL_OPTION_VIDEO_META);
+
+	return GST_BUFFER_POOL_CLASS(gbm_pool_parent_class)->set_config(bpool, config);
+}
+
+static GstFlowReturn
+gbm_pool_alloc_buffer(GstBufferPool *bpool, GstBuffer **buffer,
+		GstBufferPoolAcquireParams *params)
+{
+	GbmPool *pool = (GbmPool *)bpool;
+	GstVideoInfo *info = &pool->info;
+	gsize size = GST_VIDEO_INFO_SIZE(info);
+	struct gbm_bo *bo;
+	GstMemory *mem;
+	GstBuffer *buf;
+	gsize bo_size;
+	int fd;
+
+	(void)params;
+
+	/* NOTE: do not actually use GBM_BO_USE_WRITE since that gets us a dumb buffer: */
+	bo = gbm_bo_create(pool->gbm->dev, GBM_POOL_ROW,
+			(size + GBM_POOL_ROW - 1) / GBM_POOL_ROW,
+			GBM_FORMAT_R8, GBM_BO_USE_LINEAR);
+	if (!bo) {
+		GST_ERROR("failed to allocate %" G_GSIZE_FORMAT " byte gbm buffer", size);
+		return GST_FLOW_ERROR;
+	}
+
+	bo_size = (gsize)gbm_bo_get_stride(bo) * gbm_bo_get_height(bo);
+	fd = gbm_bo_get_fd(bo);
+
+	/* the dmabuf keeps the memory around, no need for the bo: */
+	gbm_bo_destroy(bo);
+
+	if (fd < 0) {
+		GST_ERROR("failed to export gbm buffer");
+		return GST_FLOW_ERROR;
+	}
+
+	/* takes ownership of the fd: */
+	mem = gst_dmabuf_allocator_alloc(pool->allocator, fd, bo_size);
+	gst_memory_resize(mem, 0, size);
+
+	buf = gst_buffer_new();
+	gst_buffer_append_memory(buf, mem);
+
+	if (pool->add_meta) {
+		gst_buffer_add_video_meta_full(buf, GST_VIDEO_FRAME_FLAG_NONE,
+				GST_VIDEO_INFO_FORMAT(info),
+				GST_VIDEO_INFO_WIDTH(info), GST_VIDEO_INFO_HEIGHT(info),
+				GST_VIDEO_INFO_N_PLANES(info), info->offset, info->stride);
+	}
+
+	*buffer = buf;
+
+	return GST_FLOW_OK;
+}
+
+static void
+gbm_pool_finalize(GObject *object)
+{
+	GbmPool *pool = (GbmPool *)object;
+
+	gst_object_unref(pool->allocator);
+
+	G_OBJECT_CLASS(gbm_pool_parent_class)->finalize(object);
+}
+
+static void
+gbm_pool_class_init(GbmPoolClass *klass)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+	GstBufferPoolClass *pool_class = GST_BUFFER_POOL_CLASS(klass);
+
+	gobject_class->finalize = gbm_pool_finalize;
+	pool_class->get_options = gbm_pool_get_options;
+	pool_class->set_config = gbm_pool_set_config;
+	pool_class->alloc_buffer = gbm_pool_alloc_buffer;
+}
+
+static void
+gbm_pool_init(GbmPool *pool)
+{
+	pool->allocator = gst_dmabuf_allocator_new();
+}
+
+static GstBufferPool *
+gbm_pool_new(const struct gbm *gbm)
+{
+	GbmPool *pool = g_object_new(gbm_pool_get_type(), NULL);
+
+	pool->gbm = gbm;
+
+	return GST_BUFFER_POOL(pool);
+}
+
 static GstPadProbeReturn
 pad_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
 {
@@ -92,6 +298,11 @@ pad_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
 		return GST_PAD_PROBE_OK;
 	}
 
+	/* the pool gets reconfigured, and the sizes/strides baked into
+	 * the imported images may no longer match:
+	 */
+	__atomic_store_n(&dec->flush_cache, true, __ATOMIC_RELEASE);
+
 	switch (GST_VIDEO_INFO_FORMAT(&(dec->info))) {
 	case GST_VIDEO_FORMAT_I420:
 		dec->format = DRM_FORMAT_YUV420;
@@ -190,6 +401,26 @@ bus_watch_cb(GstBus *bus, GstMessage *msg, gpointer user_data)
 		gst_element_set_state(GST_ELEMENT(dec->pipeline), requested_state);
 		break;
 	}
+	case GST_MESSAGE_ASYNC_DONE: {
+		/* prerolled, start the first segment.  Segment seeks end in
+		 * SEGMENT_DONE instead of eos, and the next one continues
+		 * without a flush, so there is no gap at the loop point:
+		 */
+		if (!dec->loop_segments || dec->looping)
+			break;
+		dec->looping = true;
+		if (!gst_element_seek(dec->pipeline, 1.0, GST_FORMAT_TIME,
+				GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_SEGMENT,
+				GST_SEEK_TYPE_SET, 0, GST_SEEK_TYPE_NONE, -1))
+			printf("segment seek failed, not looping\n");
+		break;
+	}
+	case GST_MESSAGE_SEGMENT_DONE: {
+		gst_element_seek(dec->pipeline, 1.0, GST_FORMAT_TIME,
+				GST_SEEK_FLAG_SEGMENT,
+				GST_SEEK_TYPE_SET, 0, GST_SEEK_TYPE_NONE, -1);
+		break;
+	}
 	case GST_MESSAGE_LATENCY: {
 		printf("redistributing latency\n");
 		gst_bin_recalculate_latency(GST_BIN(dec->pipeline));
@@ -225,9 +456,15 @@ bus_watch_cb(GstBus *bus, GstMessage *msg, gpointer user_data)
 
 		if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
 			GST_DEBUG_BIN_TO_DOT_FILE_WITH_TS(GST_BIN(dec->pipeline), GST_DEBUG_GRAPH_SHOW_ALL, "error");
-		}
 
-		// TODO: stop mainloop in case of an error
+			/* no more frames are coming, so end the stream, or
+			 * video_frame() waits for the first one forever:
+			 */
+			pthread_mutex_lock(&dec->lock);
+			dec->eos = true;
+			pthread_cond_broadcast(&dec->cond);
+			pthread_mutex_unlock(&dec->lock);
+		}
 
 		break;
 	}
@@ -238,9 +475,45 @@ bus_watch_cb(GstBus *bus, GstMessage *msg, gpointer user_data)
 	return TRUE;
 }
 
+/* Offer a pool of gbm buffers, see GbmPool.  Upstream (hardware)
+ * decoders with their own dmabuf pool are free to ignore it:
+ */
+static void
+propose_pool(struct decoder *dec, GstQuery *query)
+{
+	GstStructure *config;
+	GstVideoInfo info;
+	GstCaps *caps;
+	gboolean need_pool;
+
+	gst_query_parse_allocation(query, &caps, &need_pool);
+	if (!caps || !gst_video_info_from_caps(&info, caps))
+		return;
+
+	/* caps changed, and the old pool goes away with its buffers: */
+	if (dec->pool)
+		gst_object_unref(dec->pool);
+	dec->pool = gbm_pool_new(dec->gbm);
+
+	config = gst_buffer_pool_get_config(dec->pool);
+	/* enough for the queue, the frame shown and one being decoded: */
+	gst_buffer_pool_config_set_params(config, caps, GST_VIDEO_INFO_SIZE(&info),
+			VIDEO_QUEUE_SIZE + 2, 0);
+	gst_buffer_pool_config_add_option(config, GST_BUFFER_POOL_OPTION_VIDEO_META);
+	if (!gst_buffer_pool_set_config(dec->pool, config)) {
+		GST_WARNING("gbm pool rejected the config");
+		gst_object_unref(dec->pool);
+		dec->pool = NULL;
+		return;
+	}
+
+	gst_query_add_allocation_pool(query, dec->pool, GST_VIDEO_INFO_SIZE(&info),
+			VIDEO_QUEUE_SIZE + 2, 0);
+}
+
 static GstPadProbeReturn
 appsink_query_cb(GstPad *pad G_GNUC_UNUSED, GstPadProbeInfo *info,
-	gpointer user_data G_GNUC_UNUSED)
+	gpointer user_data)
 {
 	GstQuery *query = info->data;
 
@@ -248,12 +521,55 @@ appsink_query_cb(GstPad *pad G_GNUC_UNUSED, GstPadProbeInfo *info,
 	  return GST_PAD_PROBE_OK;
 
 	gst_query_add_allocation_meta(query, GST_VIDEO_META_API_TYPE, NULL);
+	propose_pool(user_data, query);
 
 	return GST_PAD_PROBE_HANDLED;
 }
 
+static GstFlowReturn
+new_sample_cb(GstAppSink *sink, gpointer user_data)
+{
+	struct decoder *dec = user_data;
+	GstSample *samp;
+
+	samp = gst_app_sink_pull_sample(sink);
+	if (!samp)
+		return GST_FLOW_FLUSHING;
+
+	pthread_mutex_lock(&dec->lock);
+	while (dec->queue_len == VIDEO_QUEUE_SIZE && !dec->flushing)
+		pthread_cond_wait(&dec->cond, &dec->lock);
+
+	if (dec->flushing) {
+		pthread_mutex_unlock(&dec->lock);
+		gst_sample_unref(samp);
+		return GST_FLOW_FLUSHING;
+	}
+
+	dec->queue[(dec->queue_head + dec->queue_len++) % VIDEO_QUEUE_SIZE] = samp;
+	pthread_cond_broadcast(&dec->cond);
+	pthread_mutex_unlock(&dec->lock);
+
+	return GST_FLOW_OK;
+}
+
+static void
+eos_cb(GstAppSink *sink, gpointer user_data)
+{
+	struct decoder *dec = user_data;
+
+	(void)sink;
+
+	pthread_mutex_lock(&dec->lock);
+	dec->eos = true;
+	pthread_cond_broadcast(&dec->cond);
+	pthread_mutex_unlock(&dec->lock);
+}
+
+/* The pipeline is only prerolled (to PAUSED), video_play() starts it: */
 struct decoder *
-video_init(const struct egl *egl, const struct gbm *gbm, const char *filename)
+video_init(const struct egl *egl, const struct gbm *gbm, const char *filename,
+		bool loop)
 {
 	struct decoder *dec;
 	GstElement *src, *decodebin;
@@ -261,13 +577,22 @@ video_init(const struct egl *egl, const struct gbm *gbm, const char *filename)
 	GstBus *bus;
 
 	if (egl_check(egl, eglCreateImageKHR) ||
-	    egl_check(egl, eglDestroyImageKHR))
+	    egl_check(egl, eglDestroyImageKHR) ||
+	    egl_check(egl, glEGLImageTargetTexture2DOES))
 		return NULL;
 
+	if (!image_quark)
+		image_quark = g_quark_from_static_string("kmscube-image");
+
 	dec = calloc(1, sizeof(*dec));
-	dec->loop = g_main_loop_new(NULL, FALSE);
+	dec->context = g_main_context_new();
+	dec->loop = g_main_loop_new(dec->context, FALSE);
+	dec->loop_segments = loop;
 	dec->gbm = gbm;
 	dec->egl = egl;
+	dec->base_pts = GST_CLOCK_TIME_NONE;
+	pthread_mutex_init(&dec->lock, NULL);
+	pthread_cond_init(&dec->cond, NULL);
 
 	/* Setup pipeline: */
 	static const char *pipeline =
@@ -284,11 +609,12 @@ video_init(const struct egl *egl, const struct gbm *gbm, const char *filename)
 	/* Implement the allocation query using a pad probe. This probe will
 	 * adverstize support for GstVideoMeta, which avoid hardware accelerated
 	 * decoder that produce special strides and offsets from having to
-	 * copy the buffers.
+	 * copy the buffers, and propose a pool of gbm buffers for software
+	 * decoders.
 	 */
 	pad = gst_element_get_static_pad(dec->sink, "sink");
 	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM,
-		appsink_query_cb, NULL, NULL);
+		appsink_query_cb, dec, NULL);
 	gst_object_unref(pad);
 
 	src = gst_bin_get_by_name(GST_BIN(dec->pipeline), "src");
@@ -300,10 +626,17 @@ video_init(const struct egl *egl, const struct gbm *gbm, const char *filename)
 	gst_base_sink_set_qos_enabled(GST_BASE_SINK(dec->sink), TRUE);
 
 	/* if we don't limit max-buffers then we can let the decoder outrun
-	 * vsync and quickly chew up 100's of MB of buffers:
+	 * vsync and quickly chew up 100's of MB of buffers (the queue in
+	 * new_sample_cb() bounds it from there on):
 	 */
 	g_object_set(G_OBJECT(dec->sink), "max-buffers", 2, NULL);
 
+	static GstAppSinkCallbacks callbacks = {
+		.eos = eos_cb,
+		.new_sample = new_sample_cb,
+	};
+	gst_app_sink_set_callbacks(GST_APP_SINK(dec->sink), &callbacks, dec, NULL);
+
 	gst_pad_add_probe(gst_element_get_static_pad(dec->sink, "sink"),
 			GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
 			pad_probe, dec, NULL);
@@ -315,11 +648,12 @@ video_init(const struct egl *egl, const struct gbm *gbm, const char *filename)
 	/* add bus to be able to receive error message, handle latency
 	 * requests, produce pipeline dumps, etc. */
 	bus = gst_pipeline_get_bus(GST_PIPELINE(dec->pipeline));
-	gst_bus_add_watch(bus, bus_watch_cb, dec);
+	dec->bus_watch = gst_bus_create_watch(bus);
+	g_source_set_callback(dec->bus_watch, (GSourceFunc)bus_watch_cb, dec, NULL);
+	g_source_attach(dec->bus_watch, dec->context);
 	gst_object_unref(GST_OBJECT(bus));
 
-	/* let 'er rip! */
-	gst_element_set_state(dec->pipeline, GST_STATE_PLAYING);
+	gst_element_set_state(dec->pipeline, GST_STATE_PAUSED);
 
 	pthread_create(&dec->gst_thread, NULL, gst_thread_func, dec);
 
@@ -327,11 +661,65 @@ video_init(const struct egl *egl, const struct gbm *gbm, const char *filename)
 }
 
 static void
-set_last_frame(struct decoder *dec, EGLImage frame, GstSample *samp)
+unref_image(struct cached_image *img)
+{
+	if (__atomic_sub_fetch(&img->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+		free(img);
+}
+
+/* qdata destroy notify, called from whichever thread frees the memory: */
+static void
+image_memory_freed(gpointer data)
+{
+	struct cached_image *img = data;
+
+	__atomic_store_n(&img->dead, true, __ATOMIC_RELEASE);
+	unref_image(img);
+}
+
+/* Must be called on the render thread: */
+static void
+evict_image(struct decoder *dec, struct cached_image *img)
+{
+	glDeleteTextures(1, &img->tex);
+	dec->egl->eglDestroyImageKHR(dec->egl->display, img->image);
+	img->evicted = true;
+	unref_image(img);
+}
+
+static void
+remove_cached(struct decoder *dec, unsigned n)
 {
-	if (dec->last_frame)
-		dec->egl->eglDestroyImageKHR(dec->egl->display, dec->last_frame);
-	dec->last_frame = frame;
+	evict_image(dec, dec->cache[n]);
+	memmove(&dec->cache[n], &dec->cache[n + 1],
+			(dec->num_cached - n - 1) * sizeof(dec->cache[0]));
+	dec->num_cached--;
+}
+
+/* Evict the images whose memory was freed, or with all (on a caps
+ * change) every image but the one on screen, which goes once it is
+ * replaced and its memory freed:
+ */
+static void
+flush_cache(struct decoder *dec, bool all)
+{
+	for (unsigned n = 0; n < dec->num_cached; ) {
+		struct cached_image *img = dec->cache[n];
+
+		if ((all && img->tex != dec->last_tex) ||
+		    __atomic_load_n(&img->dead, __ATOMIC_ACQUIRE))
+			remove_cached(dec, n);
+		else
+			n++;
+	}
+}
+
+static void
+set_last_frame(struct decoder *dec, struct cached_image *transient, GstSample *samp)
+{
+	if (dec->transient)
+		evict_image(dec, dec->transient);
+	dec->transient = transient;
 	if (dec->last_samp)
 		gst_sample_unref(dec->last_samp);
 	dec->last_samp = samp;
@@ -494,49 +882,295 @@ buffer_to_image(struct decoder *dec, GstBuffer *buf)
 				EGL_LINUX_DMA_BUF_EXT, NULL, attr);
 	}
 
-	/* Cleanup */
-	for (unsigned i = 0; i < nplanes; i++)
-		close(planes[i].fd);
+	/* Cleanup, all planes share the one fd: */
+	close(dmabuf_fd);
 
 	return image;
 }
 
-EGLImage
-video_frame(struct decoder *dec)
+static struct cached_image *
+import_buffer(struct decoder *dec, GstBuffer *buf)
+{
+	struct cached_image *img;
+	EGLImage image;
+
+	image = buffer_to_image(dec, buf);
+	if (image == EGL_NO_IMAGE_KHR)
+		return NULL;
+
+	img = calloc(1, sizeof(*img));
+	img->image = image;
+	img->refcnt = 1;
+
+	glGenTextures(1, &img->tex);
+	glBindTexture(GL_TEXTURE_EXTERNAL_OES, img->tex);
+	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	dec->egl->glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, image);
+
+	return img;
+}
+
+static struct cached_image *
+lookup_image(struct decoder *dec, GstMemory *mem)
+{
+	struct cached_image *img;
+
+	img = gst_mini_object_get_qdata(GST_MINI_OBJECT(mem), image_quark);
+	if (!img || img->evicted)
+		return NULL;
+
+	/* move to the end, to keep the cache in lru order: */
+	for (unsigned n = 0; n < dec->num_cached; n++) {
+		if (dec->cache[n] == img) {
+			memmove(&dec->cache[n], &dec->cache[n + 1],
+					(dec->num_cached - n - 1) * sizeof(dec->cache[0]));
+			dec->cache[dec->num_cached - 1] = img;
+			break;
+		}
+	}
+
+	return img;
+}
+
+static void
+add_image(struct decoder *dec, GstMemory *mem, struct cached_image *img)
+{
+	if (dec->num_cached == MAX_CACHED_IMAGES)
+		remove_cached(dec, 0);
+
+	dec->cache[dec->num_cached++] = img;
+
+	/* this replaces (and unrefs) an evicted image of this memory: */
+	img->refcnt++;
+	gst_mini_object_set_qdata(GST_MINI_OBJECT(mem), image_quark, img,
+			image_memory_freed);
+}
+
+/* Is the frame due on screen at time_ns (on the render loop's clock)?
+ * It is from the middle of the previous frame's interval on, which
+ * picks the frame with the pts closest to the display time:
+ */
+static bool
+frame_due(struct decoder *dec, GstSample *samp, int64_t time_ns)
+{
+	GstBuffer *buf = gst_sample_get_buffer(samp);
+	const GstSegment *segment = gst_sample_get_segment(samp);
+	GstClockTime pts = GST_BUFFER_PTS(buf);
+	GstClockTime duration = GST_BUFFER_DURATION(buf);
+
+	/* running time keeps going up across (segment seek) loops: */
+	if (segment && GST_CLOCK_TIME_IS_VALID(pts))
+		pts = gst_segment_to_running_time(segment, GST_FORMAT_TIME, pts);
+
+	if (!GST_CLOCK_TIME_IS_VALID(pts))
+		return true;
+
+	if (!GST_CLOCK_TIME_IS_VALID(dec->base_pts)) {
+		dec->base_pts = pts;
+		dec->base_time = time_ns;
+		return true;
+	}
+
+	if (!GST_CLOCK_TIME_IS_VALID(duration))
+		duration = 0;
+
+	return (int64_t)(pts - dec->base_pts) <=
+			time_ns - dec->base_time + (int64_t)duration / 2;
+}
+
+/* Pop the latest due frame, dropping the ones it overtakes.  Only waits
+ * for the decoder when there is no frame at all to show yet, and wait
+ * is set.
+ */
+static GstSample *
+next_sample(struct decoder *dec, int64_t time_ns, bool wait, bool *eos)
 {
+	GstSample *samp = NULL;
+
+	pthread_mutex_lock(&dec->lock);
+
+	while (wait && !dec->last_samp && !dec->queue_len && !dec->eos)
+		pthread_cond_wait(&dec->cond, &dec->lock);
+
+	while (dec->queue_len) {
+		GstSample *next = dec->queue[dec->queue_head];
+		/* called for the first frame too, which anchors base_pts: */
+		bool due = frame_due(dec, next, time_ns);
+
+		if ((dec->last_samp || samp) && !due)
+			break;
+
+		if (samp) {
+			gst_sample_unref(samp);
+			dec->dropped++;
+		}
+		samp = next;
+
+		dec->queue_head = (dec->queue_head + 1) % VIDEO_QUEUE_SIZE;
+		dec->queue_len--;
+	}
+
+	*eos = dec->eos && !dec->queue_len;
+
+	pthread_cond_broadcast(&dec->cond);
+	pthread_mutex_unlock(&dec->lock);
+
+	return samp;
+}
+
+/* Returns the (GL_TEXTURE_EXTERNAL_OES) texture with the frame to show
+ * at time_ns, which is the same as last time if the next one is not due
+ * yet (or not decoded in time).  Before the first frame this waits for
+ * it, or without wait returns 0 until it is there.  At the end of the
+ * stream it sets eos and returns 0.  The texture stays valid until the
+ * next call.
+ */
+GLuint
+video_frame(struct decoder *dec, int64_t time_ns, bool wait, bool *eos)
+{
+	struct cached_image *img, *transient = NULL;
 	GstSample *samp;
 	GstBuffer *buf;
-	EGLImage   frame = NULL;
+	GstMemory *mem;
+	bool cacheable;
+
+	flush_cache(dec, __atomic_exchange_n(&dec->flush_cache, false, __ATOMIC_ACQ_REL));
 
-	samp = gst_app_sink_pull_sample(GST_APP_SINK(dec->sink));
+	samp = next_sample(dec, time_ns, wait, eos);
 	if (!samp) {
-		GST_DEBUG("got no appsink sample");
-		return NULL;
+		if (*eos) {
+			GST_DEBUG("end of stream");
+			return 0;
+		}
+		if (dec->last_samp)
+			dec->repeated++;
+		return dec->last_tex;
 	}
 
 	buf = gst_sample_get_buffer(samp);
 
-	// TODO inline buffer_to_image??
-	frame = buffer_to_image(dec, buf);
-
-	// TODO in the zero-copy dmabuf case it would be nice to associate
-	// the eglimg w/ the buffer to avoid recreating it every frame..
+	/* frames copied into a new bo (see buf_to_fd()) are different
+	 * every time, only dmabuf memory (from the decoder, or GbmPool)
+	 * is worth caching:
+	 */
+	mem = gst_buffer_peek_memory(buf, 0);
+	cacheable = gst_buffer_n_memory(buf) == 1 && gst_is_dmabuf_memory(mem);
+
+	img = cacheable ? lookup_image(dec, mem) : NULL;
+	if (!img) {
+		img = import_buffer(dec, buf);
+		if (!img) {
+			/* keep showing the last frame, one bad frame is
+			 * no reason to end (or restart) the stream:
+			 */
+			if (!dec->import_failed++)
+				printf("video: failed to import a frame\n");
+			gst_sample_unref(samp);
+			return dec->last_tex;
+		}
+		if (cacheable)
+			add_image(dec, mem, img);
+		else
+			transient = img;
+	}
 
-	set_last_frame(dec, frame, samp);
+	set_last_frame(dec, transient, samp);
+	dec->last_tex = img->tex;
 
 	dec->frame++;
 
-	return frame;
+	return dec->last_tex;
 }
 
-void video_deinit(struct decoder *dec)
+void video_play(struct decoder *dec)
 {
-	set_last_frame(dec, NULL, NULL);
+	gst_element_set_state(dec->pipeline, GST_STATE_PLAYING);
+}
+
+/* Shutting the pipeline down waits for its threads, which would be a
+ * hitch in playback, so that is done in the background.  The ones still
+ * running are counted, for video_wait():
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned running;
+} teardowns = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void *
+teardown_thread_func(void *args)
+{
+	struct decoder *dec = args;
+
 	gst_element_set_state(dec->pipeline, GST_STATE_NULL);
 	gst_object_unref(dec->sink);
 	gst_object_unref(dec->pipeline);
+	if (dec->pool)
+		gst_object_unref(dec->pool);
+	g_source_destroy(dec->bus_watch);
+	g_source_unref(dec->bus_watch);
 	g_main_loop_quit(dec->loop);
 	g_main_loop_unref(dec->loop);
 	pthread_join(dec->gst_thread, 0);
+	g_main_context_unref(dec->context);
+	pthread_cond_destroy(&dec->cond);
+	pthread_mutex_destroy(&dec->lock);
 	free(dec);
+
+	pthread_mutex_lock(&teardowns.lock);
+	teardowns.running--;
+	pthread_cond_broadcast(&teardowns.cond);
+	pthread_mutex_unlock(&teardowns.lock);
+
+	return NULL;
+}
+
+void video_deinit(struct decoder *dec)
+{
+	pthread_t teardown_thread;
+
+	printf("video: %u frames shown, %u dropped, %u repeated, %u failed to import\n",
+			dec->frame, dec->dropped, dec->repeated, dec->import_failed);
+
+	/* unblock the gst thread, if it waits for room in the queue, and
+	 * stop it queueing more:
+	 */
+	pthread_mutex_lock(&dec->lock);
+	dec->flushing = true;
+	while (dec->queue_len) {
+		gst_sample_unref(dec->queue[dec->queue_head]);
+		dec->queue_head = (dec->queue_head + 1) % VIDEO_QUEUE_SIZE;
+		dec->queue_len--;
+	}
+	pthread_cond_broadcast(&dec->cond);
+	pthread_mutex_unlock(&dec->lock);
+
+	/* the GL objects have to go on this thread: */
+	set_last_frame(dec, NULL, NULL);
+	dec->last_tex = 0;
+	flush_cache(dec, true);
+
+	pthread_mutex_lock(&teardowns.lock);
+	teardowns.running++;
+	pthread_mutex_unlock(&teardowns.lock);
+
+	if (pthread_create(&teardown_thread, NULL, teardown_thread_func, dec)) {
+		teardown_thread_func(dec);
+		return;
+	}
+	pthread_detach(teardown_thread);
+}
+
+void video_wait(void)
+{
+	pthread_mutex_lock(&teardowns.lock);
+	while (teardowns.running)
+		pthread_cond_wait(&teardowns.cond, &teardowns.lock);
+	pthread_mutex_unlock(&teardowns.lock);
 }
@@ -30,7 +30,10 @@
 #include <getopt.h>
 
 #include "common.h"
+#include "capture.h"
 #include "drm-common.h"
+#include "evloop.h"
+#include "stats.h"
 
 #ifdef HAVE_GST
 #include <gst/gst.h>
@@ -41,17 +44,28 @@ static const struct egl *egl;
 static const struct gbm *gbm;
 static const struct drm *drm;
 
-static const char *shortopts = "Ac:D:f:M:m:p:S:s:V:v:x";
+static const char *shortopts = "Ab:C:c:D:f:Ll:M:m:N:n:O:oPp:r:S:s:t:V:v:x";
 
 static const struct option longopts[] = {
 	{"atomic", no_argument,       0, 'A'},
+	{"buffers", required_argument, 0, 'b'},
+	{"capture", required_argument, 0, 'C'},
 	{"count",  required_argument, 0, 'c'},
 	{"device", required_argument, 0, 'D'},
 	{"format", required_argument, 0, 'f'},
+	{"layers", no_argument,       0, 'L'},
+	{"loop",   no_argument,       0, 'l'},
 	{"mode",   required_argument, 0, 'M'},
 	{"modifier", required_argument, 0, 'm'},
+	{"streams", required_argument, 0, 'N'},
+	{"cubes",  required_argument, 0, 'n'},
+	{"offscreen", required_argument, 0, 'O'},
+	{"outputs", no_argument,      0, 'o'},
+	{"pacing", no_argument,       0, 'P'},
 	{"perfcntr", required_argument, 0, 'p'},
+	{"dynres", required_argument, 0, 'r'},
 	{"samples",  required_argument, 0, 's'},
+	{"stats",  required_argument, 0, 't'},
 	{"video",  required_argument, 0, 'V'},
 	{"vmode",  required_argument, 0, 'v'},
 	{"surfaceless", no_argument,  0, 'x'},
@@ -60,25 +74,55 @@ static const struct option longopts[] = {
 
 static void usage(const char *name)
 {
-	printf("Usage: %s [-ADfMmSsVvx]\n"
+	printf("Usage: %s [-AbCDfLlMmNnOoPrSstVvx]\n"
 			"\n"
 			"options:\n"
 			"    -A, --atomic             use atomic modesetting and fencing\n"
+			"    -b, --buffers=N          number of buffers in the swapchain (2..8,\n"
+			"                             default 2)\n"
+			"    -C, --capture=FILE       record the rendered frames to FILE, as a y4m\n"
+			"                             stream (.y4m), png sequence (.png, with a\n"
+			"                             %%u for the frame number) or raw rgba\n"
 			"    -c, --count              run for the specified number of frames\n"
 			"    -D, --device=DEVICE      use the given device\n"
 			"    -f, --format=FOURCC      framebuffer format\n"
+			"    -L, --layers             put the video or shadertoy output and a UI\n"
+			"                             overlay on their own planes (atomic only)\n"
+			"    -l, --loop               loop a single video (or each stream) with\n"
+			"                             segment seeks, rather than restarting it\n"
 			"    -M, --mode=MODE          specify mode, one of:\n"
 			"        smooth    -  smooth shaded cube (default)\n"
 			"        rgba      -  rgba textured cube\n"
 			"        nv12-2img -  yuv textured (color conversion in shader)\n"
 			"        nv12-1img -  yuv textured (single nv12 texture)\n"
 			"    -m, --modifier=MODIFIER  hardcode the selected modifier\n"
+			"    -N, --streams=N          play N videos at once, each on its own cube\n"
+			"                             (1..8, with --video, which may list fewer\n"
+			"                             files to reuse)\n"
+			"    -n, --cubes=N            draw a grid of N cubes rather than one, and\n"
+			"                             report draws/s and triangles/s with the fps\n"
+			"                             (not with --video)\n"
+			"    -O, --offscreen=WxH      render offscreen at the given size, as fast as\n"
+			"                             possible, on a render node and without a\n"
+			"                             display\n"
+			"    -o, --outputs            drive all connected outputs, as one canvas\n"
+			"                             spanning them left to right (atomic only)\n"
+			"    -P, --pacing             start rendering as late as possible for the\n"
+			"                             next vblank, to minimize latency\n"
 			"    -p, --perfcntr=LIST      sample specified performance counters using\n"
 			"                             the AMD_performance_monitor extension (comma\n"
 			"                             separated list, shadertoy mode only)\n"
-			"    -S, --shadertoy=FILE     use specified shadertoy shader\n"
+			"    -r, --dynres=MS          lower the shadertoy resolution while it takes\n"
+			"                             more than MS milliseconds of gpu time a frame\n"
+			"                             (shadertoy mode only, not with --layers)\n"
+			"    -S, --shadertoy=FILE     use specified shadertoy shader, or a directory\n"
+			"                             with a multipass one (image.glsl and\n"
+			"                             bufa.glsl..bufd.glsl, see shadertoy.h)\n"
 			"    -s, --samples=N          use MSAA\n"
-			"    -V, --video=FILE         video textured cube (comma separated list)\n"
+			"    -t, --stats=FILE         write frame timing percentiles to FILE at\n"
+			"                             exit and on SIGUSR1 (CSV, or JSON for .json)\n"
+			"    -V, --video=FILE         video textured cube (comma separated list,\n"
+			"                             played gapless and repeated, see --loop)\n"
 			"    -v, --vmode=VMODE        specify the video mode in the format\n"
 			"                             <mode>[-<vrefresh>]\n"
 			"    -x, --surfaceless        use surfaceless mode, instead of gbm surface\n"
@@ -92,6 +136,8 @@ int main(int argc, char *argv[])
 	const char *video = NULL;
 	const char *shadertoy = NULL;
 	const char *perfcntr = NULL;
+	const char *stats = NULL;
+	const char *capture = NULL;
 	char mode_str[DRM_DISPLAY_MODE_LEN] = "";
 	char *p;
 	enum mode mode = SMOOTH;
@@ -99,11 +145,25 @@ int main(int argc, char *argv[])
 	uint64_t modifier = DRM_FORMAT_MOD_LINEAR;
 	int samples = 0;
 	int atomic = 0;
-	int opt;
+	int opt, ret;
 	unsigned int len;
 	unsigned int vrefresh = 0;
 	unsigned int count = ~0;
+	unsigned int buffers = NUM_BUFFERS;
+	unsigned int streams = 1;
+	unsigned int cubes = 1;
 	bool surfaceless = false;
+	bool layers = false;
+	bool loop = false;
+	bool outputs = false;
+	bool pacing = false;
+	int offscreen_width = 0, offscreen_height = 0;
+	bool offscreen = false;
+	int64_t dynres_ns = 0;
+
+	/* before any thread gets created, so all of them inherit it: */
+	if (evloop_block_signals())
+		return -1;
 
 #ifdef HAVE_GST
 	gst_init(&argc, &argv);
@@ -115,6 +175,9 @@ int main(int argc, char *argv[])
 		case 'A':
 			atomic = 1;
 			break;
+		case 'b':
+			buffers = strtoul(optarg, NULL, 0);
+			break;
 		case 'c':
 			count = strtoul(optarg, NULL, 0);
 			break;
@@ -136,6 +199,12 @@ int main(int argc, char *argv[])
 					     fourcc[2], fourcc[3]);
 			break;
 		}
+		case 'L':
+			layers = true;
+			break;
+		case 'l':
+			loop = true;
+			break;
 		case 'M':
 			if (strcmp(optarg, "smooth") == 0) {
 				mode = SMOOTH;
@@ -154,9 +223,32 @@ int main(int argc, char *argv[])
 		case 'm':
 			modifier = strtoull(optarg, NULL, 0);
 			break;
+		case 'N':
+			streams = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			cubes = strtoul(optarg, NULL, 0);
+			break;
+		case 'O':
+			offscreen = true;
+			if (sscanf(optarg, "%dx%d", &offscreen_width, &offscreen_height) != 2) {
+				printf("invalid offscreen size: %s\n", optarg);
+				usage(argv[0]);
+				return -1;
+			}
+			break;
+		case 'o':
+			outputs = true;
+			break;
+		case 'P':
+			pacing = true;
+			break;
 		case 'p':
 			perfcntr = optarg;
 			break;
+		case 'r':
+			dynres_ns = strtod(optarg, NULL) * (NSEC_PER_SEC / MSEC_PER_SEC);
+			break;
 		case 'S':
 			mode = SHADERTOY;
 			shadertoy = optarg;
@@ -164,6 +256,12 @@ int main(int argc, char *argv[])
 		case 's':
 			samples = strtoul(optarg, NULL, 0);
 			break;
+		case 't':
+			stats = optarg;
+			break;
+		case 'C':
+			capture = optarg;
+			break;
 		case 'V':
 			mode = VIDEO;
 			video = optarg;
@@ -190,36 +288,86 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (atomic)
-		drm = init_drm_atomic(device, mode_str, vrefresh, count);
+	if (layers && !atomic) {
+		printf("layers require atomic modesetting\n");
+		return -1;
+	}
+
+	if (outputs && !atomic) {
+		printf("multiple outputs require atomic modesetting\n");
+		return -1;
+	}
+
+	if (offscreen && (atomic || outputs || layers || pacing)) {
+		printf("offscreen rendering has no display to use those options with\n");
+		return -1;
+	}
+
+	if (streams > 1 && (mode != VIDEO || layers)) {
+		printf("multiple streams require --video, without --layers\n");
+		return -1;
+	}
+
+	if (cubes != 1 && mode == VIDEO) {
+		printf("multiple cubes are not supported with --video\n");
+		return -1;
+	}
+
+	if (outputs && layers) {
+		printf("layers are not supported with multiple outputs\n");
+		return -1;
+	}
+
+	/* the layer's size is fixed: */
+	if (dynres_ns && (mode != SHADERTOY || layers)) {
+		printf("dynamic resolution requires --shadertoy, without --layers\n");
+		return -1;
+	}
+
+	if (offscreen)
+		drm = init_drm_offscreen(device, offscreen_width, offscreen_height, count);
+	else if (atomic)
+		drm = init_drm_atomic(device, mode_str, vrefresh, count, outputs, pacing);
 	else
-		drm = init_drm_legacy(device, mode_str, vrefresh, count);
+		drm = init_drm_legacy(device, mode_str, vrefresh, count, pacing);
 	if (!drm) {
-		printf("failed to initialize %s DRM\n", atomic ? "atomic" : "legacy");
+		printf("failed to initialize %s DRM\n",
+				offscreen ? "offscreen" : atomic ? "atomic" : "legacy");
 		return -1;
 	}
 
-	gbm = init_gbm(drm->fd, drm->mode->hdisplay, drm->mode->vdisplay,
-			format, modifier, surfaceless);
+	/* there is nothing to present a gbm surface to: */
+	if (offscreen)
+		surfaceless = true;
+
+	gbm = init_gbm(drm->fd, drm->width, drm->height,
+			format, modifier, surfaceless, buffers);
 	if (!gbm) {
 		printf("failed to initialize GBM\n");
 		return -1;
 	}
 
 	if (mode == SMOOTH)
-		egl = init_cube_smooth(gbm, samples);
+		egl = init_cube_smooth(gbm, samples, layers);
+	else if (mode == VIDEO && streams > 1)
+		egl = init_cube_video_multi(gbm, video, streams, samples, loop);
 	else if (mode == VIDEO)
-		egl = init_cube_video(gbm, video, samples);
+		egl = init_cube_video(gbm, video, samples, layers, loop);
 	else if (mode == SHADERTOY)
-		egl = init_cube_shadertoy(gbm, shadertoy, samples);
+		egl = init_cube_shadertoy(gbm, shadertoy, samples, layers, dynres_ns);
 	else
-		egl = init_cube_tex(gbm, mode, samples);
+		egl = init_cube_tex(gbm, mode, samples, layers);
 
 	if (!egl) {
 		printf("failed to initialize EGL\n");
 		return -1;
 	}
 
+	if (mode != VIDEO && init_cubes(cubes)) {
+		printf("failed to initialize cubes\n");
+		return -1;
+	}
+
 	if (perfcntr) {
 		if (mode != SHADERTOY) {
 			printf("performance counters only supported in shadertoy mode\n");
@@ -228,9 +376,23 @@ int main(int argc, char *argv[])
 		init_perfcntrs(egl, perfcntr);
 	}
 
+	stats_init(stats);
+
+	if (init_capture(egl, gbm, capture, drm->mode ? drm->mode->vrefresh : 0)) {
+		printf("failed to initialize capture\n");
+		return -1;
+	}
+
 	/* clear the color buffer */
 	glClearColor(0.5, 0.5, 0.5, 1.0);
 	glClear(GL_COLOR_BUFFER_BIT);
 
-	return drm->run(gbm, egl);
+	ret = drm->run(gbm, egl);
+
+	if (egl->fini)
+		egl->fini();
+
+	fini_capture(egl);
+
+	return ret;
 }
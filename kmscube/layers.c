@@ -0,0 +1,260 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+
+/* The gpu composition fallback uses its own vertex attribute and texture
+ * unit, so it doesn't disturb the state the cube modes set up once at
+ * init time:
+ */
+#define BLIT_ATTRIB 7
+#define BLIT_UNIT   7
+
+static struct {
+	GLuint program;
+	GLint texture, flip;
+	GLuint vbo;
+} blit;
+
+static const char *blit_vs =
+	"attribute vec2 in_position;        \n"
+	"                                   \n"
+	"uniform float uFlip;               \n"
+	"                                   \n"
+	"varying vec2 vTexCoord;            \n"
+	"                                   \n"
+	"void main()                        \n"
+	"{                                  \n"
+	"    gl_Position = vec4(in_position * 2.0 - 1.0, 0.0, 1.0);\n"
+	"    vTexCoord = vec2(in_position.x, mix(in_position.y, 1.0 - in_position.y, uFlip));\n"
+	"}                                  \n";
+
+static const char *blit_fs =
+	"precision mediump float;           \n"
+	"                                   \n"
+	"uniform sampler2D uTex;            \n"
+	"                                   \n"
+	"varying vec2 vTexCoord;            \n"
+	"                                   \n"
+	"void main()                        \n"
+	"{                                  \n"
+	"    gl_FragColor = texture2D(uTex, vTexCoord);\n"
+	"}                                  \n";
+
+static int init_blit(void)
+{
+	static const GLfloat quad[] = {
+		0.0f, 0.0f,
+		1.0f, 0.0f,
+		0.0f, 1.0f,
+		1.0f, 1.0f,
+	};
+	int ret;
+
+	ret = create_program(blit_vs, blit_fs);
+	if (ret < 0)
+		return -1;
+
+	blit.program = ret;
+
+	glBindAttribLocation(blit.program, BLIT_ATTRIB, "in_position");
+
+	ret = link_program(blit.program);
+	if (ret)
+		return -1;
+
+	blit.texture = glGetUniformLocation(blit.program, "uTex");
+	blit.flip = glGetUniformLocation(blit.program, "uFlip");
+
+	glGenBuffers(1, &blit.vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, blit.vbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+
+	return 0;
+}
+
+int init_layer(struct egl *egl, const struct gbm *gbm, struct layer *layer,
+		uint32_t format, unsigned width, unsigned height)
+{
+	if (egl->num_layers == MAX_LAYERS) {
+		printf("too many layers\n");
+		return -1;
+	}
+
+	if (egl_check(egl, eglCreateImageKHR) ||
+	    egl_check(egl, glEGLImageTargetTexture2DOES))
+		return -1;
+
+	layer->format = format;
+	layer->width = width;
+	layer->height = height;
+	layer->num_buffers = gbm->num_buffers;
+	/* layers stack in the order they are added: */
+	layer->zpos = egl->num_layers + 1;
+
+	for (unsigned i = 0; i < layer->num_buffers; i++) {
+		layer->bos[i] = gbm_bo_create(gbm->dev, width, height, format,
+				GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+		if (!layer->bos[i]) {
+			printf("failed to create %s layer buffer\n", layer->name);
+			return -1;
+		}
+
+		if (!create_framebuffer(egl, layer->bos[i], &layer->fbs[i])) {
+			printf("failed to create %s layer framebuffer\n", layer->name);
+			return -1;
+		}
+
+		glBindTexture(GL_TEXTURE_2D, layer->fbs[i].tex);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	egl->layers[egl->num_layers++] = layer;
+
+	return 0;
+}
+
+/* Render all layers for this frame, into the layer buffers that go
+ * with swapchain buffer idx.  The caller binds the primary framebuffer
+ * again afterwards.
+ */
+void draw_layers(const struct egl *egl, const struct gbm *gbm, int idx,
+		unsigned i, int64_t time_ns)
+{
+	GLint program;
+
+	glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+
+	for (unsigned n = 0; n < egl->num_layers; n++) {
+		struct layer *layer = egl->layers[n];
+
+		layer->cur = idx;
+
+		glBindFramebuffer(GL_FRAMEBUFFER, layer->fbs[idx].fb);
+		glViewport(0, 0, layer->width, layer->height);
+
+		layer->draw(layer, i, time_ns);
+	}
+
+	glViewport(0, 0, gbm->width, gbm->height);
+	glUseProgram(program);
+}
+
+/* Blend the layers selected in mask into the currently bound (primary)
+ * framebuffer, in stacking order, as the display controller would have
+ * done if they were on planes.  Layer content is premultiplied, which is
+ * the kms default blend mode.
+ */
+void composite_layers(const struct egl *egl, const struct gbm *gbm, unsigned mask)
+{
+	GLint program, vbo;
+
+	if (!mask)
+		return;
+
+	if (!blit.program && init_blit()) {
+		printf("failed to initialize layer composition\n");
+		return;
+	}
+
+	glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+	glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &vbo);
+
+	glUseProgram(blit.program);
+	glUniform1i(blit.texture, BLIT_UNIT);
+	/* a window surface is scanned out bottom-up compared to a plain
+	 * fbo, so in that case flip the layers to match the planes:
+	 */
+	glUniform1f(blit.flip, gbm->surface ? 1.0f : 0.0f);
+
+	glBindBuffer(GL_ARRAY_BUFFER, blit.vbo);
+	glVertexAttribPointer(BLIT_ATTRIB, 2, GL_FLOAT, GL_FALSE, 0, 0);
+	glEnableVertexAttribArray(BLIT_ATTRIB);
+
+	glActiveTexture(GL_TEXTURE0 + BLIT_UNIT);
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+	for (unsigned n = 0; n < egl->num_layers; n++) {
+		const struct layer *layer = egl->layers[n];
+		int y = layer->y;
+
+		if (!(mask & (1 << n)))
+			continue;
+
+		if (gbm->surface)
+			y = gbm->height - layer->y - layer->height;
+
+		glViewport(layer->x, y, layer->width, layer->height);
+		glBindTexture(GL_TEXTURE_2D, layer->fbs[layer->cur].tex);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	}
+
+	glDisable(GL_BLEND);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE0);
+	glDisableVertexAttribArray(BLIT_ATTRIB);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	glViewport(0, 0, gbm->width, gbm->height);
+	glUseProgram(program);
+}
+
+/* A minimal UI overlay: a translucent status bar along the top of the
+ * screen, with a block that moves along as frames are rendered.
+ */
+static struct layer hud;
+
+static void draw_hud(struct layer *layer, unsigned i, int64_t time_ns)
+{
+	unsigned size = layer->height;
+	unsigned pos = (i % 120) * (layer->width - size) / 120;
+
+	(void)time_ns;
+
+	glClearColor(0.0, 0.0, 0.0, 0.5);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(pos, 0, size, size);
+	glClearColor(0.8, 0.8, 0.8, 0.8);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glDisable(GL_SCISSOR_TEST);
+}
+
+int init_hud_layer(struct egl *egl, const struct gbm *gbm)
+{
+	hud.name = "hud";
+	hud.x = 0;
+	hud.y = 0;
+	hud.draw = draw_hud;
+
+	return init_layer(egl, gbm, &hud, DRM_FORMAT_ARGB8888, gbm->width, 32);
+}
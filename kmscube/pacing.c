@@ -0,0 +1,105 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "pacing.h"
+
+/* lower bound of the safety margin: */
+#define MIN_MARGIN_NS  (NSEC_PER_SEC / 1000)
+
+void pacing_init(struct pacing *p, const drmModeModeInfo *mode, bool deadline)
+{
+	memset(p, 0, sizeof(*p));
+
+	p->deadline = deadline;
+
+	/* mode clock is in kHz: */
+	if (mode->clock && mode->htotal && mode->vtotal)
+		p->period_ns = (int64_t)mode->htotal * mode->vtotal *
+				(NSEC_PER_SEC / 1000) / mode->clock;
+	else
+		p->period_ns = NSEC_PER_SEC / (mode->vrefresh ? mode->vrefresh : 60);
+
+	p->margin_ns = MIN_MARGIN_NS;
+}
+
+int64_t pacing_schedule(struct pacing *p, int64_t now_ns, int64_t *start_ns)
+{
+	int64_t earliest = now_ns + p->render_ns + p->margin_ns;
+	int64_t target;
+
+	if (!p->last_vblank_ns) {
+		/* nothing on screen yet, so no vblank to go by: */
+		target = earliest;
+	} else {
+		/* first vblank after the frame can be ready: */
+		int64_t n = (earliest - p->last_vblank_ns + p->period_ns - 1) / p->period_ns;
+		target = p->last_vblank_ns + MAX2(n, 1) * p->period_ns;
+	}
+
+	/* one frame per vblank, the previous frame may still be queued for
+	 * the one we came up with:
+	 */
+	if (p->last_target_ns && target < p->last_target_ns + p->period_ns / 2)
+		target = p->last_target_ns + p->period_ns;
+
+	if (!p->start_ns)
+		p->start_ns = target;
+	p->last_target_ns = target;
+
+	*start_ns = now_ns;
+	if (p->deadline)
+		*start_ns = MAX2(now_ns, target - p->render_ns - p->margin_ns);
+
+	return target;
+}
+
+void pacing_flip(struct pacing *p, uint64_t seq, int64_t vblank_ns, int64_t target_ns)
+{
+	/* refine the period from the vblank counter, the mode clock is
+	 * only nominal:
+	 */
+	if (seq && p->last_seq && seq > p->last_seq) {
+		int64_t period = (vblank_ns - p->last_vblank_ns) /
+				(int64_t)(seq - p->last_seq);
+		p->period_ns += (period - p->period_ns) / 8;
+	}
+
+	if (vblank_ns > target_ns + p->period_ns / 2) {
+		/* missed the target vblank, render earlier: */
+		p->missed++;
+		p->margin_ns = MIN2(p->margin_ns + p->period_ns / 4, p->period_ns);
+	} else {
+		p->margin_ns = MAX2(p->margin_ns - p->margin_ns / 64, MIN_MARGIN_NS);
+	}
+
+	p->last_vblank_ns = vblank_ns;
+	p->last_seq = seq;
+}
+
+void pacing_rendered(struct pacing *p, int64_t render_ns)
+{
+	/* follow increases right away, decreases slowly: */
+	p->render_ns = MAX2(render_ns, p->render_ns - p->render_ns / 16);
+}
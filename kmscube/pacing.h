@@ -0,0 +1,81 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _PACING_H
+#define _PACING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+/* Frame pacing, shared by the legacy and atomic backends.
+ *
+ * Flip completion timestamps (the vblank the new frame went on screen
+ * at) are used to predict the following vblanks.  Each frame gets a
+ * target vblank, the first one it can make given how long rendering
+ * takes, and the predicted present time is what the frame animates to,
+ * so a dropped frame doesn't slow down the animation.
+ *
+ * With deadline scheduling enabled, rendering is held back until just
+ * before the target vblank (the render time estimate plus a safety
+ * margin), which keeps the latency from render to screen minimal.  The
+ * margin grows when a frame misses its vblank, and slowly shrinks back
+ * as long as they don't.
+ */
+
+struct pacing {
+	bool deadline;             /* delay rendering until the deadline */
+
+	int64_t period_ns;         /* refresh period */
+	int64_t last_vblank_ns;    /* time of the last flip, 0 before the first */
+	uint64_t last_seq;         /* its vblank sequence, 0 if not known */
+
+	int64_t render_ns;         /* render time estimate (decaying max) */
+	int64_t margin_ns;
+
+	int64_t start_ns;          /* present time of the first frame */
+	int64_t last_target_ns;    /* target of the last scheduled frame */
+
+	unsigned missed;
+};
+
+void pacing_init(struct pacing *p, const drmModeModeInfo *mode, bool deadline);
+
+/* Pick the target vblank for a frame about to be rendered.  Returns the
+ * predicted present time, and in *start_ns when to start rendering.
+ */
+int64_t pacing_schedule(struct pacing *p, int64_t now_ns, int64_t *start_ns);
+
+/* The frame with this target went on screen at the vblank at vblank_ns
+ * (seq is its sequence number, or 0 if not known):
+ */
+void pacing_flip(struct pacing *p, uint64_t seq, int64_t vblank_ns, int64_t target_ns);
+
+/* How long the frame took to render: */
+void pacing_rendered(struct pacing *p, int64_t render_ns);
+
+/* Animation time of a frame presented at present_ns: */
+static inline int64_t pacing_time(const struct pacing *p, int64_t present_ns)
+{
+	return present_ns - p->start_ns;
+}
+
+#endif /* _PACING_H */
@@ -0,0 +1,424 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+
+/* On-disk cache of linked program binaries (GL_OES_get_program_binary),
+ * so a warm start doesn't compile any GLSL.
+ *
+ * Binaries are keyed by a hash of the shader sources and the driver's
+ * vendor, renderer, version and GLSL version strings, so a driver
+ * update misses rather than loading a stale binary.  Files are written
+ * to a temporary name and renamed into place, so a crash or power loss
+ * never leaves a truncated entry behind, and anything the driver
+ * refuses to load is removed and compiled from source again.
+ *
+ * Only the MAX_FILES most recently used binaries are kept, since every
+ * shadertoy hot reload edit adds one.
+ *
+ * The cache lives in $KMSCUBE_CACHE_DIR, or kmscube/ in $XDG_CACHE_HOME
+ * (~/.cache by default).  Set KMSCUBE_CACHE_DIR to an empty string to
+ * disable it.
+ */
+
+/* Bump when kmscube changes something that is baked into the binaries
+ * but not part of the sources, like the attribute locations:
+ */
+#define CACHE_VERSION 1
+#define CACHE_MAGIC   0x4250434b    /* "KCPB" */
+
+#define MAX_PENDING   16
+#define MAX_FILES     64
+
+struct header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	uint32_t format;
+	uint32_t length;
+};
+
+/* Programs between create_program() and link_program(), also without a
+ * cached binary, for the key to store the one linked under:
+ */
+struct pending {
+	GLuint program;             /* 0 for a free slot */
+	uint64_t key;
+	char *vs_src, *fs_src;      /* to compile after all, if the binary fails */
+	void *binary;               /* NULL if there was none cached */
+	struct header header;
+};
+
+static struct {
+	bool enabled;
+	char dir[256];
+	uint64_t driver_hash;
+
+	PFNGLGETPROGRAMBINARYOESPROC glGetProgramBinaryOES;
+	PFNGLPROGRAMBINARYOESPROC glProgramBinaryOES;
+
+	struct pending pending[MAX_PENDING];
+	bool warned_full;
+} cache;
+
+/* 64-bit FNV-1a, including the terminating 0 so "ab" + "c" != "a" + "bc": */
+static uint64_t hash_str(uint64_t hash, const char *str)
+{
+	const unsigned char *p = (const unsigned char *)(str ? str : "");
+
+	do {
+		hash ^= *p;
+		hash *= 0x100000001b3ull;
+	} while (*p++);
+
+	return hash;
+}
+
+static int mkdir_p(char *path)
+{
+	for (char *p = path + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(path, 0755) && errno != EEXIST) {
+			*p = '/';
+			return -1;
+		}
+		*p = '/';
+	}
+
+	if (mkdir(path, 0755) && errno != EEXIST)
+		return -1;
+
+	return 0;
+}
+
+struct entry {
+	char name[32];
+	time_t mtime;
+};
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct entry *ea = a, *eb = b;
+
+	/* newest first: */
+	return (ea->mtime < eb->mtime) - (ea->mtime > eb->mtime);
+}
+
+/* Remove all but the MAX_FILES most recently used binaries (a hit
+ * touches its file, see load_binary()):
+ */
+static void prune_cache(void)
+{
+	struct entry *entries = NULL;
+	unsigned count = 0, size = 0;
+	struct dirent *de;
+	char path[320];
+	struct stat st;
+	DIR *dir;
+
+	dir = opendir(cache.dir);
+	if (!dir)
+		return;
+
+	while ((de = readdir(dir))) {
+		size_t len = strlen(de->d_name);
+
+		if (len != 20 || strcmp(de->d_name + 16, ".bin") ||
+		    fstatat(dirfd(dir), de->d_name, &st, 0))
+			continue;
+
+		if (count == size) {
+			struct entry *e;
+
+			size = size ? 2 * size : MAX_FILES * 2;
+			e = realloc(entries, size * sizeof(*entries));
+			if (!e)
+				break;
+			entries = e;
+		}
+
+		memcpy(entries[count].name, de->d_name, len + 1);
+		entries[count].mtime = st.st_mtime;
+		count++;
+	}
+	closedir(dir);
+
+	if (count > MAX_FILES) {
+		qsort(entries, count, sizeof(*entries), entry_cmp);
+
+		for (unsigned i = MAX_FILES; i < count; i++) {
+			snprintf(path, sizeof(path), "%s/%s", cache.dir, entries[i].name);
+			unlink(path);
+		}
+	}
+
+	free(entries);
+}
+
+void progcache_init(const struct egl *egl)
+{
+	const char *dir = getenv("KMSCUBE_CACHE_DIR");
+	GLint formats = 0;
+	int len;
+
+	cache.enabled = false;
+
+	if (!egl->glGetProgramBinaryOES || !egl->glProgramBinaryOES)
+		return;
+
+	/* the extension is there, but the driver may not support any: */
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+	if (formats < 1)
+		return;
+
+	if (dir) {
+		len = snprintf(cache.dir, sizeof(cache.dir), "%s", dir);
+	} else if ((dir = getenv("XDG_CACHE_HOME")) && dir[0]) {
+		len = snprintf(cache.dir, sizeof(cache.dir), "%s/kmscube", dir);
+	} else if ((dir = getenv("HOME"))) {
+		len = snprintf(cache.dir, sizeof(cache.dir), "%s/.cache/kmscube", dir);
+	} else {
+		return;
+	}
+
+	if (len <= 0 || len >= (int)sizeof(cache.dir))
+		return;
+
+	if (mkdir_p(cache.dir)) {
+		printf("program cache disabled, could not create %s: %s\n",
+				cache.dir, strerror(errno));
+		return;
+	}
+
+	cache.driver_hash = hash_str(0xcbf29ce484222325ull, (const char *)glGetString(GL_VENDOR));
+	cache.driver_hash = hash_str(cache.driver_hash, (const char *)glGetString(GL_RENDERER));
+	cache.driver_hash = hash_str(cache.driver_hash, (const char *)glGetString(GL_VERSION));
+	cache.driver_hash = hash_str(cache.driver_hash, (const char *)glGetString(GL_SHADING_LANGUAGE_VERSION));
+
+	cache.glGetProgramBinaryOES = egl->glGetProgramBinaryOES;
+	cache.glProgramBinaryOES = egl->glProgramBinaryOES;
+	cache.enabled = true;
+
+	printf("Using program cache in %s\n", cache.dir);
+
+	prune_cache();
+}
+
+static void cache_path(char *path, size_t size, uint64_t key)
+{
+	snprintf(path, size, "%s/%016" PRIx64 ".bin", cache.dir, key);
+}
+
+static void *load_binary(uint64_t key, struct header *header)
+{
+	char path[320];
+	struct stat st;
+	void *binary = NULL;
+	int fd;
+
+	cache_path(path, sizeof(path), key);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) ||
+			read(fd, header, sizeof(*header)) != sizeof(*header) ||
+			header->magic != CACHE_MAGIC ||
+			header->version != CACHE_VERSION ||
+			header->key != key ||
+			st.st_size != (off_t)(sizeof(*header) + header->length))
+		goto out;
+
+	binary = malloc(header->length);
+	if (read(fd, binary, header->length) != (ssize_t)header->length) {
+		free(binary);
+		binary = NULL;
+	}
+
+	/* for prune_cache() to keep it: */
+	if (binary)
+		futimens(fd, NULL);
+
+out:
+	close(fd);
+	return binary;
+}
+
+static void store_binary(GLuint program, uint64_t key)
+{
+	struct header header = {
+		.magic = CACHE_MAGIC,
+		.version = CACHE_VERSION,
+		.key = key,
+	};
+	char path[320], tmp[340];
+	GLint length = 0;
+	GLsizei written = 0;
+	GLenum format;
+	void *binary;
+	int fd;
+
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+	if (length <= 0)
+		return;
+
+	binary = malloc(length);
+	cache.glGetProgramBinaryOES(program, length, &written, &format, binary);
+	if (written <= 0)
+		goto out;
+
+	header.format = format;
+	header.length = written;
+
+	cache_path(path, sizeof(path), key);
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, getpid());
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		goto out;
+
+	if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+			write(fd, binary, written) != written ||
+			fsync(fd)) {
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	close(fd);
+
+	if (rename(tmp, path))
+		unlink(tmp);
+	else
+		prune_cache();
+
+out:
+	free(binary);
+}
+
+static struct pending *find_pending(GLuint program)
+{
+	for (unsigned i = 0; i < MAX_PENDING; i++)
+		if (cache.pending[i].program == program)
+			return &cache.pending[i];
+	return NULL;
+}
+
+bool progcache_lookup(unsigned program, const char *vs_src, const char *fs_src)
+{
+	struct pending *p;
+
+	if (!cache.enabled)
+		return false;
+
+	/* GL just handed out this name, so a slot still holding it is left
+	 * over from a program deleted without delete_program():
+	 */
+	progcache_done(program, false);
+
+	p = find_pending(0);
+	if (!p) {
+		/* or deleted, without reusing the name yet: */
+		for (unsigned i = 0; i < MAX_PENDING; i++)
+			if (!glIsProgram(cache.pending[i].program))
+				progcache_done(cache.pending[i].program, false);
+		p = find_pending(0);
+	}
+	if (!p) {
+		if (!cache.warned_full)
+			printf("too many programs linking at once, not caching all of them\n");
+		cache.warned_full = true;
+		return false;
+	}
+
+	p->program = program;
+	p->key = hash_str(hash_str(cache.driver_hash, vs_src), fs_src);
+	p->binary = load_binary(p->key, &p->header);
+
+	if (!p->binary)
+		return false;
+
+	/* the sources are only needed if the binary doesn't load: */
+	p->vs_src = strdup(vs_src);
+	p->fs_src = strdup(fs_src);
+
+	return true;
+}
+
+int progcache_link(unsigned program, const char **vs_src, const char **fs_src)
+{
+	struct pending *p = find_pending(program);
+	char path[320];
+	GLint ret;
+
+	if (!p || !program || !p->binary)
+		return 0;
+
+	cache.glProgramBinaryOES(program, p->header.format, p->binary, p->header.length);
+	free(p->binary);
+	p->binary = NULL;
+
+	glGetProgramiv(program, GL_LINK_STATUS, &ret);
+	if (ret) {
+		progcache_done(program, false);
+		return 1;
+	}
+
+	/* most likely a driver update that didn't change the version
+	 * string, so get rid of it and store the new one once linked:
+	 */
+	printf("cached program binary rejected, compiling it\n");
+	cache_path(path, sizeof(path), p->key);
+	unlink(path);
+
+	*vs_src = p->vs_src;
+	*fs_src = p->fs_src;
+
+	return -1;
+}
+
+void progcache_done(unsigned program, bool linked)
+{
+	struct pending *p = find_pending(program);
+
+	if (!p || !program)
+		return;
+
+	if (linked)
+		store_binary(program, p->key);
+
+	free(p->binary);
+	free(p->vs_src);
+	free(p->fs_src);
+	memset(p, 0, sizeof(*p));
+}
@@ -0,0 +1,1013 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include <GLES3/gl3.h>
+
+#include "common.h"
+#include "evloop.h"
+#include "shadertoy.h"
+
+#define NUM_PASSES   5      /* Buffer A-D, and Image */
+#define IMAGE        4
+#define NUM_CHANNELS 4
+
+/* Dynamic resolution steps down 1/8th of the configured size at a time,
+ * to 1/4 of it.  Queries are read a few frames late, so they don't
+ * stall, and the average of a few frames settles before the next step:
+ */
+#define DYNRES_LEVELS  7
+#define DYNRES_QUERIES 4
+#define DYNRES_SETTLE  16
+
+static const char *pass_names[NUM_PASSES] = {
+	"bufa", "bufb", "bufc", "bufd", "image",
+};
+
+static const struct format {
+	const char *name;
+	GLint internal_format;
+	GLenum format, type;
+} formats[] = {
+	{ "rgb8",    GL_RGB,     GL_RGB,  GL_UNSIGNED_BYTE },
+	{ "rgba8",   GL_RGBA,    GL_RGBA, GL_UNSIGNED_BYTE },
+	{ "rgba16f", GL_RGBA16F, GL_RGBA, GL_HALF_FLOAT },
+};
+
+struct pass {
+	bool used;
+	char *src;
+	int channel[NUM_CHANNELS];  /* pass index, or -1 */
+	unsigned base_width, base_height;
+	unsigned width, height;     /* scaled by dynamic resolution */
+	const struct format *format;
+
+	GLuint program;
+	int status;                 /* program_status(), until it is 1 */
+	GLint time_loc, time_delta_loc, frame_loc;
+	GLint resolution_loc, channel_resolution_loc;
+	GLint channel_loc[NUM_CHANNELS];
+
+	/* buffers only, cur is the one last rendered: */
+	GLuint fbo[2], tex[2];
+	int cur;
+};
+
+static struct {
+	const char *path;
+	bool dir;
+
+	struct pass passes[NUM_PASSES];
+	int order[NUM_PASSES];
+	unsigned num_passes;
+
+	GLuint vbo;
+	GLuint black;               /* for unused channels */
+	bool ready, failed;
+
+	int frame;
+	int64_t last_time_ns;
+
+	/* dynamic resolution, see shadertoy_dynres(): */
+	struct {
+		const struct egl *egl;
+		int64_t budget_ns, avg_ns;
+		GLuint queries[DYNRES_QUERIES];
+		int query_level[DYNRES_QUERIES];  /* -1 when not pending */
+		unsigned next, samples;
+		bool measuring;
+		int level;
+	} dynres;
+
+	/* hot reload, see shadertoy_watch(): */
+	struct {
+		int fd;                     /* inotify, -1 if not watching */
+		unsigned dirty;             /* passes changed on disk */
+		unsigned building;          /* passes with a new program in pending[] */
+		struct pass pending[NUM_PASSES];
+		int64_t start_ns;
+	} reload;
+} stoy;
+
+static const char *shadertoy_vs =
+	"attribute vec3 position;           \n"
+	"void main()                        \n"
+	"{                                  \n"
+	"    gl_Position = vec4(position, 1.0);\n"
+	"}                                  \n";
+
+static const char *shadertoy_fs_tmpl =
+	"precision mediump float;                                                             \n"
+	"uniform vec3      iResolution;           // viewport resolution (in pixels)          \n"
+	"uniform float     iGlobalTime;           // shader playback time (in seconds)        \n"
+	"uniform vec4      iMouse;                // mouse pixel coords                       \n"
+	"uniform vec4      iDate;                 // (year, month, day, time in seconds)      \n"
+	"uniform float     iSampleRate;           // sound sample rate (i.e., 44100)          \n"
+	"uniform vec3      iChannelResolution[4]; // channel resolution (in pixels)           \n"
+	"uniform float     iChannelTime[4];       // channel playback time (in sec)           \n"
+	"uniform float     iTime;                                                             \n"
+	"uniform float     iTimeDelta;            // render time of the last frame (in sec)   \n"
+	"uniform int       iFrame;                // frame number                             \n"
+	"uniform sampler2D iChannel0;                                                         \n"
+	"uniform sampler2D iChannel1;                                                         \n"
+	"uniform sampler2D iChannel2;                                                         \n"
+	"uniform sampler2D iChannel3;                                                         \n"
+	"                                                                                     \n"
+	"%s                                                                                   \n"
+	"                                                                                     \n"
+	"void main()                                                                          \n"
+	"{                                                                                    \n"
+	"    mainImage(gl_FragColor, gl_FragCoord.xy);                                        \n"
+	"}                                                                                    \n";
+
+static char *read_file(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	struct stat st;
+	char *buf;
+
+	if (!f)
+		return NULL;
+
+	if (fstat(fileno(f), &st)) {
+		fclose(f);
+		return NULL;
+	}
+
+	buf = malloc(st.st_size + 1);
+	buf[fread(buf, 1, st.st_size, f)] = '\0';
+	fclose(f);
+
+	return buf;
+}
+
+static int pass_index(const char *name)
+{
+	for (int i = 0; i < IMAGE; i++)
+		if (!strcasecmp(name, pass_names[i]))
+			return i;
+	return -1;
+}
+
+/* The "// key: value" lines of a pass: */
+static int parse_directives(struct pass *pass, const char *name)
+{
+	const char *line = pass->src;
+
+	while (line && *line) {
+		const char *end = strchr(line, '\n');
+		size_t len = end ? (size_t)(end - line) : strlen(line);
+		char buf[128], value[32];
+		unsigned n, w, h;
+
+		if (len < sizeof(buf)) {
+			memcpy(buf, line, len);
+			buf[len] = '\0';
+
+			if (sscanf(buf, " // iChannel%u: %31s", &n, value) == 2) {
+				if (n >= NUM_CHANNELS) {
+					printf("%s: no iChannel%u\n", name, n);
+					return -1;
+				}
+				pass->channel[n] = pass_index(value);
+				if (pass->channel[n] < 0 && strcasecmp(value, "none")) {
+					printf("%s: unknown iChannel%u input: %s\n", name, n, value);
+					return -1;
+				}
+			} else if (sscanf(buf, " // format: %31s", value) == 1) {
+				pass->format = NULL;
+				for (unsigned i = 0; i < ARRAY_SIZE(formats); i++)
+					if (!strcasecmp(value, formats[i].name))
+						pass->format = &formats[i];
+				if (!pass->format) {
+					printf("%s: unknown format: %s\n", name, value);
+					return -1;
+				}
+			} else if (sscanf(buf, " // size: %ux%u", &w, &h) == 2) {
+				if (!w || !h) {
+					printf("%s: invalid size: %ux%u\n", name, w, h);
+					return -1;
+				}
+				pass->width = w;
+				pass->height = h;
+			}
+		}
+
+		line = end ? end + 1 : NULL;
+	}
+
+	return 0;
+}
+
+/* The file a pass is read from, NULL if it can't have one: */
+static const char *pass_file(int i, char *file, size_t size)
+{
+	if (stoy.dir) {
+		snprintf(file, size, "%s/%s.glsl", stoy.path, pass_names[i]);
+		return file;
+	}
+
+	return (i == IMAGE) ? stoy.path : NULL;
+}
+
+static int check_channels(const struct pass *pass, const char *name)
+{
+	for (int c = 0; c < NUM_CHANNELS; c++) {
+		int src = pass->channel[c];
+		if (src >= 0 && !stoy.passes[src].used) {
+			printf("%s: iChannel%d reads %s, which there is none of\n",
+					name, c, pass_names[src]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int load_passes(const char *path)
+{
+	struct stat st;
+	char file[512];
+
+	if (stat(path, &st)) {
+		printf("could not stat '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	stoy.path = path;
+	stoy.dir = S_ISDIR(st.st_mode);
+
+	for (int i = 0; i < NUM_PASSES; i++) {
+		struct pass *pass = &stoy.passes[i];
+		const char *name = pass_file(i, file, sizeof(file));
+
+		if (!name)
+			continue;
+
+		pass->src = read_file(name);
+		if (!pass->src) {
+			/* only the Image pass is required: */
+			if (errno == ENOENT && i != IMAGE)
+				continue;
+			printf("could not read '%s': %s\n", name, strerror(errno));
+			return -1;
+		}
+
+		pass->used = true;
+		pass->width = (i == IMAGE) ? 512 : 0;
+		pass->height = (i == IMAGE) ? 512 : 0;
+		pass->format = &formats[i == IMAGE ? 0 : 1];
+		for (int c = 0; c < NUM_CHANNELS; c++)
+			pass->channel[c] = -1;
+
+		if (parse_directives(pass, pass_names[i]))
+			return -1;
+
+		/* it renders into the cube's texture (or layer): */
+		if (i == IMAGE)
+			pass->format = &formats[0];
+	}
+
+	for (int i = 0; i < NUM_PASSES; i++) {
+		struct pass *pass = &stoy.passes[i];
+
+		if (!pass->used)
+			continue;
+
+		/* buffers without a size of their own follow the Image pass: */
+		if (!pass->width) {
+			pass->width = stoy.passes[IMAGE].width;
+			pass->height = stoy.passes[IMAGE].height;
+		}
+
+		pass->base_width = pass->width;
+		pass->base_height = pass->height;
+
+		if (check_channels(pass, pass_names[i]))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Passes in A-D order, except that a pass goes after the buffers it
+ * reads.  On a cycle, the first of the remaining ones goes next.  The
+ * Image pass is always last:
+ */
+static void schedule_passes(void)
+{
+	bool done[NUM_PASSES] = { false };
+	unsigned num_buffers = 0;
+
+	for (int i = 0; i < IMAGE; i++)
+		if (stoy.passes[i].used)
+			num_buffers++;
+
+	stoy.num_passes = 0;
+
+	while (stoy.num_passes < num_buffers) {
+		int next = -1;
+
+		for (int i = 0; i < IMAGE && next < 0; i++) {
+			struct pass *pass = &stoy.passes[i];
+			bool ready = pass->used && !done[i];
+
+			for (int c = 0; c < NUM_CHANNELS && ready; c++) {
+				int src = pass->channel[c];
+				if (src >= 0 && src != i && !done[src])
+					ready = false;
+			}
+
+			if (ready)
+				next = i;
+		}
+
+		for (int i = 0; i < IMAGE && next < 0; i++)
+			if (stoy.passes[i].used && !done[i])
+				next = i;
+
+		done[next] = true;
+		stoy.order[stoy.num_passes++] = next;
+	}
+
+	stoy.order[stoy.num_passes++] = IMAGE;
+}
+
+static int init_buffer(struct pass *pass, const char *name)
+{
+	const struct format *format = pass->format;
+
+	glGenTextures(2, pass->tex);
+	glGenFramebuffers(2, pass->fbo);
+
+	for (int n = 0; n < 2; n++) {
+		glBindTexture(GL_TEXTURE_2D, pass->tex[n]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, format->internal_format, pass->width, pass->height,
+				0, format->format, format->type, NULL);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, pass->fbo[n]);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+				pass->tex[n], 0);
+
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			glDeleteFramebuffers(2, pass->fbo);
+			glDeleteTextures(2, pass->tex);
+
+			/* float formats need EXT_color_buffer_(half_)float: */
+			if (format == &formats[1]) {
+				printf("%s: could not create %ux%u framebuffer\n",
+						name, pass->width, pass->height);
+				return -1;
+			}
+
+			printf("%s: %s not renderable, using rgba8\n", name, format->name);
+			pass->format = &formats[1];
+			return init_buffer(pass, name);
+		}
+
+		/* the first frame reads zeroes, like on shadertoy.com: */
+		glClearColor(0.0, 0.0, 0.0, 0.0);
+		glClear(GL_COLOR_BUFFER_BIT);
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	return 0;
+}
+
+/* Resize a buffer's textures (the framebuffers stay attached): */
+static void resize_buffer(struct pass *pass)
+{
+	const struct format *format = pass->format;
+
+	for (int n = 0; n < 2; n++) {
+		glBindTexture(GL_TEXTURE_2D, pass->tex[n]);
+		glTexImage2D(GL_TEXTURE_2D, 0, format->internal_format, pass->width, pass->height,
+				0, format->format, format->type, NULL);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, pass->fbo[n]);
+		glClearColor(0.0, 0.0, 0.0, 0.0);
+		glClear(GL_COLOR_BUFFER_BIT);
+	}
+}
+
+/* Submit the pass's program, see program_status() for when it's done: */
+static int build_pass(struct pass *pass)
+{
+	char *frag;
+	int ret;
+
+	if (asprintf(&frag, shadertoy_fs_tmpl, pass->src) < 0)
+		return -1;
+
+	ret = create_program(shadertoy_vs, frag);
+	free(frag);
+	if (ret < 0)
+		return -1;
+
+	pass->program = ret;
+	pass->status = 0;
+	glBindAttribLocation(pass->program, 0, "position");
+
+	return link_program_async(pass->program);
+}
+
+int shadertoy_init(const char *path)
+{
+	static const GLubyte black[4] = { 0, 0, 0, 0 };
+	static const GLfloat vertices[] = {
+		-1.0f, -1.0f, 0.0f,
+		 1.0f, -1.0f, 0.0f,
+		-1.0f,  1.0f, 0.0f,
+		 1.0f,  1.0f, 0.0f,
+	};
+
+	stoy.reload.fd = -1;
+
+	if (load_passes(path))
+		return -1;
+
+	schedule_passes();
+
+	/* submit all programs first, so they compile in parallel: */
+	for (unsigned n = 0; n < stoy.num_passes; n++) {
+		if (build_pass(&stoy.passes[stoy.order[n]]))
+			return -1;
+	}
+
+	for (int i = 0; i < IMAGE; i++) {
+		if (stoy.passes[i].used && init_buffer(&stoy.passes[i], pass_names[i]))
+			return -1;
+	}
+
+	if (stoy.num_passes > 1) {
+		printf("Shadertoy passes:");
+		for (unsigned n = 0; n < stoy.num_passes; n++) {
+			struct pass *pass = &stoy.passes[stoy.order[n]];
+			printf(" %s (%ux%u %s)", pass_names[stoy.order[n]],
+					pass->width, pass->height, pass->format->name);
+		}
+		printf("\n");
+	}
+
+	glGenTextures(1, &stoy.black);
+	glBindTexture(GL_TEXTURE_2D, stoy.black);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, black);
+
+	glGenBuffers(1, &stoy.vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, stoy.vbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+
+	return 0;
+}
+
+void shadertoy_size(unsigned *width, unsigned *height)
+{
+	*width = stoy.passes[IMAGE].width;
+	*height = stoy.passes[IMAGE].height;
+}
+
+static float dynres_scale(int level)
+{
+	return 1.0f - level / 8.0f;
+}
+
+float shadertoy_scale(void)
+{
+	return dynres_scale(stoy.dynres.level);
+}
+
+int shadertoy_dynres(const struct egl *egl, int64_t budget_ns)
+{
+	if (!egl->glGenQueriesEXT) {
+		printf("dynamic resolution needs EXT_disjoint_timer_query\n");
+		return -1;
+	}
+
+	stoy.dynres.egl = egl;
+	stoy.dynres.budget_ns = budget_ns;
+
+	egl->glGenQueriesEXT(DYNRES_QUERIES, stoy.dynres.queries);
+	for (int q = 0; q < DYNRES_QUERIES; q++)
+		stoy.dynres.query_level[q] = -1;
+
+	return 0;
+}
+
+/* Needs the program in use: */
+static void set_resolutions(struct pass *pass)
+{
+	glUniform3f(pass->resolution_loc, pass->width, pass->height, 0);
+
+	if (pass->channel_resolution_loc >= 0) {
+		GLfloat res[NUM_CHANNELS][3] = { { 0 } };
+
+		for (int c = 0; c < NUM_CHANNELS; c++) {
+			int src = pass->channel[c];
+			if (src < 0)
+				continue;
+			res[c][0] = stoy.passes[src].width;
+			res[c][1] = stoy.passes[src].height;
+			res[c][2] = 1.0f;
+		}
+		glUniform3fv(pass->channel_resolution_loc, NUM_CHANNELS, &res[0][0]);
+	}
+}
+
+static void resize_passes(void)
+{
+	float scale = dynres_scale(stoy.dynres.level);
+
+	for (int i = 0; i < NUM_PASSES; i++) {
+		struct pass *pass = &stoy.passes[i];
+
+		if (!pass->used)
+			continue;
+
+		pass->width = MAX2(1, (int)(pass->base_width * scale + 0.5f));
+		pass->height = MAX2(1, (int)(pass->base_height * scale + 0.5f));
+
+		if (i != IMAGE)
+			resize_buffer(pass);
+	}
+
+	for (unsigned n = 0; n < stoy.num_passes; n++) {
+		struct pass *pass = &stoy.passes[stoy.order[n]];
+
+		glUseProgram(pass->program);
+		set_resolutions(pass);
+	}
+}
+
+/* Feed the gpu time of a frame to the controller, true if the
+ * resolution needs to change:
+ */
+static bool dynres_sample(int64_t gpu_ns)
+{
+	int level = stoy.dynres.level;
+	float scale = dynres_scale(level);
+	int64_t budget_ns = stoy.dynres.budget_ns;
+	int64_t avg_ns = stoy.dynres.avg_ns;
+
+	avg_ns = avg_ns ? (avg_ns * 7 + gpu_ns) / 8 : gpu_ns;
+	stoy.dynres.avg_ns = avg_ns;
+
+	if (++stoy.dynres.samples < DYNRES_SETTLE)
+		return false;
+
+	/* the cost goes with the pixel count, so down as far as it takes,
+	 * and up one step when that fits with some room to spare:
+	 */
+	if (avg_ns > budget_ns) {
+		while (level < DYNRES_LEVELS - 1) {
+			float s = dynres_scale(++level);
+			if (avg_ns * (s * s) / (scale * scale) <= budget_ns)
+				break;
+		}
+	} else if (level > 0) {
+		float s = dynres_scale(level - 1);
+		if (avg_ns * (s * s) / (scale * scale) < budget_ns * 0.8)
+			level--;
+	}
+
+	if (level == stoy.dynres.level)
+		return false;
+
+	stoy.dynres.level = level;
+	stoy.dynres.avg_ns = avg_ns * (dynres_scale(level) * dynres_scale(level)) / (scale * scale);
+	stoy.dynres.samples = 0;
+
+	printf("shadertoy: %.1f ms on the gpu, rendering at %.0f%%\n",
+			(double)avg_ns / 1000000, dynres_scale(level) * 100);
+
+	return true;
+}
+
+static void dynres_begin(void)
+{
+	unsigned q = stoy.dynres.next;
+
+	/* with all queries still in flight, this frame goes untimed: */
+	stoy.dynres.measuring = stoy.dynres.budget_ns && stoy.dynres.query_level[q] < 0;
+	if (stoy.dynres.measuring)
+		stoy.dynres.egl->glBeginQueryEXT(GL_TIME_ELAPSED_EXT, stoy.dynres.queries[q]);
+}
+
+static void dynres_end(void)
+{
+	const struct egl *egl = stoy.dynres.egl;
+	bool resize = false;
+
+	if (!stoy.dynres.budget_ns)
+		return;
+
+	if (stoy.dynres.measuring) {
+		egl->glEndQueryEXT(GL_TIME_ELAPSED_EXT);
+		stoy.dynres.query_level[stoy.dynres.next] = stoy.dynres.level;
+		stoy.dynres.next = (stoy.dynres.next + 1) % DYNRES_QUERIES;
+	}
+
+	/* the finished ones, oldest first: */
+	for (unsigned n = 0; n < DYNRES_QUERIES; n++) {
+		unsigned q = (stoy.dynres.next + n) % DYNRES_QUERIES;
+		GLuint64 gpu_ns;
+		GLuint available;
+		GLint disjoint;
+
+		if (stoy.dynres.query_level[q] < 0)
+			continue;
+
+		egl->glGetQueryObjectuivEXT(stoy.dynres.queries[q],
+				GL_QUERY_RESULT_AVAILABLE_EXT, &available);
+		if (!available)
+			break;
+
+		egl->glGetQueryObjectui64vEXT(stoy.dynres.queries[q],
+				GL_QUERY_RESULT_EXT, &gpu_ns);
+
+		/* timed at an older resolution, or garbage (eg. after a gpu
+		 * frequency change):
+		 */
+		glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+		if (!disjoint && stoy.dynres.query_level[q] == stoy.dynres.level)
+			resize |= dynres_sample(gpu_ns);
+
+		stoy.dynres.query_level[q] = -1;
+	}
+
+	if (resize)
+		resize_passes();
+}
+
+static void init_uniforms(struct pass *pass)
+{
+	GLuint program = pass->program;
+
+	pass->time_loc = glGetUniformLocation(program, "iTime");
+	pass->time_delta_loc = glGetUniformLocation(program, "iTimeDelta");
+	pass->frame_loc = glGetUniformLocation(program, "iFrame");
+	pass->resolution_loc = glGetUniformLocation(program, "iResolution");
+	pass->channel_resolution_loc = glGetUniformLocation(program, "iChannelResolution");
+
+	glUseProgram(program);
+
+	for (int c = 0; c < NUM_CHANNELS; c++) {
+		char name[] = "iChannel0";
+
+		name[8] += c;
+		pass->channel_loc[c] = glGetUniformLocation(program, name);
+		glUniform1i(pass->channel_loc[c], c);
+	}
+
+	/* these only change with the resolution: */
+	set_resolutions(pass);
+}
+
+static void reload_cancel(void)
+{
+	for (int i = 0; i < NUM_PASSES; i++) {
+		struct pass *pending = &stoy.reload.pending[i];
+
+		if (pending->program)
+			delete_program(pending->program);
+		free(pending->src);
+		memset(pending, 0, sizeof(*pending));
+	}
+
+	stoy.reload.building = 0;
+}
+
+/* Read and submit the changed passes, keeping their size and format: */
+static void reload_start(unsigned passes)
+{
+	char file[512];
+
+	stoy.reload.start_ns = get_time_ns();
+
+	for (int i = 0; i < NUM_PASSES; i++) {
+		struct pass *pending = &stoy.reload.pending[i];
+		const char *name;
+
+		if (!(passes & (1 << i)))
+			continue;
+
+		name = pass_file(i, file, sizeof(file));
+		pending->src = read_file(name);
+		if (!pending->src) {
+			printf("could not read '%s': %s\n", name, strerror(errno));
+			break;
+		}
+
+		for (int c = 0; c < NUM_CHANNELS; c++)
+			pending->channel[c] = -1;
+
+		if (parse_directives(pending, pass_names[i]) ||
+		    check_channels(pending, pass_names[i]) ||
+		    build_pass(pending))
+			break;
+
+		stoy.reload.building |= 1 << i;
+	}
+
+	if (stoy.reload.building != passes) {
+		printf("shadertoy: keeping the old programs\n");
+		reload_cancel();
+	}
+}
+
+/* Swap in the new programs once all of them are built: */
+static void reload_poll(void)
+{
+	unsigned passes = stoy.reload.building;
+	char names[64] = "";
+	bool failed = false, building = false;
+
+	/* another change before the last one built starts it over: */
+	if (stoy.reload.dirty) {
+		passes |= stoy.reload.dirty;
+		stoy.reload.dirty = 0;
+		reload_cancel();
+		reload_start(passes);
+		return;
+	}
+
+	if (!passes)
+		return;
+
+	for (int i = 0; i < NUM_PASSES; i++) {
+		struct pass *pending = &stoy.reload.pending[i];
+
+		if (!(passes & (1 << i)))
+			continue;
+
+		/* the status is kept, so errors are only printed once: */
+		if (pending->status == 0) {
+			pending->status = program_status(pending->program, false);
+			if (pending->status < 0)
+				printf("%s: failed to build\n", pass_names[i]);
+		}
+
+		failed |= pending->status < 0;
+		building |= pending->status == 0;
+	}
+
+	/* no need to wait for the rest: */
+	if (failed) {
+		printf("shadertoy: keeping the old programs\n");
+		reload_cancel();
+		return;
+	}
+
+	if (building)
+		return;
+
+	for (int i = 0; i < NUM_PASSES; i++) {
+		struct pass *pass = &stoy.passes[i];
+		struct pass *pending = &stoy.reload.pending[i];
+
+		if (!(passes & (1 << i)))
+			continue;
+
+		delete_program(pass->program);
+		free(pass->src);
+
+		pass->src = pending->src;
+		pass->program = pending->program;
+		pass->status = 1;
+		memcpy(pass->channel, pending->channel, sizeof(pass->channel));
+		init_uniforms(pass);
+
+		pending->src = NULL;
+		pending->program = 0;
+
+		strcat(names, " ");
+		strcat(names, pass_names[i]);
+	}
+
+	reload_cancel();
+
+	/* the channels may have changed: */
+	schedule_passes();
+
+	/* a broken pass may just have been fixed, and the rest is checked
+	 * again by shadertoy_ready():
+	 */
+	stoy.failed = false;
+
+	printf("shadertoy: reloaded%s in %.1f ms\n", names,
+			(double)(get_time_ns() - stoy.reload.start_ns) / 1000000);
+}
+
+static int watch_event(struct evloop *loop, int fd, void *data)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+
+	(void)loop; (void)data;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + len; ) {
+			const struct inotify_event *ev = (const void *)p;
+
+			p += sizeof(*ev) + ev->len;
+			if (!ev->len)
+				continue;
+
+			for (int i = 0; i < NUM_PASSES; i++) {
+				char file[512];
+				const char *name = pass_file(i, file, sizeof(file));
+				const char *slash;
+
+				if (!name)
+					continue;
+
+				slash = strrchr(name, '/');
+				if (strcmp(ev->name, slash ? slash + 1 : name))
+					continue;
+
+				if (stoy.passes[i].used)
+					stoy.reload.dirty |= 1 << i;
+				else
+					printf("shadertoy: new pass %s needs a restart\n", pass_names[i]);
+			}
+		}
+	}
+
+	return 0;
+}
+
+int shadertoy_watch(struct evloop *loop)
+{
+	char *dir;
+	int fd, ret;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		printf("failed to create inotify: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* the directory, since editors tend to replace files on save: */
+	if (stoy.dir) {
+		dir = strdup(stoy.path);
+	} else {
+		const char *slash = strrchr(stoy.path, '/');
+		dir = slash ? strndup(stoy.path, MAX2(1, slash - stoy.path)) : strdup(".");
+	}
+
+	ret = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (ret < 0)
+		printf("could not watch '%s': %s\n", dir, strerror(errno));
+	free(dir);
+
+	if (ret < 0 || evloop_add_fd(loop, fd, watch_event, NULL) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	stoy.reload.fd = fd;
+
+	return 0;
+}
+
+bool shadertoy_ready(void)
+{
+	reload_poll();
+
+	if (stoy.ready || stoy.failed)
+		return stoy.ready;
+
+	stoy.ready = true;
+
+	for (unsigned n = 0; n < stoy.num_passes; n++) {
+		struct pass *pass = &stoy.passes[stoy.order[n]];
+
+		if (pass->status > 0)
+			continue;
+
+		pass->status = program_status(pass->program, false);
+		if (pass->status < 0) {
+			printf("%s: failed to build\n", pass_names[stoy.order[n]]);
+			stoy.failed = true;
+		}
+		if (pass->status <= 0) {
+			stoy.ready = false;
+			continue;
+		}
+
+		init_uniforms(pass);
+	}
+
+	if (stoy.failed)
+		stoy.ready = false;
+
+	return stoy.ready;
+}
+
+void shadertoy_fini(void)
+{
+	if (stoy.reload.fd >= 0)
+		close(stoy.reload.fd);
+	stoy.reload.fd = -1;
+
+	reload_cancel();
+}
+
+void shadertoy_render(int64_t time_ns)
+{
+	GLenum mrt_bufs[] = {GL_COLOR_ATTACHMENT0};
+	float time = (double)time_ns / NSEC_PER_SEC;
+	float time_delta = 0.0f;
+	GLint target;
+
+	if (stoy.frame > 0)
+		time_delta = (double)(time_ns - stoy.last_time_ns) / NSEC_PER_SEC;
+
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &target);
+
+	dynres_begin();
+
+	glBindBuffer(GL_ARRAY_BUFFER, stoy.vbo);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (const GLvoid *)(intptr_t)0);
+	glEnableVertexAttribArray(0);
+
+	for (unsigned n = 0; n < stoy.num_passes; n++) {
+		struct pass *pass = &stoy.passes[stoy.order[n]];
+		bool image = stoy.order[n] == IMAGE;
+
+		/* a buffer renders into the older of its pair, so reading
+		 * its own output gets the previous frame's:
+		 */
+		if (image) {
+			glBindFramebuffer(GL_FRAMEBUFFER, target);
+			glDrawBuffers(1, mrt_bufs);
+		} else {
+			glBindFramebuffer(GL_FRAMEBUFFER, pass->fbo[!pass->cur]);
+		}
+		glViewport(0, 0, pass->width, pass->height);
+
+		glUseProgram(pass->program);
+		glUniform1f(pass->time_loc, time);
+		glUniform1f(pass->time_delta_loc, time_delta);
+		glUniform1i(pass->frame_loc, stoy.frame);
+
+		for (int c = 0; c < NUM_CHANNELS; c++) {
+			int src = pass->channel[c];
+
+			glActiveTexture(GL_TEXTURE0 + c);
+			if (src >= 0)
+				glBindTexture(GL_TEXTURE_2D, stoy.passes[src].tex[stoy.passes[src].cur]);
+			else
+				glBindTexture(GL_TEXTURE_2D, stoy.black);
+		}
+
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+		if (!image)
+			pass->cur = !pass->cur;
+	}
+
+	glActiveTexture(GL_TEXTURE0);
+	glDisableVertexAttribArray(0);
+
+	/* a new resolution applies from the next frame on: */
+	dynres_end();
+	glBindFramebuffer(GL_FRAMEBUFFER, target);
+
+	stoy.frame++;
+	stoy.last_time_ns = time_ns;
+}
@@ -0,0 +1,87 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _SHADERTOY_H
+#define _SHADERTOY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct egl;
+struct evloop;
+
+/* Shadertoy render graph, for the shadertoy mode.
+ *
+ * The shadertoy is either a single file, which is the Image pass, or a
+ * directory with image.glsl and, optionally, bufa.glsl to bufd.glsl for
+ * Buffer A to D.  Like on shadertoy.com, each buffer pass renders into
+ * its own texture (a pair, ping-ponged, so a pass can read its own
+ * output from the previous frame), and every pass can read up to four
+ * of them as iChannel0..3.  Passes that others read are rendered first,
+ * so those see this frame's output, and on a cycle the rest of it gets
+ * the previous frame's.
+ *
+ * Channels and buffer setup are comment lines in each pass's source:
+ *
+ *   // iChannel0: bufa         (bufa to bufd, or none)
+ *   // format: rgba16f         (rgb8, rgba8 or rgba16f, buffers only)
+ *   // size: 1024x1024         (default: the Image pass size)
+ *
+ * The Image pass size (512x512 by default) can be set the same way, and
+ * is what the cube gets as its texture.
+ */
+
+int shadertoy_init(const char *path);
+
+/* Hot reload: passes whose source changes on disk are rebuilt in the
+ * background, and swapped in together once all of them are built.  If
+ * one fails, the old programs stay.  Channels are reparsed, but size
+ * and format changes, and new passes, take a restart.
+ */
+int shadertoy_watch(struct evloop *loop);
+
+/* Stop watching, and drop a reload still in progress.  The event loop
+ * is finished by then, and does not close the watch fd itself:
+ */
+void shadertoy_fini(void);
+
+/* The Image pass size, which changes with dynamic resolution: */
+void shadertoy_size(unsigned *width, unsigned *height);
+
+/* Dynamic resolution: time the passes on the gpu (with
+ * EXT_disjoint_timer_query), and render all of them at a lower
+ * resolution while they take more than budget_ns a frame, back up
+ * when there is room for it again.  Buffers are cleared when resized.
+ */
+int shadertoy_dynres(const struct egl *egl, int64_t budget_ns);
+
+/* Current resolution, relative to the configured one: */
+float shadertoy_scale(void);
+
+/* All programs built, polled without waiting for the compiler: */
+bool shadertoy_ready(void);
+
+/* Render the buffer passes, then the Image pass into the framebuffer
+ * bound when called:
+ */
+void shadertoy_render(int64_t time_ns);
+
+#endif /* _SHADERTOY_H */
@@ -0,0 +1,84 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _SPSC_QUEUE_H
+#define _SPSC_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Lock-free single-producer/single-consumer ring of pointers.  One thread
+ * may push and one (other) thread may pop without any locking; the head
+ * is only written by the consumer and the tail only by the producer.
+ *
+ * The queue does not block, users pair it with an eventfd (or similar)
+ * to wake up the other side.
+ */
+
+#define SPSC_QUEUE_SIZE 16   /* must be a power of two */
+
+struct spsc_queue {
+	void *entries[SPSC_QUEUE_SIZE];
+	unsigned head;   /* next entry to pop, written by consumer */
+	unsigned tail;   /* next entry to push, written by producer */
+};
+
+static inline void spsc_queue_init(struct spsc_queue *q)
+{
+	q->head = q->tail = 0;
+}
+
+static inline bool spsc_queue_push(struct spsc_queue *q, void *entry)
+{
+	unsigned tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	unsigned head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+	if (tail - head == SPSC_QUEUE_SIZE)
+		return false;
+
+	q->entries[tail & (SPSC_QUEUE_SIZE - 1)] = entry;
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+static inline void * spsc_queue_pop(struct spsc_queue *q)
+{
+	unsigned head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	unsigned tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	void *entry;
+
+	if (head == tail)
+		return NULL;
+
+	entry = q->entries[head & (SPSC_QUEUE_SIZE - 1)];
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+	return entry;
+}
+
+static inline bool spsc_queue_empty(struct spsc_queue *q)
+{
+	return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) ==
+		__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+}
+
+#endif /* _SPSC_QUEUE_H */
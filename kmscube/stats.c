@@ -0,0 +1,272 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/sync_file.h>
+
+#include "common.h"
+#include "evloop.h"
+#include "stats.h"
+
+/* Values below 2^SUB_BITS get a bucket each, above that every power
+ * of two range is split in 2^SUB_BITS buckets:
+ */
+#define SUB_BITS    5
+#define SUB_COUNT   (1 << SUB_BITS)
+#define NUM_BUCKETS ((64 - SUB_BITS) * SUB_COUNT)
+
+struct histogram {
+	uint64_t counts[NUM_BUCKETS];
+	uint64_t count;
+	int64_t min, max;
+	double sum;
+};
+
+enum stage {
+	STAGE_CPU,                 /* draw_start -> draw_end */
+	STAGE_GPU,                 /* draw_start -> gpu_done */
+	STAGE_QUEUE,               /* draw_end -> commit */
+	STAGE_FLIP,                /* commit -> flip */
+	STAGE_LATENCY,             /* draw_start -> flip */
+	STAGE_INTERVAL,            /* flip -> next flip */
+	STAGE_COUNT
+};
+
+static const char * const stage_names[STAGE_COUNT] = {
+	[STAGE_CPU]      = "cpu",
+	[STAGE_GPU]      = "gpu",
+	[STAGE_QUEUE]    = "queue",
+	[STAGE_FLIP]     = "flip",
+	[STAGE_LATENCY]  = "latency",
+	[STAGE_INTERVAL] = "interval",
+};
+
+static struct {
+	const char *filename;
+	struct histogram hist[STAGE_COUNT];
+	int64_t last_flip;
+} stats;
+
+static unsigned bucket_index(uint64_t v)
+{
+	unsigned msb;
+
+	if (v < SUB_COUNT)
+		return v;
+
+	msb = 63 - __builtin_clzll(v);
+
+	return (msb - SUB_BITS + 1) * SUB_COUNT +
+			((v >> (msb - SUB_BITS)) - SUB_COUNT);
+}
+
+/* highest value that lands in the bucket: */
+static uint64_t bucket_value(unsigned idx)
+{
+	unsigned msb;
+
+	if (idx < SUB_COUNT)
+		return idx;
+
+	msb = idx / SUB_COUNT + SUB_BITS - 1;
+
+	return (((uint64_t)(idx % SUB_COUNT + SUB_COUNT + 1)) << (msb - SUB_BITS)) - 1;
+}
+
+static void hist_add(struct histogram *h, int64_t v)
+{
+	v = MAX2(v, 0);
+
+	if (!h->count || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+
+	h->counts[bucket_index(v)]++;
+	h->count++;
+	h->sum += v;
+}
+
+static int64_t hist_percentile(const struct histogram *h, double p)
+{
+	uint64_t rank = p / 100.0 * h->count + 0.5;
+	uint64_t seen = 0;
+
+	rank = MAX2(rank, 1);
+
+	for (unsigned i = 0; i < NUM_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= rank)
+			return MIN2((int64_t)bucket_value(i), h->max);
+	}
+
+	return h->max;
+}
+
+void stats_init(const char *filename)
+{
+	memset(&stats, 0, sizeof(stats));
+	stats.filename = filename;
+}
+
+void stats_add(const struct frame_times *t)
+{
+	hist_add(&stats.hist[STAGE_CPU], t->draw_end - t->draw_start);
+	hist_add(&stats.hist[STAGE_GPU], t->gpu_done - t->draw_start);
+	hist_add(&stats.hist[STAGE_QUEUE], t->commit - t->draw_end);
+	hist_add(&stats.hist[STAGE_FLIP], t->flip - t->commit);
+	hist_add(&stats.hist[STAGE_LATENCY], t->flip - t->draw_start);
+
+	if (stats.last_flip)
+		hist_add(&stats.hist[STAGE_INTERVAL], t->flip - stats.last_flip);
+	stats.last_flip = t->flip;
+}
+
+#define MS(ns) ((double)(ns) / (NSEC_PER_SEC / MSEC_PER_SEC))
+
+static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+
+static void write_csv(FILE *f)
+{
+	fprintf(f, "stage,count,min_ms,mean_ms,p50_ms,p90_ms,p99_ms,p99.9_ms,max_ms\n");
+
+	for (unsigned s = 0; s < STAGE_COUNT; s++) {
+		const struct histogram *h = &stats.hist[s];
+
+		if (!h->count)
+			continue;
+
+		fprintf(f, "%s,%"PRIu64",%.3f,%.3f", stage_names[s], h->count,
+				MS(h->min), MS(h->sum / h->count));
+		for (unsigned i = 0; i < ARRAY_SIZE(percentiles); i++)
+			fprintf(f, ",%.3f", MS(hist_percentile(h, percentiles[i])));
+		fprintf(f, ",%.3f\n", MS(h->max));
+	}
+}
+
+static void write_json(FILE *f)
+{
+	bool first = true;
+
+	fprintf(f, "{\n");
+
+	for (unsigned s = 0; s < STAGE_COUNT; s++) {
+		const struct histogram *h = &stats.hist[s];
+
+		if (!h->count)
+			continue;
+
+		fprintf(f, "%s  \"%s\": {\"count\": %"PRIu64", \"min_ms\": %.3f, \"mean_ms\": %.3f",
+				first ? "" : ",\n", stage_names[s], h->count,
+				MS(h->min), MS(h->sum / h->count));
+		fprintf(f, ", \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"p99.9_ms\": %.3f",
+				MS(hist_percentile(h, 50.0)), MS(hist_percentile(h, 90.0)),
+				MS(hist_percentile(h, 99.0)), MS(hist_percentile(h, 99.9)));
+		fprintf(f, ", \"max_ms\": %.3f}", MS(h->max));
+		first = false;
+	}
+
+	fprintf(f, "\n}\n");
+}
+
+static void print_summary(void)
+{
+	printf("Frame timing (ms):   p50      p90      p99    p99.9      max\n");
+
+	for (unsigned s = 0; s < STAGE_COUNT; s++) {
+		const struct histogram *h = &stats.hist[s];
+
+		if (!h->count)
+			continue;
+
+		printf("  %-10s", stage_names[s]);
+		for (unsigned i = 0; i < ARRAY_SIZE(percentiles); i++)
+			printf(" %8.3f", MS(hist_percentile(h, percentiles[i])));
+		printf(" %8.3f\n", MS(h->max));
+	}
+}
+
+void stats_dump(void)
+{
+	const char *ext;
+	FILE *f;
+
+	print_summary();
+
+	if (!stats.filename)
+		return;
+
+	f = fopen(stats.filename, "w");
+	if (!f) {
+		printf("could not open %s: %s\n", stats.filename, strerror(errno));
+		return;
+	}
+
+	ext = strrchr(stats.filename, '.');
+	if (ext && strcmp(ext, ".json") == 0)
+		write_json(f);
+	else
+		write_csv(f);
+
+	fclose(f);
+
+	printf("Wrote frame statistics to %s\n", stats.filename);
+}
+
+static int dump_signal(struct evloop *loop, int fd, void *data)
+{
+	(void)loop; (void)fd; (void)data;
+	stats_dump();
+	return 0;
+}
+
+int stats_add_signal(struct evloop *loop)
+{
+	if (evloop_add_signal(loop, SIGUSR1, dump_signal, NULL) < 0)
+		return -1;
+	return 0;
+}
+
+int64_t fence_signal_time(int fd)
+{
+	struct sync_fence_info fences[4] = {};
+	struct sync_file_info info = {};
+	int64_t t = 0;
+
+	/* the first call just gets the number of fences: */
+	if (ioctl(fd, SYNC_IOC_FILE_INFO, &info) < 0 || info.status != 1 ||
+	    info.num_fences > ARRAY_SIZE(fences))
+		return 0;
+
+	info.sync_fence_info = (uint64_t)(uintptr_t)fences;
+	if (ioctl(fd, SYNC_IOC_FILE_INFO, &info) < 0)
+		return 0;
+
+	for (unsigned i = 0; i < info.num_fences; i++)
+		t = MAX2(t, (int64_t)fences[i].timestamp_ns);
+
+	return t;
+}
@@ -0,0 +1,57 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdint.h>
+
+struct evloop;
+
+/* Per-frame stage timing.  Each completed frame's timestamps are added
+ * to log-linear (HDR style) histograms, one per stage, with ~3% value
+ * precision from nanoseconds to minutes in fixed memory, so the tail
+ * percentiles cost nothing per frame.  The summary is printed at exit,
+ * and written as CSV (or JSON, for a .json filename) with --stats,
+ * also on SIGUSR1.
+ */
+
+struct frame_times {
+	int64_t draw_start;        /* rendering started */
+	int64_t draw_end;          /* rendering submitted */
+	int64_t gpu_done;          /* gpu fence signaled, draw_end without fences */
+	int64_t commit;            /* handed to kms */
+	int64_t flip;              /* on screen */
+};
+
+void stats_init(const char *filename);
+void stats_add(const struct frame_times *t);
+
+/* Dump on SIGUSR1, which main() blocks, see evloop_block_signals(): */
+int stats_add_signal(struct evloop *loop);
+
+/* Print the summary, and write the stats file if there is one: */
+void stats_dump(void);
+
+/* Get the time a sync_file fence signaled at, 0 if it didn't (yet): */
+int64_t fence_signal_time(int fd);
+
+#endif /* _STATS_H */
@@ -702,9 +702,9 @@ static void write_png_file(char *filename, int width, int height, uint8_t *buffe
 
 static bool needs_check = true;
 
-static void draw_and_check_quads(unsigned frame)
+static void draw_and_check_quads(unsigned frame, int64_t time_ns)
 {
-	(void)frame;
+	(void)frame; (void)time_ns;
 
 	update_texture();
 
@@ -950,14 +950,14 @@ int main(int argc, char *argv[])
 	print_summary();
 
 	/* no real need for atomic here: */
-	drm = init_drm_legacy(device, mode_str, vrefresh, ~0);
+	drm = init_drm_legacy(device, mode_str, vrefresh, ~0, false);
 	if (!drm) {
 		printf("failed to initialize DRM\n");
 		return -1;
 	}
 
 	gbm = init_gbm(drm->fd, drm->mode->hdisplay, drm->mode->vdisplay,
-			DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR, false);
+			DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR, false, NUM_BUFFERS);
 	if (!gbm) {
 		printf("failed to initialize GBM\n");
 		return -1;
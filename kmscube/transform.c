@@ -0,0 +1,113 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "transform.h"
+
+/* sin/cos for 4096 steps of a full turn.  In between, the remaining
+ * angle is less than 0.0016 rad, small enough for the first terms of
+ * the series to be exact at float precision:
+ */
+#define TABLE_SIZE 4096
+
+static struct {
+	bool initialized;
+	float sin[TABLE_SIZE], cos[TABLE_SIZE];
+} table;
+
+static void init_table(void)
+{
+	if (table.initialized)
+		return;
+
+	for (unsigned i = 0; i < TABLE_SIZE; i++) {
+		double rad = i * 2.0 * M_PI / TABLE_SIZE;
+		table.sin[i] = sin(rad);
+		table.cos[i] = cos(rad);
+	}
+
+	table.initialized = true;
+}
+
+static void table_sincos(float degrees, float *s, float *c)
+{
+	double steps = (double)degrees * (TABLE_SIZE / 360.0);
+	double whole = floor(steps);
+	double e = (steps - whole) * (2.0 * M_PI / TABLE_SIZE);
+	/* the table size is a power of two, so this wraps negative angles too: */
+	unsigned i = (int64_t)whole & (TABLE_SIZE - 1);
+	double se = e - e * e * e / 6.0;
+	double ce = 1.0 - e * e / 2.0;
+
+	*s = table.sin[i] * ce + table.cos[i] * se;
+	*c = table.cos[i] * ce - table.sin[i] * se;
+}
+
+void transform_modelview(ESMatrix *modelview, float t, float scale,
+		float x, float y, float z)
+{
+	float sx, cx, sy, cy, sz, cz;
+	GLfloat (*m)[4] = modelview->m;
+
+	init_table();
+
+	/* the same angles as the esRotate() calls this replaces: */
+	table_sincos(45.0f + (0.25f * t), &sx, &cx);
+	table_sincos(45.0f - (0.5f * t), &sy, &cy);
+	table_sincos(10.0f + (0.15f * t), &sz, &cz);
+
+	/* Rz * Ry * Rx, in esRotate()'s convention, times scale: */
+	m[0][0] = scale * (cz * cy);
+	m[0][1] = scale * (cz * sy * sx - sz * cx);
+	m[0][2] = scale * (cz * sy * cx + sz * sx);
+	m[0][3] = 0.0f;
+
+	m[1][0] = scale * (sz * cy);
+	m[1][1] = scale * (sz * sy * sx + cz * cx);
+	m[1][2] = scale * (sz * sy * cx - cz * sx);
+	m[1][3] = 0.0f;
+
+	m[2][0] = scale * -sy;
+	m[2][1] = scale * (cy * sx);
+	m[2][2] = scale * (cy * cx);
+	m[2][3] = 0.0f;
+
+	m[3][0] = x;
+	m[3][1] = y;
+	m[3][2] = z;
+	m[3][3] = 1.0f;
+}
+
+void transform_init(struct transform *xf, float size, float aspect)
+{
+	esMatrixLoadIdentity(&xf->projection);
+	esFrustum(&xf->projection, -size, +size, -size * aspect, +size * aspect, 6.0f, 10.0f);
+}
+
+void transform_update(struct transform *xf, float t)
+{
+	transform_modelview(&xf->modelview, t, 1.0f, 0.0f, 0.0f, -8.0f);
+	esMatrixMultiply(&xf->modelviewprojection, &xf->modelview, &xf->projection);
+	esNormalMatrix(xf->normal, &xf->modelview);
+}
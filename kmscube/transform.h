@@ -0,0 +1,59 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _TRANSFORM_H
+#define _TRANSFORM_H
+
+#include "esUtil.h"
+
+/* The cube animation, shared by the cube modes.
+ *
+ * The cube turns about x, y and z at 0.25, -0.5 and 0.15 degrees per
+ * animation step (see anim_step()).  Rather than three esRotate() on
+ * an identity matrix per frame, each with its own sin/cos and matrix
+ * multiply, the sines and cosines come from a table and the rotations
+ * are combined directly into the modelview.  The projection is set up
+ * once, and modelview, modelviewprojection and normal matrix are all
+ * produced by transform_update().
+ */
+
+struct transform {
+	ESMatrix projection;
+	ESMatrix modelview;
+	ESMatrix modelviewprojection;
+	GLfloat normal[9];
+};
+
+/* A frustum from -size to +size horizontally (aspect is height / width),
+ * with the cube 8 units away:
+ */
+void transform_init(struct transform *xf, float size, float aspect);
+
+/* For animation step t: */
+void transform_update(struct transform *xf, float t);
+
+/* Just the modelview of a cube at animation step t, scaled by scale and
+ * then moved to (x, y, z):
+ */
+void transform_modelview(ESMatrix *modelview, float t, float scale,
+		float x, float y, float z);
+
+#endif /* _TRANSFORM_H */
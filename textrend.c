@@ -200,7 +200,40 @@ static float coords[] = {
 
 /*
 Just a boilerplate shader builder helper.
+Both shaders are submitted before asking for either status, and the
+driver may use threads for it (KHR_parallel_shader_compile), so they
+compile at the same time rather than one after the other.
 */
+/*
+ Let the driver use as many compiler threads as it likes, if it can.
+ Looked up once, with the context current, before the first prog().
+*/
+static void (*max_compiler_threads)(GLuint);
+
+static void init_parallel_compile(void)
+{
+	const char* exts = (const char*)glGetString(GL_EXTENSIONS);
+
+	if(exts && strstr(exts, "GL_KHR_parallel_shader_compile"))
+		max_compiler_threads = (void (*)(GLuint))eglGetProcAddress("glMaxShaderCompilerThreadsKHR");
+
+	if(max_compiler_threads) max_compiler_threads(0xffffffff);
+}
+
+static void log_shader(GLuint shader, const char* name, char** buffer)
+{
+	int n;
+
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &n);
+
+	if(!n){
+		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &n);
+		*buffer = realloc(*buffer, n);
+		glGetShaderInfoLog(shader, n, 0, *buffer);
+		printf("\n### %s ###\n%s\n", name, *buffer);
+	}
+}
+
 unsigned int prog(const char* vertex, const char* fragment)
 {
 	GLuint vert, frag;
@@ -211,38 +244,23 @@ unsigned int prog(const char* vertex, const char* fragment)
 	vert = glCreateShader(GL_VERTEX_SHADER);
 	glShaderSource(vert, 1, &vertex, 0);
 	glCompileShader(vert);
-	glGetShaderiv(vert, GL_COMPILE_STATUS, &n);
-
-	if(!n){
-		glGetShaderiv(vert, GL_INFO_LOG_LENGTH, &n);
-		buffer = realloc(buffer, n);
-		glGetShaderInfoLog(vert, n, 0, buffer);
-		printf("\n### vert ###\n%s\n", buffer);
-	}
-
-	glReleaseShaderCompiler();
 
 	frag = glCreateShader(GL_FRAGMENT_SHADER);
 	glShaderSource(frag, 1, &fragment, 0);
 	glCompileShader(frag);
-	glGetShaderiv(frag, GL_COMPILE_STATUS, &n);
-
-	if(!n){
-		glGetShaderiv(frag, GL_INFO_LOG_LENGTH, &n);
-		buffer = realloc(buffer, n);
-		glGetShaderInfoLog(frag, n, 0, buffer);
-		printf("\n### frag ###\n%s\n", buffer);
-	}
-
-	glReleaseShaderCompiler();
 
 	program = glCreateProgram();
 	glAttachShader(program, vert);
 	glAttachShader(program, frag);
 	glLinkProgram(program);
+
+	/* the first status query is where this waits for the compiler: */
 	glGetProgramiv(program, GL_LINK_STATUS, &n);
 
 	if(!n){
+		log_shader(vert, "vert", &buffer);
+		log_shader(frag, "frag", &buffer);
+
 		glGetProgramiv(program, GL_INFO_LOG_LENGTH, &n);
 		buffer = realloc(buffer, n);
 		glGetProgramInfoLog(program, n, 0, buffer);
@@ -251,6 +269,8 @@ unsigned int prog(const char* vertex, const char* fragment)
 
 	if(buffer) free(buffer);
 
+	glReleaseShaderCompiler();
+
 	glDetachShader(program, vert);
 	glDetachShader(program, frag);
 	glDeleteShader(vert);
@@ -421,6 +441,7 @@ int main(int argc, char **argv) {
 	egl_context = eglCreateContext(egl_disp, egl_conf, EGL_NO_CONTEXT, ctx);
 	eglMakeCurrent(egl_disp, egl_surf, egl_surf, egl_context);
 
+	init_parallel_compile();
 	program = prog(vertex, fragment);
 	glUseProgram(program);
 